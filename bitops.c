@@ -0,0 +1,375 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#include "bitops.h"
+
+#include <string.h>
+#include <stdatomic.h>
+
+#include "utilMacros.h"
+#include "unittestMacros.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define BITOPS_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+// private declarations
+// -----------------------------------------------------------------------------
+typedef uint64_t (*bitsFn_t)(uint64_t val, uint64_t mask);
+typedef size_t (*countFn_t)(const uint64_t *words, size_t wordCount);
+typedef void (*combineFn_t)(uint64_t *dst, const uint64_t *src, size_t wordCount, bitops_combine_t op);
+
+/* Implementations are picked on the first call. Until then the pointers hold the
+   resolve functions; threads racing through them store the same values. */
+static uint64_t pdepResolve(uint64_t val, uint64_t mask);
+static uint64_t pextResolve(uint64_t val, uint64_t mask);
+static size_t popcountArrayResolve(const uint64_t *words, size_t wordCount);
+static void combineArraysResolve(uint64_t *dst, const uint64_t *src, size_t wordCount, bitops_combine_t op);
+static void resolve(void);
+
+static uint64_t pdepPortable(uint64_t val, uint64_t mask);
+static uint64_t pextPortable(uint64_t val, uint64_t mask);
+static size_t popcountArrayPortable(const uint64_t *words, size_t wordCount);
+// also finishes the tails of the vector kernels
+static void combineArraysPortable(uint64_t *dst, const uint64_t *src, size_t wordCount, bitops_combine_t op);
+
+static _Atomic(bitsFn_t) pdepImpl = pdepResolve;
+static _Atomic(bitsFn_t) pextImpl = pextResolve;
+static _Atomic(countFn_t) popcountArrayImpl = popcountArrayResolve;
+static _Atomic(combineFn_t) combineArraysImpl = combineArraysResolve;
+
+// interface functions
+// -----------------------------------------------------------------------------
+uint64_t bitops_pdep(uint64_t val, uint64_t mask) {
+    return atomic_load_explicit(&pdepImpl, memory_order_relaxed)(val, mask);
+}
+
+uint64_t bitops_pext(uint64_t val, uint64_t mask) {
+    return atomic_load_explicit(&pextImpl, memory_order_relaxed)(val, mask);
+}
+
+size_t bitops_scanFirstSet(const uint64_t *words, size_t wordCount) {
+    for (size_t i = 0; i < wordCount; ++i) {
+        if (words[i])
+            return i << 6 | bitops_ctz(words[i]);
+    }
+    return BITOPS_NONE;
+}
+
+size_t bitops_scanFirstClear(const uint64_t *words, size_t wordCount) {
+    for (size_t i = 0; i < wordCount; ++i) {
+        if (~words[i])
+            return i << 6 | bitops_ctz(~words[i]);
+    }
+    return BITOPS_NONE;
+}
+
+size_t bitops_scanNextSet(const uint64_t *words, size_t wordCount, size_t from) {
+    size_t i = from >> 6;
+    if (i >= wordCount)
+        return BITOPS_NONE;
+
+    // bits below from are masked out of the first word
+    uint64_t word = words[i] & (UINT64_MAX << (from & 63));
+    while (!word) {
+        if (++i == wordCount)
+            return BITOPS_NONE;
+        word = words[i];
+    }
+    return i << 6 | bitops_ctz(word);
+}
+
+size_t bitops_popcountArray(const uint64_t *words, size_t wordCount) {
+    return atomic_load_explicit(&popcountArrayImpl, memory_order_relaxed)(words, wordCount);
+}
+
+void bitops_combineArrays(uint64_t *dst, const uint64_t *src, size_t wordCount, bitops_combine_t op) {
+    atomic_load_explicit(&combineArraysImpl, memory_order_relaxed)(dst, src, wordCount, op);
+}
+
+// private functions
+// -----------------------------------------------------------------------------
+#ifdef BITOPS_X86_DISPATCH
+__attribute__((target("bmi2")))
+static uint64_t pdepBmi2(uint64_t val, uint64_t mask) {
+    return _pdep_u64(val, mask);
+}
+
+__attribute__((target("bmi2")))
+static uint64_t pextBmi2(uint64_t val, uint64_t mask) {
+    return _pext_u64(val, mask);
+}
+
+__attribute__((target("popcnt")))
+static size_t popcountArrayPopcnt(const uint64_t *words, size_t wordCount) {
+    size_t result = 0;
+    for (size_t i = 0; i < wordCount; ++i)
+        result += (size_t) __builtin_popcountll(words[i]);
+    return result;
+}
+
+// the op switch sits outside the loops, so each loop is a plain load-op-store stream
+__attribute__((target("avx2")))
+static void combineArraysAvx2(uint64_t *dst, const uint64_t *src, size_t wordCount, bitops_combine_t op) {
+    size_t vectorWordCount = wordCount & ~(size_t) 3;
+    __m256i *d = (__m256i *) dst;
+    const __m256i *s = (const __m256i *) src;
+    switch (op) {
+    case BITOPS_AND:
+        for (size_t i = 0; i < vectorWordCount / 4; ++i)
+            _mm256_storeu_si256(d + i, _mm256_and_si256(_mm256_loadu_si256(d + i), _mm256_loadu_si256(s + i)));
+        break;
+    case BITOPS_OR:
+        for (size_t i = 0; i < vectorWordCount / 4; ++i)
+            _mm256_storeu_si256(d + i, _mm256_or_si256(_mm256_loadu_si256(d + i), _mm256_loadu_si256(s + i)));
+        break;
+    case BITOPS_AND_NOT:
+        for (size_t i = 0; i < vectorWordCount / 4; ++i)
+            _mm256_storeu_si256(d + i, _mm256_andnot_si256(_mm256_loadu_si256(s + i), _mm256_loadu_si256(d + i)));
+        break;
+    }
+    combineArraysPortable(dst + vectorWordCount, src + vectorWordCount, wordCount - vectorWordCount, op);
+}
+
+static void combineArraysSse2(uint64_t *dst, const uint64_t *src, size_t wordCount, bitops_combine_t op) {
+    size_t vectorWordCount = wordCount & ~(size_t) 1;
+    __m128i *d = (__m128i *) dst;
+    const __m128i *s = (const __m128i *) src;
+    switch (op) {
+    case BITOPS_AND:
+        for (size_t i = 0; i < vectorWordCount / 2; ++i)
+            _mm_storeu_si128(d + i, _mm_and_si128(_mm_loadu_si128(d + i), _mm_loadu_si128(s + i)));
+        break;
+    case BITOPS_OR:
+        for (size_t i = 0; i < vectorWordCount / 2; ++i)
+            _mm_storeu_si128(d + i, _mm_or_si128(_mm_loadu_si128(d + i), _mm_loadu_si128(s + i)));
+        break;
+    case BITOPS_AND_NOT:
+        for (size_t i = 0; i < vectorWordCount / 2; ++i)
+            _mm_storeu_si128(d + i, _mm_andnot_si128(_mm_loadu_si128(s + i), _mm_loadu_si128(d + i)));
+        break;
+    }
+    combineArraysPortable(dst + vectorWordCount, src + vectorWordCount, wordCount - vectorWordCount, op);
+}
+#endif
+
+static void resolve(void) {
+    bitsFn_t pdep = pdepPortable;
+    bitsFn_t pext = pextPortable;
+    countFn_t popcountArray = popcountArrayPortable;
+    combineFn_t combineArrays = combineArraysPortable;
+#ifdef BITOPS_X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("bmi2")) {
+        pdep = pdepBmi2;
+        pext = pextBmi2;
+    }
+    if (__builtin_cpu_supports("popcnt"))
+        popcountArray = popcountArrayPopcnt;
+    combineArrays = __builtin_cpu_supports("avx2") ? combineArraysAvx2 : combineArraysSse2;
+#endif
+    atomic_store_explicit(&pdepImpl, pdep, memory_order_relaxed);
+    atomic_store_explicit(&pextImpl, pext, memory_order_relaxed);
+    atomic_store_explicit(&popcountArrayImpl, popcountArray, memory_order_relaxed);
+    atomic_store_explicit(&combineArraysImpl, combineArrays, memory_order_relaxed);
+}
+
+static uint64_t pdepResolve(uint64_t val, uint64_t mask) {
+    resolve();
+    return bitops_pdep(val, mask);
+}
+
+static uint64_t pextResolve(uint64_t val, uint64_t mask) {
+    resolve();
+    return bitops_pext(val, mask);
+}
+
+static size_t popcountArrayResolve(const uint64_t *words, size_t wordCount) {
+    resolve();
+    return bitops_popcountArray(words, wordCount);
+}
+
+static void combineArraysResolve(uint64_t *dst, const uint64_t *src, size_t wordCount, bitops_combine_t op) {
+    resolve();
+    bitops_combineArrays(dst, src, wordCount, op);
+}
+
+static uint64_t pdepPortable(uint64_t val, uint64_t mask) {
+    uint64_t result = 0;
+    for (uint64_t bit = 1; mask; bit <<= 1) {
+        uint64_t lowestMaskBit = mask & ~(mask - 1);
+        if (val & bit)
+            result |= lowestMaskBit;
+        mask ^= lowestMaskBit;
+    }
+    return result;
+}
+
+static uint64_t pextPortable(uint64_t val, uint64_t mask) {
+    uint64_t result = 0;
+    for (uint64_t bit = 1; mask; bit <<= 1) {
+        uint64_t lowestMaskBit = mask & ~(mask - 1);
+        if (val & lowestMaskBit)
+            result |= bit;
+        mask ^= lowestMaskBit;
+    }
+    return result;
+}
+
+static size_t popcountArrayPortable(const uint64_t *words, size_t wordCount) {
+    size_t result = 0;
+    for (size_t i = 0; i < wordCount; ++i)
+        result += bitops_popcount(words[i]);
+    return result;
+}
+
+static void combineArraysPortable(uint64_t *dst, const uint64_t *src, size_t wordCount, bitops_combine_t op) {
+    switch (op) {
+    case BITOPS_AND:
+        for (size_t i = 0; i < wordCount; ++i)
+            dst[i] &= src[i];
+        break;
+    case BITOPS_OR:
+        for (size_t i = 0; i < wordCount; ++i)
+            dst[i] |= src[i];
+        break;
+    case BITOPS_AND_NOT:
+        for (size_t i = 0; i < wordCount; ++i)
+            dst[i] &= ~src[i];
+        break;
+    }
+}
+
+// unittest
+// -----------------------------------------------------------------------------
+#ifdef UNITTEST
+
+int bitopsFindFirstSet(void) {
+    ASSERT(bitops_findFirstSet(0) == -1);
+    ASSERT(bitops_findFirstSet(0x0F00) == 8);
+    ASSERT(bitops_findFirstSet(0x10000000) == 28);
+    ASSERT(bitops_findFirstSet(0x80000000) == 31);
+    ASSERT(bitops_findFirstSet(0x100000000) == 32);
+    ASSERT(bitops_findFirstSet(0x8000000000000000) == 63);
+    ASSERT(bitops_ctz(0x0F00) == 8);
+    return 0;
+}
+
+int bitopsFindLastSet(void) {
+    ASSERT(bitops_findLastSet(0) == -1);
+    ASSERT(bitops_findLastSet(1 << 0) == 0);
+    ASSERT(bitops_findLastSet(1 << 1) == 1);
+    ASSERT(bitops_findLastSet(1 << 15) == 15);
+    ASSERT(bitops_findLastSet(0x5555) == 14);
+    ASSERT(bitops_findLastSet(0xAAAA) == 15);
+    ASSERT(bitops_findLastSet(UINT64_MAX) == 63);
+    ASSERT(bitops_clz(1) == 63);
+    return 0;
+}
+
+int bitopsPopcount(void) {
+    ASSERT(bitops_popcount(0) == 0);
+    ASSERT(bitops_popcount(0xF0F0) == 8);
+    ASSERT(bitops_popcount(UINT64_MAX) == 64);
+    uint64_t x = 0x9E3779B97F4A7C15u;
+    for (int i = 0; i < 1000; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        unsigned int expected = 0;
+        for (uint64_t v = x; v; v &= v - 1)
+            ++expected;
+        ASSERT(bitops_popcount(x) == expected);
+    }
+    return 0;
+}
+
+int bitopsPdepPext(void) {
+    ASSERT(bitops_pdep(0x5, 0xF0) == 0x50);
+    ASSERT(bitops_pdep(0x3, 0x8000000000000001) == 0x8000000000000001);
+    ASSERT(bitops_pext(0x50, 0xF0) == 0x5);
+    ASSERT(bitops_pext(UINT64_MAX, 0xF00F) == 0xFF);
+
+    // dispatched and portable versions agree
+    uint64_t x = 0x9E3779B97F4A7C15;
+    for (int i = 0; i < 1000; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        uint64_t mask = x * 0xD6E8FEB86659FD93;
+        ASSERT(bitops_pdep(x, mask) == pdepPortable(x, mask));
+        ASSERT(bitops_pext(x, mask) == pextPortable(x, mask));
+        unsigned int maskBitCount = bitops_popcount(mask);
+        uint64_t lowBits = maskBitCount == 64 ? x : x & (((uint64_t) 1 << maskBitCount) - 1);
+        ASSERT(bitops_pext(bitops_pdep(x, mask), mask) == lowBits);
+    }
+    return 0;
+}
+
+int bitopsScanFirstSetAndClear(void) {
+    uint64_t words[4] = { 0 };
+    ASSERT(bitops_scanFirstSet(words, 4) == BITOPS_NONE);
+    words[2] = 0x100;
+    ASSERT(bitops_scanFirstSet(words, 4) == 2 * 64 + 8);
+    ASSERT(bitops_scanFirstSet(words, 2) == BITOPS_NONE);
+
+    uint64_t full[3] = { UINT64_MAX, UINT64_MAX, UINT64_MAX & ~(uint64_t) 0x10 };
+    ASSERT(bitops_scanFirstClear(full, 3) == 2 * 64 + 4);
+    ASSERT(bitops_scanFirstClear(full, 2) == BITOPS_NONE);
+    return 0;
+}
+
+int bitopsScanNextSet(void) {
+    uint64_t words[3] = { 0x81, 0, 0x8000000000000000 };
+    ASSERT(bitops_scanNextSet(words, 3, 0) == 0);
+    ASSERT(bitops_scanNextSet(words, 3, 1) == 7);
+    ASSERT(bitops_scanNextSet(words, 3, 8) == 191);
+    ASSERT(bitops_scanNextSet(words, 3, 191) == 191);
+    ASSERT(bitops_scanNextSet(words, 3, 192) == BITOPS_NONE);
+    ASSERT(bitops_scanNextSet(words, 2, 8) == BITOPS_NONE);
+    return 0;
+}
+
+int bitopsPopcountArray(void) {
+    uint64_t words[5] = { 1, 3, 7, UINT64_MAX, 0 };
+    ASSERT(bitops_popcountArray(words, 5) == 1 + 2 + 3 + 64);
+    ASSERT(bitops_popcountArray(words, 5) == popcountArrayPortable(words, 5));
+    ASSERT(bitops_popcountArray(words, 0) == 0);
+    return 0;
+}
+
+int bitopsCombineArrays(void) {
+    // odd length, so the vector kernels have a tail
+    uint64_t a[11], b[11], expected[11];
+    uint64_t x = 0x9E3779B97F4A7C15;
+    for (size_t i = 0; i < ARRAY_LENGTH(a); ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        a[i] = x;
+        b[i] = x * 0xD6E8FEB86659FD93;
+    }
+
+    const bitops_combine_t ops[] = { BITOPS_AND, BITOPS_OR, BITOPS_AND_NOT };
+    for (size_t j = 0; j < ARRAY_LENGTH(ops); ++j) {
+        for (size_t i = 0; i < ARRAY_LENGTH(a); ++i)
+            expected[i] = ops[j] == BITOPS_AND ? a[i] & b[i] : ops[j] == BITOPS_OR ? a[i] | b[i] : a[i] & ~b[i];
+        uint64_t dst[ARRAY_LENGTH(a)];
+        memcpy(dst, a, sizeof(a));
+        bitops_combineArrays(dst, b, ARRAY_LENGTH(a), ops[j]);
+        ASSERT(!memcmp(dst, expected, sizeof(dst)));
+        memcpy(dst, a, sizeof(a));
+        combineArraysPortable(dst, b, ARRAY_LENGTH(a), ops[j]);
+        ASSERT(!memcmp(dst, expected, sizeof(dst)));
+#ifdef BITOPS_X86_DISPATCH
+        memcpy(dst, a, sizeof(a));
+        combineArraysSse2(dst, b, ARRAY_LENGTH(a), ops[j]);
+        ASSERT(!memcmp(dst, expected, sizeof(dst)));
+#endif
+    }
+    return 0;
+}
+
+#endif
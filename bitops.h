@@ -0,0 +1,71 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+/* Bit scanning on single words and arrays of words. The single word scans are compiler
+   builtins -- one instruction (bsf/tzcnt, bsr/lzcnt) on any x86-64. Single word popcount
+   is one instruction only if the build targets POPCNT (-mpopcnt, -march=native ...);
+   otherwise the builtin would be a libgcc call, so it's an inline SWAR count instead.
+   popcount over arrays and pdep/pext check the CPU once and use POPCNT/BMI2 when
+   available; without them they fall back to portable code. The array combinators use
+   AVX2 when available and SSE2 otherwise (always there on x86-64). */
+
+#define BITOPS_NONE ((size_t) -1)
+
+typedef enum {
+    BITOPS_AND,
+    BITOPS_OR,
+    BITOPS_AND_NOT, // dst & ~src
+} bitops_combine_t;
+
+// index of the lowest / highest set bit, -1 for 0
+static inline int bitops_findFirstSet(uint64_t val) {
+    return val ? __builtin_ctzll(val) : -1;
+}
+
+static inline int bitops_findLastSet(uint64_t val) {
+    return val ? 63 - __builtin_clzll(val) : -1;
+}
+
+// undefined for 0 -- guarded by assert()
+static inline unsigned int bitops_ctz(uint64_t val) {
+    assert(val);
+    return (unsigned int) __builtin_ctzll(val);
+}
+
+static inline unsigned int bitops_clz(uint64_t val) {
+    assert(val);
+    return (unsigned int) __builtin_clzll(val);
+}
+
+// not dispatched like the array version -- an indirect call would cost more than SWAR
+static inline unsigned int bitops_popcount(uint64_t val) {
+#if defined(__POPCNT__) || !(defined(__x86_64__) || defined(__i386__))
+    return (unsigned int) __builtin_popcountll(val);
+#else
+    val -= (val >> 1) & 0x5555555555555555u;
+    val = (val & 0x3333333333333333u) + ((val >> 2) & 0x3333333333333333u);
+    val = (val + (val >> 4)) & 0x0F0F0F0F0F0F0F0Fu;
+    return (unsigned int) ((val * 0x0101010101010101u) >> 56);
+#endif
+}
+
+// deposits the low bits of val at the positions set in mask / gathers them back
+uint64_t bitops_pdep(uint64_t val, uint64_t mask);
+uint64_t bitops_pext(uint64_t val, uint64_t mask);
+
+// word at a time scans -- bit i lives in words[i / 64] at position i % 64;
+// return BITOPS_NONE if there is no such bit
+size_t bitops_scanFirstSet(const uint64_t *words, size_t wordCount);
+size_t bitops_scanFirstClear(const uint64_t *words, size_t wordCount);
+size_t bitops_scanNextSet(const uint64_t *words, size_t wordCount, size_t from);
+size_t bitops_popcountArray(const uint64_t *words, size_t wordCount);
+// dst[i] = dst[i] op src[i]; no alignment needed, dst and src must not overlap partially
+void bitops_combineArrays(uint64_t *dst, const uint64_t *src, size_t wordCount, bitops_combine_t op);
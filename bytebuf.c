@@ -0,0 +1,217 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#define _POSIX_C_SOURCE 200809L
+#include "bytebuf.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "unittestMacros.h"
+
+// private declarations
+// -----------------------------------------------------------------------------
+static int getSegments(const bytebuf_t *buf, size_t offset, size_t count, struct iovec *iov);
+static void commitWrite(bytebuf_t *buf, size_t count);
+static void commitRead(bytebuf_t *buf, size_t count);
+
+// interface functions
+// -----------------------------------------------------------------------------
+bytebuf_t bytebuf_make(unsigned int capacityLog2) {
+    assert(capacityLog2 < sizeof(size_t) * 8 - 1);
+    bytebuf_t buf = { .capacityLog2 = capacityLog2 };
+
+    size_t capacity = (size_t) 1 << capacityLog2;
+    buf.rotationMask = capacity - 1;
+    buf.a = malloc(capacity);
+    return buf;
+}
+
+ssize_t bytebuf_readFrom(bytebuf_t *buf, int fd) {
+    struct iovec iov[2];
+    size_t postEnd = buf->start + buf->length & buf->rotationMask;
+    int iovcnt = getSegments(buf, postEnd, buf->rotationMask + 1 - buf->length, iov);
+    if (!iovcnt) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    ssize_t result = readv(fd, iov, iovcnt);
+    if (result > 0) {
+        commitWrite(buf, (size_t) result);
+        if ((size_t) result > buf->readHighWater)
+            buf->readHighWater = (size_t) result;
+    }
+    return result;
+}
+
+ssize_t bytebuf_writeTo(bytebuf_t *buf, int fd) {
+    struct iovec iov[2];
+    int iovcnt = getSegments(buf, buf->start, buf->length, iov);
+    if (!iovcnt)
+        return 0;
+
+    ssize_t result = writev(fd, iov, iovcnt);
+    if (result > 0)
+        commitRead(buf, (size_t) result);
+    return result;
+}
+
+size_t bytebuf_write(bytebuf_t *buf, const void *in, size_t count) {
+    struct iovec iov[2];
+    size_t postEnd = buf->start + buf->length & buf->rotationMask;
+    size_t space = buf->rotationMask + 1 - buf->length;
+    count = count < space ? count : space;
+    getSegments(buf, postEnd, count, iov);
+
+    memcpy(iov[0].iov_base, in, iov[0].iov_len);
+    memcpy(iov[1].iov_base, (const uint8_t *) in + iov[0].iov_len, iov[1].iov_len);
+    commitWrite(buf, count);
+    return count;
+}
+
+size_t bytebuf_read(bytebuf_t *buf, void *out, size_t count) {
+    struct iovec iov[2];
+    count = count < buf->length ? count : buf->length;
+    getSegments(buf, buf->start, count, iov);
+
+    memcpy(out, iov[0].iov_base, iov[0].iov_len);
+    memcpy((uint8_t *) out + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+    commitRead(buf, count);
+    return count;
+}
+
+void bytebuf_resetHighWater(bytebuf_t *buf) {
+    buf->lengthHighWater = buf->length;
+    buf->readHighWater = 0;
+}
+
+void bytebuf_destroy(bytebuf_t *buf) {
+    free(buf->a);
+    buf->a = NULL;
+}
+
+// private functions
+// -----------------------------------------------------------------------------
+// returns the number of non empty segments; iov[1] is always valid for memcpy
+static int getSegments(const bytebuf_t *buf, size_t offset, size_t count, struct iovec *iov) {
+    size_t capacity = buf->rotationMask + 1;
+    bool isWrapped = count > capacity - offset;
+    size_t n1 = isWrapped ? capacity - offset : count;
+    iov[0] = (struct iovec) { .iov_base = buf->a + offset, .iov_len = n1 };
+    iov[1] = (struct iovec) { .iov_base = buf->a, .iov_len = count - n1 };
+    return !count ? 0 : isWrapped ? 2 : 1;
+}
+
+static void commitWrite(bytebuf_t *buf, size_t count) {
+    buf->length += count;
+    if (buf->length > buf->lengthHighWater)
+        buf->lengthHighWater = buf->length;
+}
+
+static void commitRead(bytebuf_t *buf, size_t count) {
+    buf->start = buf->start + count & buf->rotationMask;
+    buf->length -= count;
+}
+
+// unittest
+// -----------------------------------------------------------------------------
+#ifdef UNITTEST
+#include <unistd.h>
+
+int bytebufMakeInitialization(void) {
+    bytebuf_t buf = bytebuf_make(4);
+    ASSERT(buf.a);
+    ASSERT(buf.rotationMask == 0xF);
+    ASSERT(!buf.length);
+    ASSERT(!buf.lengthHighWater);
+
+    bytebuf_destroy(&buf);
+    return 0;
+}
+
+int bytebufWriteAndReadAcrossWrap(void) {
+    bytebuf_t buf = bytebuf_make(3);
+    buf.start = 5; // cause wrapping
+    ASSERT(bytebuf_write(&buf, "abcdefghij", 10) == 8);
+    ASSERT(buf.a[0] == 'd');
+    char out[9] = { 0 };
+    ASSERT(bytebuf_read(&buf, out, sizeof(out)) == 8);
+    ASSERT(!strcmp(out, "abcdefgh"));
+    ASSERT(buf.start == 5);
+
+    bytebuf_destroy(&buf);
+    return 0;
+}
+
+int bytebufReadFromFillsBothSegments(void) {
+    int fds[2];
+    ASSERT(!pipe(fds));
+    ASSERT(write(fds[1], "0123456789", 10) == 10);
+
+    bytebuf_t buf = bytebuf_make(4);
+    buf.start = 12; // free space wraps after 4 bytes
+    ASSERT(bytebuf_readFrom(&buf, fds[0]) == 10);
+    ASSERT(buf.length == 10);
+    ASSERT(buf.a[15] == '3');
+    ASSERT(buf.a[0] == '4');
+    ASSERT(buf.lengthHighWater == 10);
+    ASSERT(buf.readHighWater == 10);
+
+    close(fds[0]);
+    close(fds[1]);
+    bytebuf_destroy(&buf);
+    return 0;
+}
+
+int bytebufReadFromFullBufferFails(void) {
+    bytebuf_t buf = bytebuf_make(2);
+    buf.length = 4;
+    ASSERT(bytebuf_readFrom(&buf, -1) == -1);
+    ASSERT(errno == ENOBUFS);
+
+    bytebuf_destroy(&buf);
+    return 0;
+}
+
+int bytebufWriteToDrainsBothSegments(void) {
+    int fds[2];
+    ASSERT(!pipe(fds));
+
+    bytebuf_t buf = bytebuf_make(3);
+    buf.start = 6; // cause wrapping
+    bytebuf_write(&buf, "abcde", 5);
+    ASSERT(bytebuf_writeTo(&buf, fds[1]) == 5);
+    ASSERT(!buf.length);
+    ASSERT(buf.start == 3);
+
+    char out[6] = { 0 };
+    ASSERT(read(fds[0], out, 5) == 5);
+    ASSERT(!strcmp(out, "abcde"));
+
+    close(fds[0]);
+    close(fds[1]);
+    bytebuf_destroy(&buf);
+    return 0;
+}
+
+int bytebufHighWaterKeepsPeak(void) {
+    bytebuf_t buf = bytebuf_make(3);
+    char out[8];
+    bytebuf_write(&buf, "abcdef", 6);
+    bytebuf_read(&buf, out, 4);
+    bytebuf_write(&buf, "gh", 2);
+    ASSERT(buf.lengthHighWater == 6);
+
+    bytebuf_resetHighWater(&buf);
+    ASSERT(buf.lengthHighWater == 4);
+
+    bytebuf_destroy(&buf);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,41 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Byte oriented sibling of circbuf_t for socket and pipe I/O. readFrom/writeTo move
+   data between a file descriptor and both wrap segments with a single readv/writev,
+   without an intermediate buffer. */
+
+typedef struct {
+    uint8_t *a;
+    size_t start;
+    size_t length;
+    unsigned int capacityLog2;
+    size_t rotationMask;
+
+    // statistics for sizing buffers -- reset with bytebuf_resetHighWater()
+    size_t lengthHighWater; // peak fill level
+    size_t readHighWater; // biggest single readFrom transfer
+} bytebuf_t;
+
+bytebuf_t bytebuf_make(unsigned int capacityLog2);
+
+// fills free space from fd; returns bytes read, 0 on EOF and -1 on error (errno is set,
+// ENOBUFS if the buffer is full)
+ssize_t bytebuf_readFrom(bytebuf_t *buf, int fd);
+// drains used space into fd; returns bytes written or -1 on error
+ssize_t bytebuf_writeTo(bytebuf_t *buf, int fd);
+
+// copying convenience functions; return number of bytes transferred
+size_t bytebuf_write(bytebuf_t *buf, const void *in, size_t count);
+size_t bytebuf_read(bytebuf_t *buf, void *out, size_t count);
+
+void bytebuf_resetHighWater(bytebuf_t *buf);
+void bytebuf_destroy(bytebuf_t *buf);
@@ -12,6 +12,12 @@
 
 // private declaration
 // -----------------------------------------------------------------------------
+static circbuf_spans_t getSpans(const circbuf_t *buf, size_t offset, size_t count);
+static void migrate(circbuf_t *buf, size_t count);
+static void startIncrementalGrowth(circbuf_t *buf);
+
+// interface functions
+// -----------------------------------------------------------------------------
 circbuf_t circbuf_make(unsigned int capacityLog2) {
     const unsigned int ptrSizeLog2 = 1 + sizeof(void *) / 4;
     const unsigned int addressablePtrCountLog2 = sizeof(size_t) * 8 - ptrSizeLog2;
@@ -39,35 +45,112 @@ void circbuf_dynamicPut(circbuf_t *buf, void *elem) {
     circbuf_put(buf, elem);
 }
 
+void circbuf_incrementalPut(circbuf_t *buf, void *elem) {
+    if (buf->oldA)
+        migrate(buf, CIRCBUF_MIGRATION_STEP);
+    if (CIRCBUF_FULL(*buf))
+        startIncrementalGrowth(buf);
+
+    circbuf_put(buf, elem);
+}
+
 void *circbuf_popBack(circbuf_t *buf) {
     assert(buf->length);
 
-    void *result = buf->a[buf->start];
+    void *result;
+    bool isMigrating = buf->oldA;
+    if (isMigrating && buf->oldLength) {
+        result = buf->oldA[buf->oldStart];
+        buf->oldStart = buf->oldStart + 1 & buf->oldRotationMask;
+        --buf->oldLength;
+    } else {
+        result = buf->a[buf->start];
+    }
     buf->start = buf->start + 1 & buf->rotationMask;
     --buf->length;
+
+    if (isMigrating)
+        migrate(buf, CIRCBUF_MIGRATION_STEP);
+    return result;
+}
+
+void *circbuf_dynamicPopBack(circbuf_t *buf) {
+    void *result = circbuf_popBack(buf);
+
+    size_t capacity = buf->rotationMask + 1;
+    bool isFarBelowCapacity = buf->length <= capacity >> CIRCBUF_SHRINK_RATIO_LOG2;
+    if (!isFarBelowCapacity || buf->capacityLog2 <= CIRCBUF_SHRINK_MIN_CAPACITY_LOG2) {
+        buf->lowWaterCount = 0;
+        return result;
+    }
+
+    if (++buf->lowWaterCount >= capacity / 2)
+        circbuf_resize(buf, buf->capacityLog2 - 1); // resets lowWaterCount
+
     return result;
 }
 
+void circbuf_finishMigration(circbuf_t *buf) {
+    if (buf->oldA)
+        migrate(buf, buf->oldLength);
+}
+
+void circbuf_putN(circbuf_t *buf, void *const *elems, size_t count) {
+    circbuf_finishMigration(buf);
+    circbuf_spans_t unused = circbuf_writable(buf);
+    assert(count <= unused.length[0] + unused.length[1]);
+
+    size_t n1 = count < unused.length[0] ? count : unused.length[0];
+    memcpy(unused.p[0], elems, sizeof(void *) * n1);
+    memcpy(unused.p[1], elems + n1, sizeof(void *) * (count - n1));
+    circbuf_commitPut(buf, count);
+}
+
+void circbuf_popN(circbuf_t *buf, void **out, size_t count) {
+    circbuf_finishMigration(buf);
+    circbuf_spans_t used = circbuf_readable(buf);
+    assert(count <= buf->length);
+
+    size_t n1 = count < used.length[0] ? count : used.length[0];
+    memcpy(out, used.p[0], sizeof(void *) * n1);
+    memcpy(out + n1, used.p[1], sizeof(void *) * (count - n1));
+    circbuf_commitPop(buf, count);
+}
+
+circbuf_spans_t circbuf_readable(const circbuf_t *buf) {
+    assert(!buf->oldA);
+    return getSpans(buf, buf->start, buf->length);
+}
+
+circbuf_spans_t circbuf_writable(const circbuf_t *buf) {
+    size_t capacity = buf->rotationMask + 1;
+    size_t postEnd = buf->start + buf->length & buf->rotationMask;
+    return getSpans(buf, postEnd, capacity - buf->length);
+}
+
+void circbuf_commitPut(circbuf_t *buf, size_t count) {
+    assert(count <= buf->rotationMask + 1 - buf->length);
+    buf->length += count;
+}
+
+void circbuf_commitPop(circbuf_t *buf, size_t count) {
+    assert(count <= buf->length && !buf->oldA);
+    buf->start = buf->start + count & buf->rotationMask;
+    buf->length -= count;
+}
+
 void circbuf_increaseSize(circbuf_t *buf) {
     circbuf_resize(buf, buf->capacityLog2 + 1);
 }
 
 void circbuf_resize(circbuf_t *buf, unsigned int newCapacityLog2) {
     assert((1 << newCapacityLog2) >= buf->length);
+    circbuf_finishMigration(buf);
 
     circbuf_t newBuf = circbuf_make(newCapacityLog2);
-    size_t capacity = 1 << buf->capacityLog2;
-    bool isWrapped = buf->length > capacity - buf->start;
-    size_t n1, n2;
-    if (isWrapped) {
-        n1 = capacity - buf->start;
-        n2 = buf->length - n1;
-    } else {
-        n1 = buf->length;
-        n2 = 0;
-    }
-    memcpy(newBuf.a, buf->a + buf->start, sizeof(void *) * n1);
-    memcpy(newBuf.a + n1, buf->a, sizeof(void *) * n2);
+    circbuf_spans_t used = circbuf_readable(buf);
+    memcpy(newBuf.a, used.p[0], sizeof(void *) * used.length[0]);
+    memcpy(newBuf.a + used.length[0], used.p[1], sizeof(void *) * used.length[1]);
     newBuf.length = buf->length;
 
     free(buf->a);
@@ -75,6 +158,7 @@ void circbuf_resize(circbuf_t *buf, unsigned int newCapacityLog2) {
 }
 
 void circbuf_destroy(circbuf_t *buf) {
+    circbuf_finishMigration(buf);
     for (size_t i = 0; i < buf->length; ++i) {
         size_t index = buf->start + i & buf->rotationMask;
         free(buf->a[index]);
@@ -82,6 +166,56 @@ void circbuf_destroy(circbuf_t *buf) {
     free(buf->a);
 }
 
+// private functions
+// -----------------------------------------------------------------------------
+static circbuf_spans_t getSpans(const circbuf_t *buf, size_t offset, size_t count) {
+    size_t capacity = buf->rotationMask + 1;
+    bool isWrapped = count > capacity - offset;
+    circbuf_spans_t result = { .p = { buf->a + offset, buf->a } };
+    if (isWrapped) {
+        result.length[0] = capacity - offset;
+        result.length[1] = count - result.length[0];
+    } else {
+        result.length[0] = count;
+        result.length[1] = 0;
+    }
+    return result;
+}
+
+// moves the newest not yet migrated elements, so the remaining ones stay the oldest
+static void migrate(circbuf_t *buf, size_t count) {
+    count = count < buf->oldLength ? count : buf->oldLength;
+    for (size_t i = 0; i < count; ++i) {
+        size_t last = --buf->oldLength;
+        void *elem = buf->oldA[buf->oldStart + last & buf->oldRotationMask];
+        buf->a[buf->start + last & buf->rotationMask] = elem;
+    }
+
+    if (!buf->oldLength) {
+        free(buf->oldA);
+        buf->oldA = NULL;
+    }
+}
+
+static void startIncrementalGrowth(circbuf_t *buf) {
+    circbuf_finishMigration(buf); // only needed if elements were put with plain put
+
+    unsigned int newCapacityLog2 = buf->capacityLog2 + 1;
+    size_t newCapacity = (size_t) 1 << newCapacityLog2;
+    buf->oldA = buf->a;
+    buf->oldStart = buf->start;
+    buf->oldLength = buf->length;
+    buf->oldRotationMask = buf->rotationMask;
+
+    // no calloc - contents are written before they're read
+    buf->a = malloc(sizeof(void *) * newCapacity);
+    buf->start = 0;
+    buf->capacityLog2 = newCapacityLog2;
+    buf->rotationMask = newCapacity - 1;
+}
+
+// unittest
+// -----------------------------------------------------------------------------
 #ifdef UNITTEST
 #include "utilMacros.h"
 static void saveDoubles(circbuf_t *buf, double *toSave, size_t count) {
@@ -222,4 +356,195 @@ int circbufRetrieveAfterResize(void) {
     return 0;
 }
 
+int circbufPutNWrapsAround(void) {
+    double foo[3];
+    void *elems[] = { foo, foo + 1, foo + 2 };
+    circbuf_t buf = circbuf_make(2);
+    buf.start = 2; // cause
+    buf.length = 1; // wrapping
+    circbuf_putN(&buf, elems, ARRAY_LENGTH(elems));
+    ASSERT(buf.length == 4);
+    ASSERT(buf.a[3] == foo);
+    ASSERT(buf.a[0] == foo + 1);
+    ASSERT(buf.a[1] == foo + 2);
+
+    free(buf.a);
+    return 0;
+}
+
+int circbufPopNKeepsOrder(void) {
+    double foo[3] = { 1.1, 2.2, 3.3 };
+    circbuf_t buf = circbuf_make(2);
+    buf.start = 3; // cause wrapping
+    saveDoubles(&buf, foo, ARRAY_LENGTH(foo));
+    void *out[2];
+    circbuf_popN(&buf, out, ARRAY_LENGTH(out));
+    ASSERT(out[0] == foo);
+    ASSERT(out[1] == foo + 1);
+    ASSERT(buf.start == 1);
+    ASSERT(buf.length == 1);
+    ASSERT(circbuf_popBack(&buf) == foo + 2);
+
+    free(buf.a);
+    return 0;
+}
+
+int circbufReadableSplitsWrappedElements(void) {
+    circbuf_t buf = circbuf_make(3);
+    buf.start = 6;
+    buf.length = 5;
+    circbuf_spans_t used = circbuf_readable(&buf);
+    ASSERT(used.p[0] == buf.a + 6);
+    ASSERT(used.length[0] == 2);
+    ASSERT(used.p[1] == buf.a);
+    ASSERT(used.length[1] == 3);
+
+    free(buf.a);
+    return 0;
+}
+
+int circbufWritableCoversFreeSpace(void) {
+    circbuf_t buf = circbuf_make(3);
+    buf.start = 2;
+    buf.length = 3;
+    circbuf_spans_t unused = circbuf_writable(&buf);
+    ASSERT(unused.p[0] == buf.a + 5);
+    ASSERT(unused.length[0] == 3);
+    ASSERT(unused.p[1] == buf.a);
+    ASSERT(unused.length[1] == 2);
+
+    free(buf.a);
+    return 0;
+}
+
+int circbufCommitPutExposesWrittenElements(void) {
+    double foo;
+    circbuf_t buf = circbuf_make(2);
+    circbuf_spans_t unused = circbuf_writable(&buf);
+    unused.p[0][0] = &foo;
+    circbuf_commitPut(&buf, 1);
+    ASSERT(buf.length == 1);
+    ASSERT(circbuf_popBack(&buf) == &foo);
+
+    free(buf.a);
+    return 0;
+}
+
+int circbufIncrementalPutDefersMigration(void) {
+    double foo[4];
+    circbuf_t buf = circbuf_make(1);
+    buf.start = 1; // cause wrapping
+    circbuf_incrementalPut(&buf, foo);
+    circbuf_incrementalPut(&buf, foo + 1);
+    void **previous = buf.a;
+    circbuf_incrementalPut(&buf, foo + 2);
+    ASSERT(buf.capacityLog2 == 2);
+    ASSERT(buf.oldA == previous);
+    ASSERT(buf.oldLength == 2);
+    ASSERT(buf.length == 3);
+
+    circbuf_incrementalPut(&buf, foo + 3);
+    ASSERT(!buf.oldA); // 2 < CIRCBUF_MIGRATION_STEP
+    for (size_t i = 0; i < ARRAY_LENGTH(foo); ++i)
+        ASSERT(circbuf_popBack(&buf) == foo + i);
+
+    free(buf.a);
+    return 0;
+}
+
+int circbufPopBackDuringMigrationKeepsOrder(void) {
+    double foo[100];
+    circbuf_t buf = circbuf_make(5);
+    for (size_t i = 0; i < 32; ++i)
+        circbuf_put(&buf, foo + i);
+    for (size_t i = 32; i < 40; ++i)
+        circbuf_incrementalPut(&buf, foo + i);
+    ASSERT(buf.oldA);
+
+    // interleave pops and puts while the old array is still in use
+    size_t next = 40;
+    for (size_t i = 0; i < 60; ++i) {
+        ASSERT(circbuf_popBack(&buf) == foo + i);
+        if (next < ARRAY_LENGTH(foo))
+            circbuf_incrementalPut(&buf, foo + next++);
+    }
+    ASSERT(!buf.oldA);
+    for (size_t i = 60; i < ARRAY_LENGTH(foo); ++i)
+        ASSERT(circbuf_popBack(&buf) == foo + i);
+
+    free(buf.a);
+    return 0;
+}
+
+int circbufFinishMigration(void) {
+    double foo[40];
+    circbuf_t buf = circbuf_make(5);
+    buf.start = 20; // cause wrapping
+    for (size_t i = 0; i < 32; ++i)
+        circbuf_put(&buf, foo + i);
+    circbuf_incrementalPut(&buf, foo + 32);
+    ASSERT(buf.oldA);
+
+    circbuf_finishMigration(&buf);
+    ASSERT(!buf.oldA);
+    size_t iter = buf.start;
+    for (size_t i = 0; i < 33; ++i)
+        ASSERT(CIRCBUF_NEXT(buf, iter) == foo + i);
+
+    free(buf.a);
+    return 0;
+}
+
+int circbufDynamicPopBackShrinksAfterStayingLow(void) {
+    circbuf_t buf = circbuf_make(CIRCBUF_SHRINK_MIN_CAPACITY_LOG2 + 2);
+    size_t capacity = (size_t) 1 << buf.capacityLog2;
+    size_t lowLength = capacity >> CIRCBUF_SHRINK_RATIO_LOG2;
+    for (size_t i = 0; i < lowLength + 1; ++i)
+        circbuf_put(&buf, NULL);
+
+    // stay at the threshold without shrinking for capacity / 2 - 1 pops
+    for (size_t i = 0; i < capacity / 2 - 1; ++i) {
+        circbuf_dynamicPopBack(&buf);
+        circbuf_put(&buf, NULL);
+        ASSERT(buf.capacityLog2 == CIRCBUF_SHRINK_MIN_CAPACITY_LOG2 + 2);
+    }
+    circbuf_dynamicPopBack(&buf);
+    ASSERT(buf.capacityLog2 == CIRCBUF_SHRINK_MIN_CAPACITY_LOG2 + 1);
+    ASSERT(buf.length == lowLength);
+    ASSERT(!buf.lowWaterCount);
+
+    free(buf.a);
+    return 0;
+}
+
+int circbufDynamicPopBackHysteresisResetsAboveThreshold(void) {
+    circbuf_t buf = circbuf_make(CIRCBUF_SHRINK_MIN_CAPACITY_LOG2 + 1);
+    size_t capacity = (size_t) 1 << buf.capacityLog2;
+    size_t lowLength = capacity >> CIRCBUF_SHRINK_RATIO_LOG2;
+    for (size_t i = 0; i < lowLength + 1; ++i)
+        circbuf_put(&buf, NULL);
+    circbuf_dynamicPopBack(&buf);
+    ASSERT(buf.lowWaterCount == 1);
+
+    circbuf_put(&buf, NULL);
+    circbuf_put(&buf, NULL);
+    circbuf_dynamicPopBack(&buf);
+    ASSERT(!buf.lowWaterCount);
+
+    free(buf.a);
+    return 0;
+}
+
+int circbufDynamicPopBackKeepsMinimumCapacity(void) {
+    circbuf_t buf = circbuf_make(CIRCBUF_SHRINK_MIN_CAPACITY_LOG2);
+    for (size_t i = 0; i < 64; ++i) {
+        circbuf_put(&buf, NULL);
+        circbuf_dynamicPopBack(&buf);
+    }
+    ASSERT(buf.capacityLog2 == CIRCBUF_SHRINK_MIN_CAPACITY_LOG2);
+
+    free(buf.a);
+    return 0;
+}
+
 #endif
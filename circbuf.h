@@ -2,6 +2,8 @@
  * Copyright:  Copyright Johannes Teichrieb 2015
  * License:    opensource.org/licenses/MIT
  */
+#pragma once
+
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -12,13 +14,37 @@ typedef struct {
     size_t length;
     unsigned int capacityLog2;
     size_t rotationMask;
+
+    // incremental growth -- the oldest oldLength elements still live in oldA; oldA is
+    // allocated too, so free(buf.a) alone leaks it (see circbuf_destroy)
+    void **oldA;
+    size_t oldStart;
+    size_t oldLength;
+    size_t oldRotationMask;
+
+    size_t lowWaterCount; // consecutive dynamicPopBack calls far below capacity
 } circbuf_t;
 
+// contiguous regions of a circbuf_t in logical order -- second one is empty unless wrapped
+typedef struct {
+    void **p[2];
+    size_t length[2];
+} circbuf_spans_t;
+
+// elements moved from the previous array by every incrementalPut and popBack
+#define CIRCBUF_MIGRATION_STEP 4
+// dynamicPopBack shrinks if length stays at or below capacity >> CIRCBUF_SHRINK_RATIO_LOG2
+// for capacity / 2 consecutive calls, but never below CIRCBUF_SHRINK_MIN_CAPACITY_LOG2
+#define CIRCBUF_SHRINK_RATIO_LOG2 3
+#define CIRCBUF_SHRINK_MIN_CAPACITY_LOG2 4
+
 #define CIRCBUF_FULL(buf) ((buf).length >= (1 << (buf).capacityLog2))
 
 #define CIRCBUF_ITER_PP(buf, iter) (iter = iter + 1 & (buf).rotationMask)
 #define CIRCBUF_NEXT(buf, iter) (iter &= (buf).rotationMask, (buf).a[iter++])
 #define CIRCBUF_FRONT_INDEX(buf) ((buf).start + (buf).length - !!(buf).length & (buf).rotationMask)
+// macros above and readable spans only see .a - call circbuf_finishMigration() first
+// when incrementalPut is used
 
 // allocated and static memory shouldn't be mixed
 
@@ -27,9 +53,27 @@ circbuf_t circbuf_make(unsigned int capacityLog2);
 void circbuf_put(circbuf_t *buf, void *elem);
 // if no space is left, increases the size before putting
 void circbuf_dynamicPut(circbuf_t *buf, void *elem);
+// like dynamicPut, but elements are moved into the bigger array a few at a time
+// by later incrementalPut and popBack calls - bounds worst case put latency
+void circbuf_incrementalPut(circbuf_t *buf, void *elem);
 void *circbuf_popBack(circbuf_t *buf);
+// popBack that halves the capacity once length stays far below it (see CIRCBUF_SHRINK_*)
+void *circbuf_dynamicPopBack(circbuf_t *buf);
+void circbuf_finishMigration(circbuf_t *buf);
+// batch versions of put and popBack - at most two memcpy each
+void circbuf_putN(circbuf_t *buf, void *const *elems, size_t count);
+void circbuf_popN(circbuf_t *buf, void **out, size_t count);
+
+// direct access to the elements (readable) and to the free space behind them (writable);
+// after working inside the spans, the change is made visible with the commit functions
+circbuf_spans_t circbuf_readable(const circbuf_t *buf);
+circbuf_spans_t circbuf_writable(const circbuf_t *buf);
+void circbuf_commitPut(circbuf_t *buf, size_t count);
+void circbuf_commitPop(circbuf_t *buf, size_t count);
+
 void circbuf_increaseSize(circbuf_t *buf);
 void circbuf_resize(circbuf_t *buf, unsigned int newCapacityLog2);
-// calls free on every element and .a itself - for allocated elements only
-// for static memory simply call free(buf.a)
+// calls free on every element and .a itself - for allocated elements only;
+// for static memory call circbuf_finishMigration() first, then free(buf.a) -- only
+// buffers that never see incrementalPut may skip the finishMigration call
 void circbuf_destroy(circbuf_t *buf);
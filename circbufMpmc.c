@@ -0,0 +1,349 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#define _POSIX_C_SOURCE 200809L
+#include "circbufMpmc.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "unittestMacros.h"
+
+// interface functions
+// -----------------------------------------------------------------------------
+void circbufMpmc_init(circbufMpmc_t *buf, unsigned int capacityLog2) {
+    const unsigned int slotSizeLog2 = 2 + sizeof(void *) / 4;
+    const unsigned int addressableSlotCountLog2 = sizeof(size_t) * 8 - slotSizeLog2;
+    // with a single slot "written" and "free for the next lap" would be the same seq
+    assert(capacityLog2 >= 1 && capacityLog2 < addressableSlotCountLog2);
+
+    size_t capacity = (size_t) 1 << capacityLog2;
+    atomic_init(&buf->start, 0);
+    atomic_init(&buf->end, 0);
+    buf->a = malloc(sizeof(circbufMpmc_slot_t) * capacity);
+    for (size_t i = 0; i < capacity; ++i) {
+        atomic_init(&buf->a[i].seq, i);
+        buf->a[i].elem = NULL;
+    }
+    buf->capacityLog2 = capacityLog2;
+    buf->rotationMask = capacity - 1;
+    eventcount_init(&buf->notEmpty);
+    eventcount_init(&buf->notFull);
+}
+
+bool circbufMpmc_put(circbufMpmc_t *buf, void *elem) {
+    size_t pos = atomic_load_explicit(&buf->end, memory_order_relaxed);
+    circbufMpmc_slot_t *slot;
+    while (true) {
+        slot = buf->a + (pos & buf->rotationMask);
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t lap = (intptr_t) seq - (intptr_t) pos;
+        if (!lap) {
+            // on failure pos is reloaded with the current end
+            if (atomic_compare_exchange_weak_explicit(&buf->end, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (lap < 0) {
+            return false; // slot still holds an element from the previous lap
+        } else {
+            pos = atomic_load_explicit(&buf->end, memory_order_relaxed);
+        }
+    }
+
+    slot->elem = elem;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+bool circbufMpmc_popBack(circbufMpmc_t *buf, void **elemOut) {
+    size_t pos = atomic_load_explicit(&buf->start, memory_order_relaxed);
+    circbufMpmc_slot_t *slot;
+    while (true) {
+        slot = buf->a + (pos & buf->rotationMask);
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t lap = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (!lap) {
+            if (atomic_compare_exchange_weak_explicit(&buf->start, &pos, pos + 1,
+                        memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (lap < 0) {
+            return false; // slot wasn't written yet in this lap
+        } else {
+            pos = atomic_load_explicit(&buf->start, memory_order_relaxed);
+        }
+    }
+
+    *elemOut = slot->elem;
+    // mark the slot writable for the next lap
+    atomic_store_explicit(&slot->seq, pos + buf->rotationMask + 1, memory_order_release);
+    return true;
+}
+
+bool circbufMpmc_putAndNotify(circbufMpmc_t *buf, void *elem) {
+    if (!circbufMpmc_put(buf, elem))
+        return false;
+    eventcount_notify(&buf->notEmpty);
+    return true;
+}
+
+bool circbufMpmc_popBackAndNotify(circbufMpmc_t *buf, void **elemOut) {
+    if (!circbufMpmc_popBack(buf, elemOut))
+        return false;
+    eventcount_notify(&buf->notFull);
+    return true;
+}
+
+int circbufMpmc_putWait(circbufMpmc_t *buf, void *elem, int timeoutMs) {
+    for (int i = 0; i < CIRCBUF_WAIT_SPIN_COUNT; ++i) {
+        if (circbufMpmc_putAndNotify(buf, elem))
+            return 0;
+        eventcount_spinPause();
+    }
+
+    struct timespec deadline;
+    bool hasDeadline = eventcount_getDeadline(timeoutMs, &deadline);
+    while (true) {
+        uint32_t key = eventcount_prepareWait(&buf->notFull);
+        if (circbufMpmc_putAndNotify(buf, elem)) {
+            eventcount_cancelWait(&buf->notFull);
+            return 0;
+        }
+        if (eventcount_wait(&buf->notFull, key, hasDeadline ? &deadline : NULL))
+            return circbufMpmc_putAndNotify(buf, elem) ? 0 : -1;
+    }
+}
+
+int circbufMpmc_popWait(circbufMpmc_t *buf, void **elemOut, int timeoutMs) {
+    for (int i = 0; i < CIRCBUF_WAIT_SPIN_COUNT; ++i) {
+        if (circbufMpmc_popBackAndNotify(buf, elemOut))
+            return 0;
+        eventcount_spinPause();
+    }
+
+    struct timespec deadline;
+    bool hasDeadline = eventcount_getDeadline(timeoutMs, &deadline);
+    while (true) {
+        uint32_t key = eventcount_prepareWait(&buf->notEmpty);
+        if (circbufMpmc_popBackAndNotify(buf, elemOut)) {
+            eventcount_cancelWait(&buf->notEmpty);
+            return 0;
+        }
+        if (eventcount_wait(&buf->notEmpty, key, hasDeadline ? &deadline : NULL))
+            return circbufMpmc_popBackAndNotify(buf, elemOut) ? 0 : -1;
+    }
+}
+
+size_t circbufMpmc_length(circbufMpmc_t *buf) {
+    size_t start = atomic_load_explicit(&buf->start, memory_order_acquire);
+    size_t end = atomic_load_explicit(&buf->end, memory_order_acquire);
+    // concurrent pops can move start past a stale end
+    return end - start <= buf->rotationMask + 1 ? end - start : 0;
+}
+
+void circbufMpmc_destroy(circbufMpmc_t *buf) {
+    free(buf->a);
+    buf->a = NULL;
+}
+
+// unittest
+// -----------------------------------------------------------------------------
+#ifdef UNITTEST
+#include <time.h>
+#include <pthread.h>
+
+int circbufMpmcInit(void) {
+    circbufMpmc_t buf;
+    circbufMpmc_init(&buf, 3);
+    ASSERT(buf.a);
+    ASSERT(buf.capacityLog2 == 3);
+    ASSERT(buf.rotationMask == 0x7);
+    ASSERT(atomic_load(&buf.a[5].seq) == 5);
+    ASSERT(circbufMpmc_length(&buf) == 0);
+
+    circbufMpmc_destroy(&buf);
+    return 0;
+}
+
+int circbufMpmcPutFailsWhenFull(void) {
+    double foo[5];
+    circbufMpmc_t buf;
+    circbufMpmc_init(&buf, 2);
+    for (int i = 0; i < 4; ++i)
+        ASSERT(circbufMpmc_put(&buf, foo + i));
+    ASSERT(!circbufMpmc_put(&buf, foo + 4));
+    ASSERT(circbufMpmc_length(&buf) == 4);
+
+    circbufMpmc_destroy(&buf);
+    return 0;
+}
+
+int circbufMpmcPopBackFailsWhenEmpty(void) {
+    circbufMpmc_t buf;
+    circbufMpmc_init(&buf, 2);
+    void *elem;
+    ASSERT(!circbufMpmc_popBack(&buf, &elem));
+
+    circbufMpmc_destroy(&buf);
+    return 0;
+}
+
+int circbufMpmcSaveAndRetrieveWrapping(void) {
+    double foo[3] = { 2.2, 3.3, 4.4 };
+    circbufMpmc_t buf;
+    circbufMpmc_init(&buf, 2);
+    void *elem;
+    for (int i = 0; i < 7; ++i) {
+        circbufMpmc_put(&buf, NULL);
+        circbufMpmc_popBack(&buf, &elem);
+    }
+
+    for (int i = 0; i < 3; ++i)
+        circbufMpmc_put(&buf, foo + i);
+    for (int i = 0; i < 3; ++i) {
+        ASSERT(circbufMpmc_popBack(&buf, &elem));
+        ASSERT(elem == foo + i);
+    }
+    ASSERT(!circbufMpmc_popBack(&buf, &elem));
+
+    circbufMpmc_destroy(&buf);
+    return 0;
+}
+
+#define MPMC_TEST_THREAD_COUNT 4
+#define MPMC_TEST_ELEMENTS_PER_THREAD 20000
+
+typedef struct {
+    circbufMpmc_t *buf;
+    size_t first;
+    size_t sum;
+} mpmcTestArg_t;
+
+static void *mpmcTestWorker(void *p) {
+    mpmcTestArg_t *arg = p;
+    for (size_t i = 0; i < MPMC_TEST_ELEMENTS_PER_THREAD; ++i) {
+        while (!circbufMpmc_put(arg->buf, (void *) (arg->first + i)))
+            ;
+        void *elem;
+        while (!circbufMpmc_popBack(arg->buf, &elem))
+            ;
+        arg->sum += (size_t) elem;
+    }
+    return NULL;
+}
+
+int circbufMpmcConcurrentPutPopLosesNothing(void) {
+    circbufMpmc_t buf;
+    circbufMpmc_init(&buf, 3);
+    pthread_t threads[MPMC_TEST_THREAD_COUNT];
+    mpmcTestArg_t args[MPMC_TEST_THREAD_COUNT];
+    for (size_t i = 0; i < MPMC_TEST_THREAD_COUNT; ++i) {
+        args[i] = (mpmcTestArg_t) { .buf = &buf, .first = i * MPMC_TEST_ELEMENTS_PER_THREAD };
+        ASSERT(!pthread_create(threads + i, NULL, mpmcTestWorker, args + i));
+    }
+
+    size_t sum = 0;
+    for (size_t i = 0; i < MPMC_TEST_THREAD_COUNT; ++i) {
+        pthread_join(threads[i], NULL);
+        sum += args[i].sum;
+    }
+    size_t n = MPMC_TEST_THREAD_COUNT * MPMC_TEST_ELEMENTS_PER_THREAD;
+    ASSERT(sum == n * (n - 1) / 2);
+    ASSERT(circbufMpmc_length(&buf) == 0);
+
+    circbufMpmc_destroy(&buf);
+    return 0;
+}
+
+int circbufMpmcOnlyNotifyVariantsWakeWaiters(void) {
+    circbufMpmc_t buf;
+    circbufMpmc_init(&buf, 2);
+    // pretend a thread sleeps on each side; waking bumps the epoch
+    atomic_store(&buf.notEmpty.waiterCount, 1);
+    atomic_store(&buf.notFull.waiterCount, 1);
+    void *elem;
+    ASSERT(circbufMpmc_put(&buf, NULL));
+    ASSERT(circbufMpmc_popBack(&buf, &elem));
+    ASSERT(!atomic_load(&buf.notEmpty.epoch) && !atomic_load(&buf.notFull.epoch));
+
+    ASSERT(circbufMpmc_putAndNotify(&buf, NULL));
+    ASSERT(atomic_load(&buf.notEmpty.epoch) == 1);
+    ASSERT(circbufMpmc_popBackAndNotify(&buf, &elem));
+    ASSERT(atomic_load(&buf.notFull.epoch) == 1);
+    // nothing to wake for failed attempts
+    ASSERT(!circbufMpmc_popBackAndNotify(&buf, &elem));
+    ASSERT(atomic_load(&buf.notFull.epoch) == 1);
+
+    circbufMpmc_destroy(&buf);
+    return 0;
+}
+
+int circbufMpmcPopWaitTimesOut(void) {
+    circbufMpmc_t buf;
+    circbufMpmc_init(&buf, 2);
+    void *elem;
+    ASSERT(circbufMpmc_popWait(&buf, &elem, 10));
+    ASSERT(errno == ETIMEDOUT);
+    ASSERT(!atomic_load(&buf.notEmpty.waiterCount));
+
+    circbufMpmc_destroy(&buf);
+    return 0;
+}
+
+int circbufMpmcPutWaitTimesOut(void) {
+    circbufMpmc_t buf;
+    circbufMpmc_init(&buf, 1);
+    ASSERT(!circbufMpmc_putWait(&buf, NULL, 10));
+    ASSERT(!circbufMpmc_putWait(&buf, NULL, 10));
+    ASSERT(circbufMpmc_putWait(&buf, NULL, 10));
+    ASSERT(errno == ETIMEDOUT);
+
+    circbufMpmc_destroy(&buf);
+    return 0;
+}
+
+static void *mpmcTestDelayedPut(void *arg) {
+    struct timespec ts = { .tv_nsec = 20000000 };
+    nanosleep(&ts, NULL);
+    circbufMpmc_putAndNotify(arg, (void *) 42);
+    return NULL;
+}
+
+int circbufMpmcPopWaitWakesOnPut(void) {
+    circbufMpmc_t buf;
+    circbufMpmc_init(&buf, 2);
+    pthread_t thread;
+    ASSERT(!pthread_create(&thread, NULL, mpmcTestDelayedPut, &buf));
+    void *elem = NULL;
+    ASSERT(!circbufMpmc_popWait(&buf, &elem, 5000));
+    ASSERT(elem == (void *) 42);
+
+    pthread_join(thread, NULL);
+    circbufMpmc_destroy(&buf);
+    return 0;
+}
+
+static void *mpmcTestDelayedPop(void *arg) {
+    struct timespec ts = { .tv_nsec = 20000000 };
+    nanosleep(&ts, NULL);
+    void *elem;
+    circbufMpmc_popBackAndNotify(arg, &elem);
+    return NULL;
+}
+
+int circbufMpmcPutWaitWakesOnPop(void) {
+    circbufMpmc_t buf;
+    circbufMpmc_init(&buf, 1);
+    circbufMpmc_put(&buf, NULL);
+    circbufMpmc_put(&buf, NULL);
+    pthread_t thread;
+    ASSERT(!pthread_create(&thread, NULL, mpmcTestDelayedPop, &buf));
+    ASSERT(!circbufMpmc_putWait(&buf, (void *) 7, 5000));
+
+    pthread_join(thread, NULL);
+    circbufMpmc_destroy(&buf);
+    return 0;
+}
+
+#endif
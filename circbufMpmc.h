@@ -0,0 +1,64 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "circbufSpsc.h"
+#include "eventcount.h"
+
+// put/pop attempts of the wait functions before the thread goes to sleep
+#define CIRCBUF_WAIT_SPIN_COUNT 200
+
+/* Bounded multi producer / multi consumer variant of circbuf_t. Every slot carries a
+   sequence number that tells whether it's ready to be written (seq == pos) or read
+   (seq == pos + 1) for the lap the claiming thread is on. Claiming a position is a single
+   CAS on end (put) or start (pop); there is no lock. */
+
+typedef struct {
+    atomic_size_t seq;
+    void *elem;
+} circbufMpmc_slot_t;
+
+typedef struct {
+    _Alignas(CIRCBUF_CACHE_LINE_SIZE) atomic_size_t start;
+    _Alignas(CIRCBUF_CACHE_LINE_SIZE) atomic_size_t end;
+
+    // constant after init
+    _Alignas(CIRCBUF_CACHE_LINE_SIZE) circbufMpmc_slot_t *a;
+    unsigned int capacityLog2;
+    size_t rotationMask;
+
+    // only touched by the wait and AndNotify functions
+    _Alignas(CIRCBUF_CACHE_LINE_SIZE) eventcount_t notEmpty;
+    eventcount_t notFull;
+} circbufMpmc_t;
+
+// capacityLog2 has to be at least 1
+void circbufMpmc_init(circbufMpmc_t *buf, unsigned int capacityLog2);
+
+// returns false if the buffer is full
+bool circbufMpmc_put(circbufMpmc_t *buf, void *elem);
+// returns false if the buffer is empty
+bool circbufMpmc_popBack(circbufMpmc_t *buf, void **elemOut);
+/* put/popBack that also wake threads sleeping in popWait/putWait -- that costs a
+   seq_cst fence per call, so the plain versions above never notify. A buffer with
+   sleeping consumers needs producers that use putAndNotify or putWait (and the other
+   way around). */
+bool circbufMpmc_putAndNotify(circbufMpmc_t *buf, void *elem);
+bool circbufMpmc_popBackAndNotify(circbufMpmc_t *buf, void **elemOut);
+// blocking versions - spin for a while, then sleep until the buffer changes; they
+// notify like the AndNotify versions; timeoutMs < 0 waits forever; return -1 with
+// errno ETIMEDOUT on timeout
+int circbufMpmc_putWait(circbufMpmc_t *buf, void *elem, int timeoutMs);
+int circbufMpmc_popWait(circbufMpmc_t *buf, void **elemOut, int timeoutMs);
+// snapshot -- may be stale as soon as it's returned
+size_t circbufMpmc_length(circbufMpmc_t *buf);
+
+// only frees .a -- remaining elements are left untouched
+void circbufMpmc_destroy(circbufMpmc_t *buf);
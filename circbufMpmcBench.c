@@ -0,0 +1,68 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+// usage: circbufMpmcBench [maxThreadCount] [opsPerThread]
+#include "circbufMpmc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#define CAPACITY_LOG2 10
+
+typedef struct {
+    circbufMpmc_t *buf;
+    size_t opCount;
+} benchArg_t;
+
+static double now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static void *worker(void *p) {
+    benchArg_t *arg = p;
+    for (size_t i = 0; i < arg->opCount; ++i) {
+        while (!circbufMpmc_put(arg->buf, (void *) i))
+            ;
+        void *elem;
+        while (!circbufMpmc_popBack(arg->buf, &elem))
+            ;
+    }
+    return NULL;
+}
+
+static double run(size_t threadCount, size_t opsPerThread) {
+    circbufMpmc_t buf;
+    circbufMpmc_init(&buf, CAPACITY_LOG2);
+    pthread_t *threads = malloc(sizeof(pthread_t) * threadCount);
+    benchArg_t arg = { .buf = &buf, .opCount = opsPerThread };
+
+    double t0 = now();
+    for (size_t i = 0; i < threadCount; ++i)
+        pthread_create(threads + i, NULL, worker, &arg);
+    for (size_t i = 0; i < threadCount; ++i)
+        pthread_join(threads[i], NULL);
+    double elapsed = now() - t0;
+
+    free(threads);
+    circbufMpmc_destroy(&buf);
+    return elapsed;
+}
+
+int main(int argc, char **argv) {
+    size_t maxThreadCount = argc > 1 ? strtoul(argv[1], NULL, 10) : 8;
+    size_t opsPerThread = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+
+    printf("threads  put+pop/s  per-thread\n");
+    for (size_t n = 1; n <= maxThreadCount; ++n) {
+        double elapsed = run(n, opsPerThread);
+        double total = (double) (n * opsPerThread) / elapsed;
+        printf("%7zu  %9.3gM  %9.3gM\n", n, total * 1e-6, total / (double) n * 1e-6);
+    }
+
+    return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#include "circbufSpsc.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+#include "unittestMacros.h"
+
+// interface functions
+// -----------------------------------------------------------------------------
+void circbufSpsc_init(circbufSpsc_t *buf, unsigned int capacityLog2) {
+    const unsigned int ptrSizeLog2 = 1 + sizeof(void *) / 4;
+    const unsigned int addressablePtrCountLog2 = sizeof(size_t) * 8 - ptrSizeLog2;
+    assert(capacityLog2 < addressablePtrCountLog2);
+
+    size_t capacity = (size_t) 1 << capacityLog2;
+    atomic_init(&buf->start, 0);
+    atomic_init(&buf->end, 0);
+    buf->cachedEnd = 0;
+    buf->cachedStart = 0;
+    buf->a = calloc(sizeof(void *), capacity);
+    buf->capacityLog2 = capacityLog2;
+    buf->rotationMask = capacity - 1;
+}
+
+bool circbufSpsc_put(circbufSpsc_t *buf, void *elem) {
+    size_t end = atomic_load_explicit(&buf->end, memory_order_relaxed);
+    size_t capacity = buf->rotationMask + 1;
+    // only touch the consumer's cache line if the cached value says we're full
+    if (end - buf->cachedStart == capacity) {
+        buf->cachedStart = atomic_load_explicit(&buf->start, memory_order_acquire);
+        if (end - buf->cachedStart == capacity)
+            return false;
+    }
+
+    buf->a[end & buf->rotationMask] = elem;
+    atomic_store_explicit(&buf->end, end + 1, memory_order_release);
+    return true;
+}
+
+bool circbufSpsc_popBack(circbufSpsc_t *buf, void **elemOut) {
+    size_t start = atomic_load_explicit(&buf->start, memory_order_relaxed);
+    if (start == buf->cachedEnd) {
+        buf->cachedEnd = atomic_load_explicit(&buf->end, memory_order_acquire);
+        if (start == buf->cachedEnd)
+            return false;
+    }
+
+    *elemOut = buf->a[start & buf->rotationMask];
+    atomic_store_explicit(&buf->start, start + 1, memory_order_release);
+    return true;
+}
+
+size_t circbufSpsc_length(circbufSpsc_t *buf) {
+    size_t start = atomic_load_explicit(&buf->start, memory_order_acquire);
+    size_t end = atomic_load_explicit(&buf->end, memory_order_acquire);
+    return end - start;
+}
+
+void circbufSpsc_destroy(circbufSpsc_t *buf) {
+    free(buf->a);
+    buf->a = NULL;
+}
+
+// unittest
+// -----------------------------------------------------------------------------
+#ifdef UNITTEST
+#include <stddef.h>
+#include <pthread.h>
+
+int circbufSpscInit(void) {
+    circbufSpsc_t buf;
+    circbufSpsc_init(&buf, 3);
+    ASSERT(buf.a);
+    ASSERT(buf.capacityLog2 == 3);
+    ASSERT(buf.rotationMask == 0x7);
+    ASSERT(circbufSpsc_length(&buf) == 0);
+
+    circbufSpsc_destroy(&buf);
+    return 0;
+}
+
+int circbufSpscIndicesAreOnSeparateCacheLines(void) {
+    size_t startOffset = offsetof(circbufSpsc_t, start);
+    size_t endOffset = offsetof(circbufSpsc_t, end);
+    size_t aOffset = offsetof(circbufSpsc_t, a);
+    ASSERT(endOffset - startOffset >= CIRCBUF_CACHE_LINE_SIZE);
+    ASSERT(aOffset - endOffset >= CIRCBUF_CACHE_LINE_SIZE);
+    return 0;
+}
+
+int circbufSpscPutFailsWhenFull(void) {
+    double foo[5];
+    circbufSpsc_t buf;
+    circbufSpsc_init(&buf, 2);
+    for (int i = 0; i < 4; ++i)
+        ASSERT(circbufSpsc_put(&buf, foo + i));
+    ASSERT(!circbufSpsc_put(&buf, foo + 4));
+    ASSERT(circbufSpsc_length(&buf) == 4);
+
+    circbufSpsc_destroy(&buf);
+    return 0;
+}
+
+int circbufSpscPopBackFailsWhenEmpty(void) {
+    circbufSpsc_t buf;
+    circbufSpsc_init(&buf, 2);
+    void *elem = NULL;
+    ASSERT(!circbufSpsc_popBack(&buf, &elem));
+
+    circbufSpsc_destroy(&buf);
+    return 0;
+}
+
+int circbufSpscSaveAndRetrieveWrapping(void) {
+    double foo[3] = { 2.2, 3.3, 4.4 };
+    circbufSpsc_t buf;
+    circbufSpsc_init(&buf, 2);
+    // advance start and end past the wrap point
+    void *elem;
+    for (int i = 0; i < 7; ++i) {
+        circbufSpsc_put(&buf, NULL);
+        circbufSpsc_popBack(&buf, &elem);
+    }
+
+    for (int i = 0; i < 3; ++i)
+        circbufSpsc_put(&buf, foo + i);
+    for (int i = 0; i < 3; ++i) {
+        ASSERT(circbufSpsc_popBack(&buf, &elem));
+        ASSERT(elem == foo + i);
+    }
+    ASSERT(circbufSpsc_length(&buf) == 0);
+
+    circbufSpsc_destroy(&buf);
+    return 0;
+}
+
+#define SPSC_TEST_ELEMENT_COUNT 100000
+
+static void *spscTestProducer(void *arg) {
+    circbufSpsc_t *buf = arg;
+    for (size_t i = 1; i <= SPSC_TEST_ELEMENT_COUNT; ++i)
+        while (!circbufSpsc_put(buf, (void *) i))
+            ;
+    return NULL;
+}
+
+int circbufSpscTwoThreadsKeepOrder(void) {
+    circbufSpsc_t buf;
+    circbufSpsc_init(&buf, 4);
+    pthread_t producer;
+    ASSERT(!pthread_create(&producer, NULL, spscTestProducer, &buf));
+
+    int error = 0;
+    for (size_t i = 1; i <= SPSC_TEST_ELEMENT_COUNT; ++i) {
+        void *elem;
+        while (!circbufSpsc_popBack(&buf, &elem))
+            ;
+        if ((size_t) elem != i)
+            error = -1;
+    }
+
+    pthread_join(producer, NULL);
+    circbufSpsc_destroy(&buf);
+    return error;
+}
+
+#endif
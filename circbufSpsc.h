@@ -0,0 +1,45 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#ifndef CIRCBUF_CACHE_LINE_SIZE
+#define CIRCBUF_CACHE_LINE_SIZE 64
+#endif
+
+/* Single producer / single consumer variant of circbuf_t. One thread may put while
+   another pops without any locking. start and end are free running -- they are only
+   masked with rotationMask on element access, so length is always (end - start). */
+
+typedef struct {
+    // written by consumer
+    _Alignas(CIRCBUF_CACHE_LINE_SIZE) atomic_size_t start;
+    size_t cachedEnd;
+
+    // written by producer
+    _Alignas(CIRCBUF_CACHE_LINE_SIZE) atomic_size_t end;
+    size_t cachedStart;
+
+    // constant after init
+    _Alignas(CIRCBUF_CACHE_LINE_SIZE) void **a;
+    unsigned int capacityLog2;
+    size_t rotationMask;
+} circbufSpsc_t;
+
+void circbufSpsc_init(circbufSpsc_t *buf, unsigned int capacityLog2);
+
+// producer only; returns false if the buffer is full
+bool circbufSpsc_put(circbufSpsc_t *buf, void *elem);
+// consumer only; returns false if the buffer is empty
+bool circbufSpsc_popBack(circbufSpsc_t *buf, void **elemOut);
+// exact only when called from producer or consumer while the other side is idle
+size_t circbufSpsc_length(circbufSpsc_t *buf);
+
+// only frees .a -- remaining elements are left untouched
+void circbufSpsc_destroy(circbufSpsc_t *buf);
@@ -0,0 +1,101 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/* Typed circbuf_t that stores elements by value in one contiguous array.
+
+  An example:
+
+typedef struct { int x, y; } point_t;
+CIRCBUF_INIT(pt, point_t)
+...
+    circbufT(pt) buf = circbuf_make_pt(4);
+    circbuf_put_pt(&buf, (point_t) { 1, 2 });
+    circbuf_peek_pt(&buf, 0)->y = 3; // modify oldest element in place
+    point_t p = circbuf_popBack_pt(&buf);
+    circbuf_destroy_pt(&buf);
+
+   Unlike circbuf_destroy, destroy only frees .a -- elements live inside the buffer. */
+
+#define circbufT(name) circbuf_##name##_t
+
+#define CIRCBUFT_FULL(buf) ((buf).length > (buf).rotationMask)
+
+#define CIRCBUF_INIT(name, type)                                                        \
+    typedef type circbuf_##name##_elem_t;                                               \
+    typedef struct {                                                                    \
+        circbuf_##name##_elem_t *a;                                                     \
+        size_t start;                                                                   \
+        size_t length;                                                                  \
+        unsigned int capacityLog2;                                                      \
+        size_t rotationMask;                                                            \
+    } circbuf_##name##_t;                                                               \
+                                                                                        \
+    static inline circbuf_##name##_t circbuf_make_##name(unsigned int capacityLog2) {   \
+        assert(capacityLog2 < sizeof(size_t) * 8 - 1);                                  \
+        circbuf_##name##_t buf = { .capacityLog2 = capacityLog2 };                      \
+        size_t capacity = (size_t) 1 << capacityLog2;                                   \
+        buf.rotationMask = capacity - 1;                                                \
+        buf.a = malloc(sizeof(circbuf_##name##_elem_t) * capacity);                     \
+        return buf;                                                                     \
+    }                                                                                   \
+                                                                                        \
+    static inline void circbuf_put_##name(circbuf_##name##_t *buf,                      \
+            circbuf_##name##_elem_t elem) {                                             \
+        assert(!CIRCBUFT_FULL(*buf));                                                   \
+        size_t postEnd = buf->start + buf->length & buf->rotationMask;                  \
+        ++buf->length;                                                                  \
+        buf->a[postEnd] = elem;                                                         \
+    }                                                                                   \
+                                                                                        \
+    static inline circbuf_##name##_elem_t circbuf_popBack_##name(circbuf_##name##_t *buf) { \
+        assert(buf->length);                                                            \
+        circbuf_##name##_elem_t result = buf->a[buf->start];                            \
+        buf->start = buf->start + 1 & buf->rotationMask;                                \
+        --buf->length;                                                                  \
+        return result;                                                                  \
+    }                                                                                   \
+                                                                                        \
+    /* i-th element counted from back (the next one to be popped) */                   \
+    static inline circbuf_##name##_elem_t *circbuf_peek_##name(circbuf_##name##_t *buf, \
+            size_t i) {                                                                 \
+        assert(i < buf->length);                                                        \
+        return buf->a + (buf->start + i & buf->rotationMask);                           \
+    }                                                                                   \
+                                                                                        \
+    static inline void circbuf_resize_##name(circbuf_##name##_t *buf,                   \
+            unsigned int newCapacityLog2) {                                             \
+        assert(((size_t) 1 << newCapacityLog2) >= buf->length);                         \
+        circbuf_##name##_t newBuf = circbuf_make_##name(newCapacityLog2);               \
+        size_t capacity = buf->rotationMask + 1;                                        \
+        bool isWrapped = buf->length > capacity - buf->start;                           \
+        size_t n1 = isWrapped ? capacity - buf->start : buf->length;                    \
+        size_t n2 = buf->length - n1;                                                   \
+        memcpy(newBuf.a, buf->a + buf->start, sizeof(circbuf_##name##_elem_t) * n1);    \
+        memcpy(newBuf.a + n1, buf->a, sizeof(circbuf_##name##_elem_t) * n2);            \
+        newBuf.length = buf->length;                                                    \
+        free(buf->a);                                                                   \
+        *buf = newBuf;                                                                  \
+    }                                                                                   \
+                                                                                        \
+    /* if no space is left, increases the size before putting */                        \
+    static inline void circbuf_dynamicPut_##name(circbuf_##name##_t *buf,               \
+            circbuf_##name##_elem_t elem) {                                             \
+        if (CIRCBUFT_FULL(*buf))                                                        \
+            circbuf_resize_##name(buf, buf->capacityLog2 + 1);                          \
+        circbuf_put_##name(buf, elem);                                                  \
+    }                                                                                   \
+                                                                                        \
+    static inline void circbuf_destroy_##name(circbuf_##name##_t *buf) {                \
+        free(buf->a);                                                                   \
+        buf->a = NULL;                                                                  \
+    }
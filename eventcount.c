@@ -0,0 +1,140 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#define _GNU_SOURCE
+#include "eventcount.h"
+
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "unittestMacros.h"
+
+// interface functions
+// -----------------------------------------------------------------------------
+void eventcount_init(eventcount_t *ec) {
+    atomic_init(&ec->epoch, 0);
+    atomic_init(&ec->waiterCount, 0);
+}
+
+uint32_t eventcount_prepareWait(eventcount_t *ec) {
+    // the caller's condition check is usually a relaxed or acquire load, which C11 lets
+    // move above a seq_cst RMW; the fence pairs with the one in eventcount_notify, so
+    // either the notifier sees the waiter or the waiter sees the condition
+    atomic_fetch_add_explicit(&ec->waiterCount, 1, memory_order_seq_cst);
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_load_explicit(&ec->epoch, memory_order_seq_cst);
+}
+
+void eventcount_cancelWait(eventcount_t *ec) {
+    atomic_fetch_sub_explicit(&ec->waiterCount, 1, memory_order_relaxed);
+}
+
+int eventcount_wait(eventcount_t *ec, uint32_t key, const struct timespec *deadline) {
+    // BITSET variant takes an absolute CLOCK_MONOTONIC timeout
+    long result = syscall(SYS_futex, &ec->epoch, FUTEX_WAIT_BITSET_PRIVATE, key, deadline,
+            NULL, FUTEX_BITSET_MATCH_ANY);
+    int error = errno;
+    eventcount_cancelWait(ec);
+
+    if (result == -1 && error == ETIMEDOUT) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+void eventcount_notifySlow(eventcount_t *ec) {
+    atomic_fetch_add_explicit(&ec->epoch, 1, memory_order_seq_cst);
+    syscall(SYS_futex, &ec->epoch, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+bool eventcount_getDeadline(int timeoutMs, struct timespec *deadlineOut) {
+    if (timeoutMs < 0)
+        return false;
+
+    clock_gettime(CLOCK_MONOTONIC, deadlineOut);
+    deadlineOut->tv_sec += timeoutMs / 1000;
+    deadlineOut->tv_nsec += timeoutMs % 1000 * 1000000L;
+    if (deadlineOut->tv_nsec >= 1000000000L) {
+        ++deadlineOut->tv_sec;
+        deadlineOut->tv_nsec -= 1000000000L;
+    }
+    return true;
+}
+
+// unittest
+// -----------------------------------------------------------------------------
+#ifdef UNITTEST
+#include <pthread.h>
+
+int eventcountNotifyWithoutWaitersKeepsEpoch(void) {
+    eventcount_t ec;
+    eventcount_init(&ec);
+    eventcount_notify(&ec);
+    ASSERT(atomic_load(&ec.epoch) == 0);
+    return 0;
+}
+
+int eventcountWaitTimesOut(void) {
+    eventcount_t ec;
+    eventcount_init(&ec);
+    struct timespec deadline;
+    ASSERT(eventcount_getDeadline(10, &deadline));
+    uint32_t key = eventcount_prepareWait(&ec);
+    ASSERT(eventcount_wait(&ec, key, &deadline));
+    ASSERT(errno == ETIMEDOUT);
+    ASSERT(!atomic_load(&ec.waiterCount));
+    return 0;
+}
+
+int eventcountWaitReturnsAfterEpochChanged(void) {
+    eventcount_t ec;
+    eventcount_init(&ec);
+    uint32_t key = eventcount_prepareWait(&ec);
+    eventcount_notify(&ec);
+    ASSERT(atomic_load(&ec.epoch) == 1);
+    // key is stale - the futex doesn't block
+    ASSERT(!eventcount_wait(&ec, key, NULL));
+    return 0;
+}
+
+typedef struct {
+    eventcount_t ec;
+    atomic_bool flag;
+} eventcountTestShared_t;
+
+static void *eventcountTestSetter(void *arg) {
+    eventcountTestShared_t *shared = arg;
+    struct timespec ts = { .tv_nsec = 5000000 };
+    nanosleep(&ts, NULL);
+    atomic_store(&shared->flag, true);
+    eventcount_notify(&shared->ec);
+    return NULL;
+}
+
+int eventcountWakesSleepingWaiter(void) {
+    eventcountTestShared_t shared;
+    eventcount_init(&shared.ec);
+    atomic_init(&shared.flag, false);
+    pthread_t thread;
+    ASSERT(!pthread_create(&thread, NULL, eventcountTestSetter, &shared));
+
+    struct timespec deadline;
+    eventcount_getDeadline(5000, &deadline);
+    while (!atomic_load(&shared.flag)) {
+        uint32_t key = eventcount_prepareWait(&shared.ec);
+        if (atomic_load(&shared.flag))
+            eventcount_cancelWait(&shared.ec);
+        else
+            ASSERT(!eventcount_wait(&shared.ec, key, &deadline));
+    }
+
+    pthread_join(thread, NULL);
+    return 0;
+}
+
+#endif
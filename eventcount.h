@@ -0,0 +1,58 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/* Futex based eventcount: lets a thread sleep until some lock-free condition might
+   have changed, without a mutex. Waiter side:
+
+    uint32_t key = eventcount_prepareWait(&ec);
+    if (conditionHolds()) {
+        eventcount_cancelWait(&ec);
+    } else {
+        eventcount_wait(&ec, key, deadline);
+    }
+
+   Notifier side: make the condition true, then eventcount_notify(). notify is a fence
+   and a load as long as nobody waits -- the wake syscall is skipped. */
+
+typedef struct {
+    _Atomic uint32_t epoch; // futex word
+    _Atomic uint32_t waiterCount;
+} eventcount_t;
+
+void eventcount_init(eventcount_t *ec);
+
+uint32_t eventcount_prepareWait(eventcount_t *ec);
+void eventcount_cancelWait(eventcount_t *ec);
+// deadline is absolute CLOCK_MONOTONIC, NULL waits forever; ends the wait that was
+// prepared; returns -1 with errno ETIMEDOUT once the deadline passed, 0 otherwise
+// (spurious wake ups included - the caller rechecks its condition)
+int eventcount_wait(eventcount_t *ec, uint32_t key, const struct timespec *deadline);
+
+void eventcount_notifySlow(eventcount_t *ec);
+
+static inline void eventcount_notify(eventcount_t *ec) {
+    // orders the caller's publishing store before reading waiterCount
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ec->waiterCount, memory_order_relaxed))
+        eventcount_notifySlow(ec);
+}
+
+// timeoutMs < 0 means no deadline -- returns false in that case
+bool eventcount_getDeadline(int timeoutMs, struct timespec *deadlineOut);
+
+static inline void eventcount_spinPause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
@@ -0,0 +1,233 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#include "idxpq.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "unittestMacros.h"
+
+#define KEY_IN_WINDOW()   (key >= pq->minKey && key - pq->minKey <= pq->keyMask)
+
+// private declarations
+// -----------------------------------------------------------------------------
+static void appendNode(idxpq_t *pq, idxpq_node_t *node);
+static void unlinkNode(idxpq_t *pq, idxpq_node_t *node);
+
+// interface functions
+// -----------------------------------------------------------------------------
+int idxpq_init(idxpq_t *pq, unsigned int keySpanLog2) {
+    // reserved and clear, so the bitmap of a wide window only costs the pages that get a
+    // key; buckets come zeroed from calloc, which maps big ones lazily as well
+    idxpyr_t occupied = idxpyr_makeReserved(keySpanLog2, keySpanLog2, false);
+    if (!occupied.rows[0]) {
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t keyCount = (size_t) 1 << occupied.indexCountLog2;
+    idxpq_node_t **buckets = calloc(keyCount, sizeof(*buckets));
+    if (!buckets) {
+        idxpyr_destroy(&occupied);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    *pq = (idxpq_t) { .occupied = occupied, .buckets = buckets, .keyMask = keyCount - 1 };
+    return 0;
+}
+
+void idxpq_push(idxpq_t *pq, idxpq_node_t *node, size_t key) {
+    assert(KEY_IN_WINDOW());
+    node->key = key;
+    appendNode(pq, node);
+    ++pq->length;
+}
+
+idxpq_node_t *idxpq_peekMin(idxpq_t *pq) {
+    // the window starts at minKey's bucket and wraps around
+    size_t bucket = idxpyr_next(&pq->occupied, pq->minKey & pq->keyMask);
+    if (bucket == IDXPYR_EMPTY)
+        bucket = idxpyr_getFirst(&pq->occupied);
+
+    return bucket == IDXPYR_EMPTY ? NULL : pq->buckets[bucket];
+}
+
+idxpq_node_t *idxpq_popMin(idxpq_t *pq) {
+    idxpq_node_t *node = idxpq_peekMin(pq);
+    if (node) {
+        unlinkNode(pq, node);
+        --pq->length;
+        pq->minKey = node->key;
+    }
+    return node;
+}
+
+void idxpq_decreaseKey(idxpq_t *pq, idxpq_node_t *node, size_t key) {
+    assert(KEY_IN_WINDOW() && key <= node->key);
+    unlinkNode(pq, node);
+    node->key = key;
+    appendNode(pq, node);
+}
+
+void idxpq_remove(idxpq_t *pq, idxpq_node_t *node) {
+    unlinkNode(pq, node);
+    --pq->length;
+}
+
+void idxpq_destroy(idxpq_t *pq) {
+    idxpyr_destroy(&pq->occupied);
+    free(pq->buckets);
+    pq->buckets = NULL;
+    pq->length = 0;
+}
+
+// private functions
+// -----------------------------------------------------------------------------
+static void appendNode(idxpq_t *pq, idxpq_node_t *node) {
+    size_t bucket = node->key & pq->keyMask;
+    idxpq_node_t *head = pq->buckets[bucket];
+    if (!head) {
+        node->prev = node;
+        node->next = node;
+        pq->buckets[bucket] = node;
+        idxpyr_set(&pq->occupied, bucket, true);
+        return;
+    }
+
+    // behind the tail, i.e. in front of the head of the circular list
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static void unlinkNode(idxpq_t *pq, idxpq_node_t *node) {
+    size_t bucket = node->key & pq->keyMask;
+    if (node->next == node) {
+        pq->buckets[bucket] = NULL;
+        idxpyr_set(&pq->occupied, bucket, false);
+        return;
+    }
+
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    if (pq->buckets[bucket] == node)
+        pq->buckets[bucket] = node->next;
+}
+
+// unittest
+// -----------------------------------------------------------------------------
+#ifdef UNITTEST
+
+int idxpqPopsInKeyThenFifoOrder(void) {
+    idxpq_t pq;
+    ASSERT(!idxpq_init(&pq, 8));
+    ASSERT(!idxpq_popMin(&pq));
+
+    idxpq_node_t nodes[5];
+    const size_t keys[] = { 7, 3, 7, 200, 3 };
+    for (size_t i = 0; i < 5; ++i)
+        idxpq_push(&pq, nodes + i, keys[i]);
+    ASSERT(pq.length == 5);
+    ASSERT(idxpq_peekMin(&pq) == nodes + 1);
+    ASSERT(idxpq_popMin(&pq) == nodes + 1);
+    ASSERT(idxpq_popMin(&pq) == nodes + 4);
+    ASSERT(pq.minKey == 3);
+
+    // the window has moved -- 258 lands in bucket 2, below minKey's bucket
+    idxpq_node_t late;
+    idxpq_push(&pq, &late, 258);
+    ASSERT(idxpq_popMin(&pq) == nodes + 0);
+    ASSERT(idxpq_popMin(&pq) == nodes + 2);
+    ASSERT(idxpq_popMin(&pq) == nodes + 3);
+    ASSERT(idxpq_popMin(&pq) == &late);
+    ASSERT(!idxpq_popMin(&pq) && !pq.length);
+
+    idxpq_destroy(&pq);
+    return 0;
+}
+
+int idxpqDecreaseKeyAndRemove(void) {
+    idxpq_t pq;
+    ASSERT(!idxpq_init(&pq, 10));
+    idxpq_node_t a, b, c;
+    idxpq_push(&pq, &a, 50);
+    idxpq_push(&pq, &b, 60);
+    idxpq_push(&pq, &c, 40);
+
+    idxpq_decreaseKey(&pq, &b, 40);
+    ASSERT(idxpq_popMin(&pq) == &c);
+    ASSERT(idxpq_peekMin(&pq) == &b);
+    idxpq_remove(&pq, &b);
+    ASSERT(idxpq_peekMin(&pq) == &a);
+    idxpq_remove(&pq, &a);
+    ASSERT(!idxpq_peekMin(&pq) && !pq.length);
+
+    idxpq_destroy(&pq);
+    return 0;
+}
+
+typedef struct {
+    idxpq_node_t node; // first, so the casts below work
+    size_t seq; // push / decreaseKey order, for the FIFO check
+    bool isQueued;
+} testItem_t;
+
+int idxpqMatchesLinearScan(void) {
+    const unsigned int keySpanLog2 = 9;
+    idxpq_t pq;
+    ASSERT(!idxpq_init(&pq, keySpanLog2));
+    testItem_t items[300] = { 0 };
+    size_t seq = 0;
+    uint32_t x = 2463534242;
+    for (int step = 0; step < 20000; ++step) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        testItem_t *item = items + x % 300;
+        size_t key = pq.minKey + (x >> 9) % ((size_t) 1 << keySpanLog2);
+        switch (x >> 28 & 3) {
+        case 0:
+        case 1:
+            if (!item->isQueued) {
+                idxpq_push(&pq, &item->node, key);
+                item->seq = seq++;
+                item->isQueued = true;
+            } else if (key < item->node.key) {
+                idxpq_decreaseKey(&pq, &item->node, key);
+                item->seq = seq++;
+            }
+            break;
+        case 2:
+            if (item->isQueued) {
+                idxpq_remove(&pq, &item->node);
+                item->isQueued = false;
+            }
+            break;
+        default: {
+            testItem_t *expected = NULL;
+            for (size_t i = 0; i < 300; ++i) {
+                testItem_t *it = items + i;
+                if (it->isQueued && (!expected || it->node.key < expected->node.key
+                        || (it->node.key == expected->node.key && it->seq < expected->seq)))
+                    expected = it;
+            }
+            testItem_t *popped = (testItem_t *) idxpq_popMin(&pq);
+            ASSERT(popped == expected);
+            if (popped)
+                popped->isQueued = false;
+        }
+        }
+    }
+    while (idxpq_popMin(&pq))
+        ;
+    ASSERT(!pq.length && idxpyr_getFirst(&pq.occupied) == IDXPYR_EMPTY);
+
+    idxpq_destroy(&pq);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,50 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "idxpyr.h"
+
+/* Monotone integer priority queue, e.g. for deadlines in ticks. Every key has its own
+   FIFO bucket, and an idxpyr_t marks the non-empty ones, so finding the minimum is one
+   getFirst-like walk instead of a heap's log n swaps. Keys are unbounded but have to
+   stay within a window: minKey <= key < minKey + 2^keySpanLog2, where minKey is the key
+   popped last. The window is used cyclically -- bucket key & (span - 1).
+
+   Nodes are intrusive: embed an idxpq_node_t in the queued object; the queue never
+   allocates per element, and decreaseKey/remove are O(1) list unlinks. */
+
+typedef struct idxpq_node_t {
+    struct idxpq_node_t *prev;
+    struct idxpq_node_t *next;
+    size_t key;
+} idxpq_node_t;
+
+typedef struct {
+    idxpyr_t occupied; // bit i <=> buckets[i] is non-empty
+    idxpq_node_t **buckets; // circular lists, the head is the oldest node
+    size_t keyMask;
+    size_t minKey;
+    size_t length;
+} idxpq_t;
+
+// keySpanLog2 is raised to at least one idxpyr block; -1 with errno ENOMEM
+int idxpq_init(idxpq_t *pq, unsigned int keySpanLog2);
+
+// key has to be inside the window -- guarded by assert()
+void idxpq_push(idxpq_t *pq, idxpq_node_t *node, size_t key);
+// NULL if the queue is empty; among equal keys the one pushed first
+idxpq_node_t *idxpq_peekMin(idxpq_t *pq);
+// also moves the window up to the popped key
+idxpq_node_t *idxpq_popMin(idxpq_t *pq);
+// the node goes to the back of its new key's bucket; key >= minKey
+void idxpq_decreaseKey(idxpq_t *pq, idxpq_node_t *node, size_t key);
+void idxpq_remove(idxpq_t *pq, idxpq_node_t *node);
+
+// the nodes themselves belong to the caller
+void idxpq_destroy(idxpq_t *pq);
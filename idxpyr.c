@@ -2,25 +2,69 @@
  * Copyright:  Copyright Johannes Teichrieb 2015
  * License:    opensource.org/licenses/MIT
  */
+#define _GNU_SOURCE
 #include "idxpyr.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "bitops.h"
 #include "unittestMacros.h"
 
 #define INDEX_EXISTS()   (index < (size_t) 1 << pyr->indexCountLog2)
 
 // private declarations
 // -----------------------------------------------------------------------------
+STATIC_ASSERT((UM_BIT_COUNT(idxpyr_block_t) - 1) * UM_BIT_COUNT(idxpyr_block_t) <= UINT16_MAX, leafPrefixesFit16Bits);
+
 static unsigned int getHeight(unsigned int indexCountLog2); // starts with 1
-static inline int countTrailingZeros(uint32_t val);
+// number of bits in a row - the top row can be smaller than a block
+static inline size_t getRowBitCount(const idxpyr_t *pyr, unsigned int row);
+static inline size_t getRowBlockCount(unsigned int indexCountLog2, unsigned int row);
+static inline void applyMask(idxpyr_block_t *block, idxpyr_block_t mask, bool state);
+// bit range [begin, end) of a single row -- no summary update
+static void fillRow(idxpyr_block_t *row, size_t begin, size_t end, bool state);
+// blocks of a row under one parent -- fewer than a block's worth only below the top block
+static inline size_t getChildCount(unsigned int indexCountLog2, unsigned int row);
+// set indices in the siblings left of (row, blockIndex); row < height - 1
+static inline size_t getPrefix(const idxpyr_t *pyr, unsigned int row, size_t blockIndex);
+// set indices below the block at (row, blockIndex) -- walks down its last children
+static size_t getBlockCount(const idxpyr_t *pyr, unsigned int row, size_t blockIndex);
+// prefix store sized for pyr -- counting is left as it is; -1 with errno ENOMEM
+static int allocPrefixes(idxpyr_t *pyr);
+// swaps in the prefix store of sized (same index count as pyr) and recounts
+static void replacePrefixes(idxpyr_t *pyr, const idxpyr_t *sized);
+// adds delta to the count of a leaf block: the prefixes right of its path and setCount
+static void addToPrefixes(idxpyr_t *pyr, size_t blockIndex, size_t delta);
+// rebuilds the prefixes above indices [begin, end)
+static void recount(idxpyr_t *pyr, size_t begin, size_t end);
+// doubling within the reservation -- everything past the current rows is kept zero
+static void growInPlace(idxpyr_t *pyr);
+// leaf row combination shared by and/or/andNot
+static void combine(idxpyr_t *dst, const idxpyr_t *src, bitops_combine_t op);
+// rows 1 .. height - 1 from the leaf row
+static void rebuildSummaries(idxpyr_t *pyr);
+static void shrinkInPlace(idxpyr_t *pyr, unsigned int indexCountLog2);
+// rows laid out back to back like idxpyr_make does
+static size_t getPackedStoreSize(unsigned int indexCountLog2);
+static uint64_t getRowsChecksum(const idxpyr_t *pyr);
+static uint64_t hashBytes(const void *data, size_t size, uint64_t seed);
+static int pwriteAll(int fd, const void *data, size_t size, size_t offset);
+// the file is known to be long enough -- end of file counts as an error
+static int preadAll(int fd, void *data, size_t size, size_t offset);
 
 // interface functions
 // -----------------------------------------------------------------------------
 idxpyr_t idxpyr_make(unsigned int indexCountLog2, bool stateInit) {
-    indexCountLog2 = MAX(indexCountLog2, UM_BIT_COUNT_LOG2(idxpyr_block_t));
+    if (indexCountLog2 < UM_BIT_COUNT_LOG2(idxpyr_block_t))
+        indexCountLog2 = UM_BIT_COUNT_LOG2(idxpyr_block_t);
     unsigned int height = getHeight(indexCountLog2);
 
     idxpyr_t result = { .indexCountLog2 = indexCountLog2, .height = height, .stateInit = stateInit };
@@ -35,6 +79,8 @@ idxpyr_t idxpyr_make(unsigned int indexCountLog2, bool stateInit) {
     size_t totalBlockCount = rowOffset + 1;
     size_t storeSize = totalBlockCount * sizeof(idxpyr_block_t);
     idxpyr_block_t *store = malloc(storeSize);
+    if (!store)
+        return (idxpyr_t) { 0 };
     result.rows[0] = store;
     result.storeSize = storeSize;
 
@@ -45,15 +91,75 @@ idxpyr_t idxpyr_make(unsigned int indexCountLog2, bool stateInit) {
     return result;
 }
 
+idxpyr_t idxpyr_makeReserved(unsigned int indexCountLog2, unsigned int maxIndexCountLog2, bool stateInit) {
+    if (indexCountLog2 < UM_BIT_COUNT_LOG2(idxpyr_block_t))
+        indexCountLog2 = UM_BIT_COUNT_LOG2(idxpyr_block_t);
+    if (maxIndexCountLog2 < indexCountLog2)
+        maxIndexCountLog2 = indexCountLog2;
+
+    idxpyr_t result = { .indexCountLog2 = indexCountLog2, .height = getHeight(indexCountLog2),
+        .stateInit = stateInit, .maxIndexCountLog2 = maxIndexCountLog2 };
+
+    // every row gets the room it has at the maximum size, rounded to pages so that
+    // shrinking one row never discards the start of the next
+    size_t pageMask = (size_t) sysconf(_SC_PAGESIZE) - 1;
+    unsigned int maxHeight = getHeight(maxIndexCountLog2);
+    size_t rowOffsets[IDXPYR_MAX_HEIGHT];
+    size_t mapSize = 0;
+    for (unsigned int i = 0; i < maxHeight; ++i) {
+        rowOffsets[i] = mapSize;
+        size_t rowSize = getRowBlockCount(maxIndexCountLog2, i) * sizeof(idxpyr_block_t);
+        mapSize += (rowSize + pageMask) & ~pageMask;
+    }
+    char *store = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (store == MAP_FAILED)
+        return (idxpyr_t) { 0 };
+
+    for (unsigned int i = 0; i < maxHeight; ++i)
+        result.rows[i] = (idxpyr_block_t *) (store + rowOffsets[i]);
+    result.storeSize = mapSize;
+
+    // the fresh mapping reads as all clear -- only a set pyramid has to touch its pages
+    if (stateInit)
+        idxpyr_setAll(&result, true);
+    return result;
+}
+
+idxpyr_t idxpyr_makeFromSorted(const size_t *indices, size_t n, unsigned int indexCountLog2) {
+    if (n) {
+        size_t last = indices[n - 1];
+        unsigned int requiredLog2 = last ? (unsigned int) bitops_findLastSet(last) + 1 : 0;
+        if (indexCountLog2 < requiredLog2)
+            indexCountLog2 = requiredLog2;
+    }
+    idxpyr_t pyr = idxpyr_make(indexCountLog2, false);
+
+    for (size_t i = 0; i < n; ++i) {
+        assert(!i || indices[i - 1] <= indices[i]);
+        size_t position = indices[i];
+        for (unsigned int row = 0; row < pyr.height; ++row) {
+            size_t blockIndex = position >> UM_BIT_COUNT_LOG2(idxpyr_block_t);
+            unsigned int bit = position & (UM_BIT_COUNT(idxpyr_block_t) - 1);
+            applyMask(pyr.rows[row] + blockIndex, (idxpyr_block_t) ((idxpyr_block_t) 1 << bit), true);
+            // the previous index went through the same block -- the rows above know it
+            unsigned int shift = (row + 1) * UM_BIT_COUNT_LOG2(idxpyr_block_t);
+            if (i && indices[i - 1] >> shift == blockIndex)
+                break;
+            position = blockIndex;
+        }
+    }
+    return pyr;
+}
+
 size_t idxpyr_getFirst(idxpyr_t *pyr) {
     idxpyr_block_t topBlock = *pyr->rows[pyr->height - 1];
     if (!topBlock)
         return IDXPYR_EMPTY;
 
-    size_t lowerBlockIndex = (size_t) countTrailingZeros(topBlock);
+    size_t lowerBlockIndex = bitops_ctz(topBlock);
     for (int i = (int) pyr->height - 2; i >= 0; --i) {
         idxpyr_block_t block = pyr->rows[i][lowerBlockIndex];
-        unsigned int bit = (unsigned int) countTrailingZeros(block);
+        unsigned int bit = bitops_ctz(block);
         lowerBlockIndex = (lowerBlockIndex << UM_BIT_COUNT_LOG2(idxpyr_block_t)) + bit;
     }
     
@@ -68,23 +174,153 @@ size_t idxpyr_popFirst(idxpyr_t *pyr) {
     return result;
 }
 
+size_t idxpyr_popFirstN(idxpyr_t *pyr, size_t *out, size_t n) {
+    size_t count = 0;
+    if (!n || !*pyr->rows[pyr->height - 1])
+        return count;
+
+    size_t position = 0;
+    unsigned int row = pyr->height - 1;
+    while (true) {
+        // down to the first non-empty leaf block, starting from where the last fix-up ended
+        for (; row; --row)
+            position = position << UM_BIT_COUNT_LOG2(idxpyr_block_t) | bitops_ctz(pyr->rows[row][position]);
+
+        size_t takenCount = count;
+        idxpyr_block_t block = pyr->rows[0][position];
+        for (; block && count < n; block &= (idxpyr_block_t) (block - 1))
+            out[count++] = position << UM_BIT_COUNT_LOG2(idxpyr_block_t) | bitops_ctz(block);
+        pyr->rows[0][position] = block;
+        takenCount = count - takenCount;
+        if (pyr->isCounting)
+            addToPrefixes(pyr, position, -takenCount);
+
+        // clear the emptied block from the row above, and so on while they run empty
+        while (!block) {
+            if (++row == pyr->height)
+                return count;
+            unsigned int bit = position & (UM_BIT_COUNT(idxpyr_block_t) - 1);
+            position >>= UM_BIT_COUNT_LOG2(idxpyr_block_t);
+            block = pyr->rows[row][position] & (idxpyr_block_t) ~((idxpyr_block_t) 1 << bit);
+            pyr->rows[row][position] = block;
+        }
+        if (count == n)
+            return count;
+    }
+}
+
+size_t idxpyr_getNearest(idxpyr_t *pyr, size_t hint) {
+    size_t below = idxpyr_prev(pyr, hint);
+    if (below == hint)
+        return below;
+    size_t above = idxpyr_next(pyr, hint);
+    if (below == IDXPYR_EMPTY)
+        return above;
+    if (above == IDXPYR_EMPTY)
+        return below;
+    return above - hint < hint - below ? above : below;
+}
+
+size_t idxpyr_popNearest(idxpyr_t *pyr, size_t hint) {
+    size_t result = idxpyr_getNearest(pyr, hint);
+    if (result != IDXPYR_EMPTY)
+        idxpyr_set(pyr, result, false);
+
+    return result;
+}
+
+size_t idxpyr_getLast(idxpyr_t *pyr) {
+    return idxpyr_prev(pyr, ((size_t) 1 << pyr->indexCountLog2) - 1);
+}
+
+size_t idxpyr_next(idxpyr_t *pyr, size_t from) {
+    // climb until a row has a set bit at or right of the current position
+    size_t position = from;
+    unsigned int row = 0;
+    while (true) {
+        if (position >= getRowBitCount(pyr, row))
+            return IDXPYR_EMPTY;
+
+        size_t blockIndex = position >> UM_BIT_COUNT_LOG2(idxpyr_block_t);
+        unsigned int bit = position & (UM_BIT_COUNT(idxpyr_block_t) - 1);
+        idxpyr_block_t block = pyr->rows[row][blockIndex] & (idxpyr_block_t) ((idxpyr_block_t) -1 << bit);
+        if (block) {
+            position = blockIndex << UM_BIT_COUNT_LOG2(idxpyr_block_t) | bitops_ctz(block);
+            break;
+        }
+        if (row == pyr->height - 1)
+            return IDXPYR_EMPTY;
+        position = blockIndex + 1;
+        ++row;
+    }
+
+    // and back down along the lowest set bits
+    while (row--) {
+        idxpyr_block_t block = pyr->rows[row][position];
+        position = position << UM_BIT_COUNT_LOG2(idxpyr_block_t) | bitops_ctz(block);
+    }
+    return position;
+}
+
+size_t idxpyr_prev(idxpyr_t *pyr, size_t from) {
+    size_t indexCount = (size_t) 1 << pyr->indexCountLog2;
+    size_t position = from < indexCount ? from : indexCount - 1;
+    unsigned int row = 0;
+    while (true) {
+        size_t blockIndex = position >> UM_BIT_COUNT_LOG2(idxpyr_block_t);
+        unsigned int bit = position & (UM_BIT_COUNT(idxpyr_block_t) - 1);
+        idxpyr_block_t lowerBitsMask = (idxpyr_block_t) ((idxpyr_block_t) -1 >> (UM_BIT_COUNT(idxpyr_block_t) - 1 - bit));
+        idxpyr_block_t block = pyr->rows[row][blockIndex] & lowerBitsMask;
+        if (block) {
+            position = blockIndex << UM_BIT_COUNT_LOG2(idxpyr_block_t) | (size_t) bitops_findLastSet(block);
+            break;
+        }
+        if (!blockIndex)
+            return IDXPYR_EMPTY;
+        position = blockIndex - 1;
+        ++row;
+    }
+
+    while (row--) {
+        idxpyr_block_t block = pyr->rows[row][position];
+        position = position << UM_BIT_COUNT_LOG2(idxpyr_block_t) | (size_t) bitops_findLastSet(block);
+    }
+    return position;
+}
+
+idxpyr_cursor_t idxpyr_makeCursor(idxpyr_t *pyr, size_t from) {
+    return (idxpyr_cursor_t) { .pyr = pyr, .next = from };
+}
+
+size_t idxpyr_cursorNext(idxpyr_cursor_t *cursor) {
+    if (cursor->next == IDXPYR_EMPTY)
+        return IDXPYR_EMPTY;
+
+    size_t result = idxpyr_next(cursor->pyr, cursor->next);
+    cursor->next = (result == IDXPYR_EMPTY) ? IDXPYR_EMPTY : result + 1;
+    return result;
+}
+
 bool idxpyr_get(idxpyr_t *pyr, size_t index) {
     assert(INDEX_EXISTS());
     unsigned int bit = index & UM_BIT_COUNT(idxpyr_block_t) - 1;
     size_t blockIndex = index >> UM_BIT_COUNT_LOG2(idxpyr_block_t);
     idxpyr_block_t block = pyr->rows[0][blockIndex];
-    return block & 1 << bit;
+    return block & (idxpyr_block_t) 1 << bit;
 }
 
 void idxpyr_set(idxpyr_t *pyr, size_t index, bool state) {
     assert(INDEX_EXISTS());
+    if (pyr->isCounting && idxpyr_get(pyr, index) != state)
+        addToPrefixes(pyr, index >> UM_BIT_COUNT_LOG2(idxpyr_block_t), state ? 1 : (size_t) -1);
 
     bool lowerBlockState = state;
     for (unsigned int i = 0; i < pyr->height; ++i) {
         unsigned int bit = index & UM_BIT_COUNT(idxpyr_block_t) - 1;
         index >>= UM_BIT_COUNT_LOG2(idxpyr_block_t);
         idxpyr_block_t block = pyr->rows[i][index];
-        block = lowerBlockState ? (idxpyr_block_t) (block | 1 << bit) : (idxpyr_block_t) (block & ~(1 << bit));
+        idxpyr_block_t mask = (idxpyr_block_t) ((idxpyr_block_t) 1 << bit);
+        block = lowerBlockState ? (idxpyr_block_t) (block | mask) : (idxpyr_block_t) (block & ~mask);
 
         pyr->rows[i][index] = block;
         lowerBlockState = block;
@@ -93,23 +329,91 @@ void idxpyr_set(idxpyr_t *pyr, size_t index, bool state) {
 
 void idxpyr_setAll(idxpyr_t *pyr, bool state) {
     int setPattern = state ? 0xFF : 0;
-    memset(pyr->rows[0], setPattern, pyr->storeSize);
-    if (!state)
-        return;
+    for (unsigned int i = 0; i < pyr->height; ++i)
+        memset(pyr->rows[i], setPattern, getRowBlockCount(pyr->indexCountLog2, i) * sizeof(idxpyr_block_t));
 
     // fix top block
     unsigned int lastRowBlockCountLog2 = pyr->indexCountLog2 - UM_BIT_COUNT_LOG2(idxpyr_block_t);
     unsigned int topBlockActiveBitCountLog2 = lastRowBlockCountLog2 % UM_BIT_COUNT_LOG2(idxpyr_block_t);
     bool isTopBlockFilled = !topBlockActiveBitCountLog2;
-    if (isTopBlockFilled)
+    if (state && !isTopBlockFilled) {
+        idxpyr_block_t *topBlock = pyr->rows[pyr->height - 1];
+        *topBlock = (idxpyr_block_t) (((size_t) 1 << (1 << topBlockActiveBitCountLog2)) - 1);
+    }
+
+    if (pyr->isCounting)
+        recount(pyr, 0, (size_t) 1 << pyr->indexCountLog2);
+}
+
+void idxpyr_setRange(idxpyr_t *pyr, size_t begin, size_t end, bool state) {
+    assert(begin <= end && end <= (size_t) 1 << pyr->indexCountLog2);
+    if (begin == end)
         return;
 
-    idxpyr_block_t *topBlock = pyr->rows[pyr->height - 1];
-    *topBlock = (idxpyr_block_t) (((size_t) 1 << (1 << topBlockActiveBitCountLog2)) - 1);
+    fillRow(pyr->rows[0], begin, end, state);
+    size_t first = begin >> UM_BIT_COUNT_LOG2(idxpyr_block_t);
+    size_t last = (end - 1) >> UM_BIT_COUNT_LOG2(idxpyr_block_t);
+    for (unsigned int row = 1; row < pyr->height; ++row) {
+        // bits first..last summarize the blocks touched in the row below; setting leaves
+        // all of them non-empty, clearing empties all but the two boundary blocks
+        if (state) {
+            fillRow(pyr->rows[row], first, last + 1, true);
+        } else {
+            if (last > first + 1)
+                fillRow(pyr->rows[row], first + 1, last, false);
+            fillRow(pyr->rows[row], first, first + 1, pyr->rows[row - 1][first]);
+            fillRow(pyr->rows[row], last, last + 1, pyr->rows[row - 1][last]);
+        }
+        first >>= UM_BIT_COUNT_LOG2(idxpyr_block_t);
+        last >>= UM_BIT_COUNT_LOG2(idxpyr_block_t);
+    }
+
+    if (pyr->isCounting)
+        recount(pyr, begin, end);
+}
+
+void idxpyr_and(idxpyr_t *dst, const idxpyr_t *src) {
+    combine(dst, src, BITOPS_AND);
+}
+
+void idxpyr_or(idxpyr_t *dst, const idxpyr_t *src) {
+    combine(dst, src, BITOPS_OR);
+}
+
+void idxpyr_andNot(idxpyr_t *dst, const idxpyr_t *src) {
+    combine(dst, src, BITOPS_AND_NOT);
+}
+
+size_t idxpyr_count(const idxpyr_t *pyr) {
+    if (pyr->isCounting)
+        return pyr->setCount;
+
+    size_t blockCount = getRowBlockCount(pyr->indexCountLog2, 0);
+    size_t wordCount = blockCount * sizeof(idxpyr_block_t) / sizeof(uint64_t);
+    size_t result = bitops_popcountArray((const uint64_t *) pyr->rows[0], wordCount);
+    // leaf rows smaller than a word
+    for (size_t i = wordCount * sizeof(uint64_t) / sizeof(idxpyr_block_t); i < blockCount; ++i)
+        result += bitops_popcount(pyr->rows[0][i]);
+    return result;
 }
 
-void idxpyr_increaseSize(idxpyr_t *pyr) {
+int idxpyr_increaseSize(idxpyr_t *pyr) {
+    if (pyr->indexCountLog2 < pyr->maxIndexCountLog2) {
+        // the new prefixes are allocated before the rows are touched
+        idxpyr_t sized = { .indexCountLog2 = pyr->indexCountLog2 + 1, .height = getHeight(pyr->indexCountLog2 + 1) };
+        if (pyr->isCounting && allocPrefixes(&sized))
+            return -1;
+        growInPlace(pyr);
+        if (pyr->isCounting)
+            replacePrefixes(pyr, &sized);
+        return 0;
+    }
+
     idxpyr_t biggerPyr = idxpyr_make(pyr->indexCountLog2 + 1, pyr->stateInit);
+    if (!biggerPyr.rows[0]) {
+        errno = ENOMEM;
+        return -1;
+    }
     idxpyr_block_t *biggerPyrTopBlock = biggerPyr.rows[biggerPyr.height - 1];
     idxpyr_block_t biggerPyrTopBlockBkp = *biggerPyrTopBlock;
 
@@ -125,14 +429,230 @@ void idxpyr_increaseSize(idxpyr_t *pyr) {
     idxpyr_block_t resetBits = (topBlockBitCountToReset == 1) ? !!topBlock : topBlock;
     idxpyr_block_t resetMask = (idxpyr_block_t) (((size_t) 1 << topBlockBitCountToReset) - 1);
     *biggerPyrTopBlock = (biggerPyrTopBlockBkp & ~resetMask) | resetBits;
+    if (pyr->isCounting && idxpyr_enableCounting(&biggerPyr)) {
+        idxpyr_destroy(&biggerPyr);
+        return -1;
+    }
 
     idxpyr_destroy(pyr);
     *pyr = biggerPyr;
+    return 0;
+}
+
+int idxpyr_shrink(idxpyr_t *pyr) {
+    size_t last = idxpyr_getLast(pyr);
+    unsigned int indexCountLog2 = (last && last != IDXPYR_EMPTY) ? (unsigned int) bitops_findLastSet(last) + 1 : 0;
+    if (indexCountLog2 < UM_BIT_COUNT_LOG2(idxpyr_block_t))
+        indexCountLog2 = UM_BIT_COUNT_LOG2(idxpyr_block_t);
+    if (indexCountLog2 >= pyr->indexCountLog2)
+        return 0;
+
+    if (pyr->maxIndexCountLog2) {
+        idxpyr_t sized = { .indexCountLog2 = indexCountLog2, .height = getHeight(indexCountLog2) };
+        if (pyr->isCounting && allocPrefixes(&sized))
+            return -1;
+        shrinkInPlace(pyr, indexCountLog2);
+        if (pyr->isCounting)
+            replacePrefixes(pyr, &sized);
+        return 0;
+    }
+
+    // the tail is empty, so the row prefixes are already the smaller pyramid
+    idxpyr_t smallerPyr = idxpyr_make(indexCountLog2, pyr->stateInit);
+    if (!smallerPyr.rows[0]) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (unsigned int i = 0; i < smallerPyr.height; ++i)
+        memcpy(smallerPyr.rows[i], pyr->rows[i], getRowBlockCount(indexCountLog2, i) * sizeof(idxpyr_block_t));
+    if (pyr->isCounting && idxpyr_enableCounting(&smallerPyr)) {
+        idxpyr_destroy(&smallerPyr);
+        return -1;
+    }
+    idxpyr_destroy(pyr);
+    *pyr = smallerPyr;
+    return 0;
+}
+
+int idxpyr_enableCounting(idxpyr_t *pyr) {
+    if (pyr->isCounting)
+        return 0;
+
+    if (allocPrefixes(pyr))
+        return -1;
+    pyr->isCounting = true;
+    recount(pyr, 0, (size_t) 1 << pyr->indexCountLog2);
+    return 0;
+}
+
+void idxpyr_disableCounting(idxpyr_t *pyr) {
+    free(pyr->leafPrefixes);
+    pyr->leafPrefixes = NULL;
+    memset(pyr->prefixes, 0, sizeof(pyr->prefixes));
+    pyr->setCount = 0;
+    pyr->isCounting = false;
+}
+
+size_t idxpyr_rank(idxpyr_t *pyr, size_t index) {
+    assert(pyr->isCounting && index <= (size_t) 1 << pyr->indexCountLog2);
+    if (index == (size_t) 1 << pyr->indexCountLog2)
+        return pyr->setCount;
+
+    // the bits left of index in its leaf, then the siblings left of the path on every row
+    size_t blockIndex = index >> UM_BIT_COUNT_LOG2(idxpyr_block_t);
+    unsigned int bit = index & (UM_BIT_COUNT(idxpyr_block_t) - 1);
+    size_t result = bitops_popcount(pyr->rows[0][blockIndex] & (idxpyr_block_t) (((idxpyr_block_t) 1 << bit) - 1));
+    for (unsigned int row = 0; row < pyr->height - 1; ++row) {
+        result += getPrefix(pyr, row, blockIndex);
+        blockIndex >>= UM_BIT_COUNT_LOG2(idxpyr_block_t);
+    }
+    return result;
+}
+
+size_t idxpyr_select(idxpyr_t *pyr, size_t k) {
+    assert(pyr->isCounting);
+    if (k >= pyr->setCount)
+        return IDXPYR_EMPTY;
+
+    size_t position = 0;
+    for (unsigned int row = pyr->height - 1; row; --row) {
+        // the last child whose prefix is at most k -- the prefixes never decrease, and the
+        // next one exceeds k, so that child is not empty
+        size_t firstChild = position << UM_BIT_COUNT_LOG2(idxpyr_block_t);
+        size_t low = 0;
+        size_t high = getChildCount(pyr->indexCountLog2, row - 1);
+        while (high - low > 1) {
+            size_t middle = (low + high) / 2;
+            if (getPrefix(pyr, row - 1, firstChild | middle) <= k)
+                low = middle;
+            else
+                high = middle;
+        }
+        position = firstChild | low;
+        k -= getPrefix(pyr, row - 1, position);
+    }
+    uint64_t kthBit = bitops_pdep((uint64_t) 1 << k, pyr->rows[0][position]);
+    return position << UM_BIT_COUNT_LOG2(idxpyr_block_t) | bitops_ctz(kthBit);
+}
+
+int idxpyr_save(const idxpyr_t *pyr, const char *path) {
+    idxpyr_fileHeader_t header = { .magic = IDXPYR_FILE_MAGIC, .version = IDXPYR_FILE_VERSION,
+        .blockBits = IDXPYR_BLOCK_BITS, .indexCountLog2 = pyr->indexCountLog2, .stateInit = pyr->stateInit,
+        .storeOffset = IDXPYR_FILE_STORE_OFFSET, .storeSize = getPackedStoreSize(pyr->indexCountLog2),
+        .checksum = getRowsChecksum(pyr) };
+
+    size_t pathLength = strlen(path);
+    char *tmpPath = malloc(pathLength + sizeof(".XXXXXX"));
+    if (!tmpPath) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(tmpPath, path, pathLength);
+    memcpy(tmpPath + pathLength, ".XXXXXX", sizeof(".XXXXXX"));
+    int fd = mkstemp(tmpPath);
+    if (fd == -1)
+        goto freePath;
+
+    size_t offset = IDXPYR_FILE_STORE_OFFSET;
+    for (unsigned int i = 0; i < pyr->height; ++i) {
+        size_t rowSize = getRowBlockCount(pyr->indexCountLog2, i) * sizeof(idxpyr_block_t);
+        if (pwriteAll(fd, pyr->rows[i], rowSize, offset))
+            goto removeFile;
+        offset += rowSize;
+    }
+    if (pwriteAll(fd, &header, sizeof(header), 0) || fsync(fd))
+        goto removeFile;
+    if (close(fd)) {
+        fd = -1;
+        goto removeFile;
+    }
+    if (rename(tmpPath, path)) {
+        fd = -1;
+        goto removeFile;
+    }
+    free(tmpPath);
+    return 0;
+
+removeFile:;
+    int error = errno;
+    if (fd != -1)
+        close(fd);
+    unlink(tmpPath);
+    errno = error;
+freePath:
+    free(tmpPath);
+    return -1;
+}
+
+int idxpyr_mapFile(idxpyr_t *pyrOut, const char *path, bool copyOnWrite) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    idxpyr_fileHeader_t header;
+    struct stat st;
+    if (fstat(fd, &st))
+        goto closeFd;
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)
+            || header.magic != IDXPYR_FILE_MAGIC || header.version != IDXPYR_FILE_VERSION
+            || header.blockBits != IDXPYR_BLOCK_BITS
+            || header.indexCountLog2 < UM_BIT_COUNT_LOG2(idxpyr_block_t)
+            || header.indexCountLog2 > IDXPYR_MAX_INDEX_COUNT_LOG2
+            || header.storeSize != getPackedStoreSize(header.indexCountLog2)
+            || header.storeOffset < sizeof(header) || header.storeOffset % sizeof(idxpyr_block_t)
+            || (uint64_t) st.st_size < header.storeOffset + header.storeSize) {
+        errno = IDXPYR_ERROR_FORMAT;
+        goto closeFd;
+    }
+
+    bool isMappable = !(header.storeOffset % (size_t) sysconf(_SC_PAGESIZE));
+    void *store;
+    if (isMappable) {
+        int prot = copyOnWrite ? PROT_READ | PROT_WRITE : PROT_READ;
+        store = mmap(NULL, header.storeSize, prot, MAP_PRIVATE, fd, header.storeOffset);
+        if (store == MAP_FAILED)
+            goto closeFd;
+    } else {
+        store = malloc(header.storeSize);
+        if (!store) {
+            errno = ENOMEM;
+            goto closeFd;
+        }
+        if (preadAll(fd, store, header.storeSize, header.storeOffset)) {
+            free(store);
+            goto closeFd;
+        }
+    }
+    close(fd);
+
+    idxpyr_t pyr = { .indexCountLog2 = header.indexCountLog2, .height = getHeight(header.indexCountLog2),
+        .storeSize = header.storeSize, .stateInit = header.stateInit, .isMapped = isMappable };
+    pyr.rows[0] = store;
+    for (unsigned int i = 1; i < pyr.height; ++i)
+        pyr.rows[i] = pyr.rows[i - 1] + getRowBlockCount(pyr.indexCountLog2, i - 1);
+    if (getRowsChecksum(&pyr) != header.checksum) {
+        idxpyr_destroy(&pyr);
+        errno = IDXPYR_ERROR_FORMAT;
+        return -1;
+    }
+
+    *pyrOut = pyr;
+    return 0;
+
+closeFd:;
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
 }
 
 void idxpyr_destroy(idxpyr_t *pyr) {
-    free(pyr->rows[0]);
+    if (pyr->maxIndexCountLog2 || pyr->isMapped)
+        munmap(pyr->rows[0], pyr->storeSize);
+    else
+        free(pyr->rows[0]);
     memset(pyr->rows, 0, sizeof(pyr->rows));
+    idxpyr_disableCounting(pyr);
 }
 
 // private functions
@@ -145,26 +665,279 @@ static unsigned int getHeight(unsigned int indexCountLog2) {
         + !!(lastRowBlockCountLog2 % UM_BIT_COUNT_LOG2(idxpyr_block_t));
 }
 
-static inline int countTrailingZeros(uint32_t val) {
-    if (!val)
+static inline size_t getRowBitCount(const idxpyr_t *pyr, unsigned int row) {
+    return (size_t) 1 << (pyr->indexCountLog2 - row * UM_BIT_COUNT_LOG2(idxpyr_block_t));
+}
+
+static inline size_t getRowBlockCount(unsigned int indexCountLog2, unsigned int row) {
+    unsigned int rowBitCountLog2 = indexCountLog2 - row * UM_BIT_COUNT_LOG2(idxpyr_block_t);
+    return rowBitCountLog2 > UM_BIT_COUNT_LOG2(idxpyr_block_t)
+        ? (size_t) 1 << (rowBitCountLog2 - UM_BIT_COUNT_LOG2(idxpyr_block_t)) : 1;
+}
+
+static inline size_t getChildCount(unsigned int indexCountLog2, unsigned int row) {
+    size_t blockCount = getRowBlockCount(indexCountLog2, row);
+    return blockCount < UM_BIT_COUNT(idxpyr_block_t) ? blockCount : UM_BIT_COUNT(idxpyr_block_t);
+}
+
+static inline size_t getPrefix(const idxpyr_t *pyr, unsigned int row, size_t blockIndex) {
+    return row ? pyr->prefixes[row][blockIndex] : pyr->leafPrefixes[blockIndex];
+}
+
+static size_t getBlockCount(const idxpyr_t *pyr, unsigned int row, size_t blockIndex) {
+    size_t result = 0;
+    for (; row; --row) {
+        blockIndex = blockIndex << UM_BIT_COUNT_LOG2(idxpyr_block_t) | (getChildCount(pyr->indexCountLog2, row - 1) - 1);
+        result += getPrefix(pyr, row - 1, blockIndex);
+    }
+    return result + bitops_popcount(pyr->rows[0][blockIndex]);
+}
+
+static int allocPrefixes(idxpyr_t *pyr) {
+    // one prefix per block of every row but the top one, laid out like them; the leaf
+    // prefixes go first, their count is a multiple of the block bits whenever upper
+    // rows follow, which keeps those aligned
+    if (pyr->height == 1)
+        return 0;
+
+    size_t leafBlockCount = getRowBlockCount(pyr->indexCountLog2, 0);
+    size_t upperBlockCount = 0;
+    for (unsigned int i = 1; i < pyr->height - 1; ++i)
+        upperBlockCount += getRowBlockCount(pyr->indexCountLog2, i);
+    uint16_t *store = malloc(leafBlockCount * sizeof(uint16_t) + upperBlockCount * sizeof(size_t));
+    if (!store) {
+        errno = ENOMEM;
         return -1;
+    }
+    pyr->leafPrefixes = store;
+    size_t *upper = (size_t *) (store + leafBlockCount);
+    for (unsigned int i = 1; i < pyr->height - 1; ++i) {
+        pyr->prefixes[i] = upper;
+        upper += getRowBlockCount(pyr->indexCountLog2, i);
+    }
+    return 0;
+}
+
+static void replacePrefixes(idxpyr_t *pyr, const idxpyr_t *sized) {
+    free(pyr->leafPrefixes);
+    pyr->leafPrefixes = sized->leafPrefixes;
+    memcpy(pyr->prefixes, sized->prefixes, sizeof(pyr->prefixes));
+    recount(pyr, 0, (size_t) 1 << pyr->indexCountLog2);
+}
+
+static void addToPrefixes(idxpyr_t *pyr, size_t blockIndex, size_t delta) {
+    pyr->setCount += delta;
+    for (unsigned int row = 0; row < pyr->height - 1; ++row) {
+        size_t end = (blockIndex | (UM_BIT_COUNT(idxpyr_block_t) - 1)) + 1;
+        size_t rowBlockCount = getRowBlockCount(pyr->indexCountLog2, row);
+        if (end > rowBlockCount)
+            end = rowBlockCount;
+        if (!row) {
+            for (size_t i = blockIndex + 1; i < end; ++i)
+                pyr->leafPrefixes[i] = (uint16_t) (pyr->leafPrefixes[i] + delta);
+        } else {
+            for (size_t i = blockIndex + 1; i < end; ++i)
+                pyr->prefixes[row][i] += delta;
+        }
+        blockIndex >>= UM_BIT_COUNT_LOG2(idxpyr_block_t);
+    }
+}
+
+static void recount(idxpyr_t *pyr, size_t begin, size_t end) {
+    if (begin == end)
+        return;
+
+    // bottom up: the counts of a row's blocks read the prefixes of the rows below
+    size_t first = begin >> UM_BIT_COUNT_LOG2(idxpyr_block_t);
+    size_t last = (end - 1) >> UM_BIT_COUNT_LOG2(idxpyr_block_t);
+    for (unsigned int row = 0; row < pyr->height - 1; ++row) {
+        first >>= UM_BIT_COUNT_LOG2(idxpyr_block_t);
+        last >>= UM_BIT_COUNT_LOG2(idxpyr_block_t);
+        size_t childCount = getChildCount(pyr->indexCountLog2, row);
+        for (size_t parent = first; parent <= last; ++parent) {
+            size_t prefix = 0;
+            size_t firstChild = parent << UM_BIT_COUNT_LOG2(idxpyr_block_t);
+            for (size_t i = firstChild; i < firstChild + childCount; ++i) {
+                if (!row)
+                    pyr->leafPrefixes[i] = (uint16_t) prefix;
+                else
+                    pyr->prefixes[row][i] = prefix;
+                prefix += getBlockCount(pyr, row, i);
+            }
+        }
+    }
+    pyr->setCount = getBlockCount(pyr, pyr->height - 1, 0);
+}
+
+static void combine(idxpyr_t *dst, const idxpyr_t *src, bitops_combine_t op) {
+    assert(dst->indexCountLog2 == src->indexCountLog2);
+    size_t blockCount = getRowBlockCount(dst->indexCountLog2, 0);
+    size_t wordCount = blockCount * sizeof(idxpyr_block_t) / sizeof(uint64_t);
+    bitops_combineArrays((uint64_t *) dst->rows[0], (const uint64_t *) src->rows[0], wordCount, op);
+    // leaf rows smaller than a word
+    for (size_t i = wordCount * sizeof(uint64_t) / sizeof(idxpyr_block_t); i < blockCount; ++i) {
+        idxpyr_block_t block = src->rows[0][i];
+        if (op == BITOPS_OR)
+            applyMask(dst->rows[0] + i, block, true);
+        else
+            applyMask(dst->rows[0] + i, op == BITOPS_AND ? (idxpyr_block_t) ~block : block, false);
+    }
 
-    uint32_t leastBit = val & ~(val - 1);
-    int result = 0;
-    if (leastBit & 0xFFFF0000)
-        result += 16;
-    if (leastBit & 0xFF00FF00)
-        result += 8;
-    if (leastBit & 0xF0F0F0F0)
-        result += 4;
-    if (leastBit & 0xCCCCCCCC)
-        result += 2;
-    if (leastBit & 0xAAAAAAAA)
-        result += 1;
+    rebuildSummaries(dst);
+    if (dst->isCounting)
+        recount(dst, 0, (size_t) 1 << dst->indexCountLog2);
+}
 
+static void rebuildSummaries(idxpyr_t *pyr) {
+    for (unsigned int row = 1; row < pyr->height; ++row) {
+        size_t lowerBlockCount = getRowBlockCount(pyr->indexCountLog2, row - 1);
+        size_t blockCount = getRowBlockCount(pyr->indexCountLog2, row);
+        // the top block may summarize fewer than a block's worth of blocks
+        size_t childCount = lowerBlockCount < UM_BIT_COUNT(idxpyr_block_t) ? lowerBlockCount : UM_BIT_COUNT(idxpyr_block_t);
+        const idxpyr_block_t *lower = pyr->rows[row - 1];
+        for (size_t i = 0; i < blockCount; ++i, lower += childCount) {
+            idxpyr_block_t block = 0;
+            for (size_t j = 0; j < childCount; ++j)
+                block |= (idxpyr_block_t) ((idxpyr_block_t) !!lower[j] << j);
+            pyr->rows[row][i] = block;
+        }
+    }
+}
+
+static void growInPlace(idxpyr_t *pyr) {
+    unsigned int oldIndexCountLog2 = pyr->indexCountLog2;
+    unsigned int oldHeight = pyr->height;
+    bool wasEmpty = !*pyr->rows[oldHeight - 1];
+    pyr->indexCountLog2 = oldIndexCountLog2 + 1;
+    pyr->height = getHeight(pyr->indexCountLog2);
+
+    // a new top row summarizes the old pyramid in its bit 0
+    for (unsigned int row = oldHeight; row < pyr->height; ++row)
+        applyMask(pyr->rows[row], 1, !wasEmpty);
+    if (!pyr->stateInit)
+        return;
+
+    for (unsigned int row = 0; row < pyr->height; ++row) {
+        size_t oldBitCount = row < oldHeight
+            ? (size_t) 1 << (oldIndexCountLog2 - row * UM_BIT_COUNT_LOG2(idxpyr_block_t)) : 1;
+        fillRow(pyr->rows[row], oldBitCount, getRowBitCount(pyr, row), true);
+    }
+}
+
+static void shrinkInPlace(idxpyr_t *pyr, unsigned int indexCountLog2) {
+    size_t pageMask = (size_t) sysconf(_SC_PAGESIZE) - 1;
+    unsigned int height = getHeight(indexCountLog2);
+    for (unsigned int row = 0; row < pyr->height; ++row) {
+        size_t keptSize = 0;
+        if (row < height) {
+            keptSize = getRowBlockCount(indexCountLog2, row) * sizeof(idxpyr_block_t);
+            keptSize = (keptSize + pageMask) & ~pageMask;
+        } else {
+            // only bit 0 of the dropped top rows can be set -- the tail is empty
+            *pyr->rows[row] = 0;
+        }
+        size_t usedSize = getRowBlockCount(pyr->indexCountLog2, row) * sizeof(idxpyr_block_t);
+        usedSize = (usedSize + pageMask) & ~pageMask;
+        if (usedSize > keptSize)
+            madvise((char *) pyr->rows[row] + keptSize, usedSize - keptSize, MADV_DONTNEED);
+    }
+    pyr->indexCountLog2 = indexCountLog2;
+    pyr->height = height;
+}
+
+static size_t getPackedStoreSize(unsigned int indexCountLog2) {
+    size_t blockCount = 0;
+    for (unsigned int i = 0; i < getHeight(indexCountLog2); ++i)
+        blockCount += getRowBlockCount(indexCountLog2, i);
+    return blockCount * sizeof(idxpyr_block_t);
+}
+
+static uint64_t getRowsChecksum(const idxpyr_t *pyr) {
+    uint64_t result = pyr->indexCountLog2;
+    for (unsigned int i = 0; i < pyr->height; ++i)
+        result = hashBytes(pyr->rows[i], getRowBlockCount(pyr->indexCountLog2, i) * sizeof(idxpyr_block_t), result);
     return result;
 }
 
+// four independent multiply chains, so a row hashes at a few bytes per cycle
+static uint64_t hashBytes(const void *data, size_t size, uint64_t seed) {
+    const uint64_t prime = 0x9E3779B97F4A7C15u;
+    const unsigned char *bytes = data;
+    uint64_t lanes[4] = { seed, seed + 1, seed + 2, seed + 3 };
+    size_t i = 0;
+    for (; i + 4 * sizeof(uint64_t) <= size; i += 4 * sizeof(uint64_t)) {
+        for (int j = 0; j < 4; ++j) {
+            uint64_t word;
+            memcpy(&word, bytes + i + (size_t) j * sizeof(uint64_t), sizeof(word));
+            lanes[j] = (lanes[j] ^ word) * prime;
+            lanes[j] ^= lanes[j] >> 29;
+        }
+    }
+    uint64_t result = size;
+    for (int j = 0; j < 4; ++j)
+        result = (result ^ lanes[j]) * prime;
+    for (; i < size; ++i)
+        result = (result ^ bytes[i]) * prime;
+    return result ^ result >> 32;
+}
+
+static int pwriteAll(int fd, const void *data, size_t size, size_t offset) {
+    const char *p = data;
+    while (size) {
+        ssize_t written = pwrite(fd, p, size, (off_t) offset);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += written;
+        size -= (size_t) written;
+        offset += (size_t) written;
+    }
+    return 0;
+}
+
+static int preadAll(int fd, void *data, size_t size, size_t offset) {
+    char *p = data;
+    while (size) {
+        ssize_t readCount = pread(fd, p, size, (off_t) offset);
+        if (readCount < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (!readCount) {
+            errno = IDXPYR_ERROR_FORMAT;
+            return -1;
+        }
+        p += readCount;
+        size -= (size_t) readCount;
+        offset += (size_t) readCount;
+    }
+    return 0;
+}
+
+static inline void applyMask(idxpyr_block_t *block, idxpyr_block_t mask, bool state) {
+    *block = state ? (idxpyr_block_t) (*block | mask) : (idxpyr_block_t) (*block & ~mask);
+}
+
+static void fillRow(idxpyr_block_t *row, size_t begin, size_t end, bool state) {
+    size_t firstBlock = begin >> UM_BIT_COUNT_LOG2(idxpyr_block_t);
+    size_t lastBlock = (end - 1) >> UM_BIT_COUNT_LOG2(idxpyr_block_t);
+    unsigned int firstBit = begin & (UM_BIT_COUNT(idxpyr_block_t) - 1);
+    unsigned int lastBit = (end - 1) & (UM_BIT_COUNT(idxpyr_block_t) - 1);
+    idxpyr_block_t firstMask = (idxpyr_block_t) ((idxpyr_block_t) -1 << firstBit);
+    idxpyr_block_t lastMask = (idxpyr_block_t) ((idxpyr_block_t) -1 >> (UM_BIT_COUNT(idxpyr_block_t) - 1 - lastBit));
+
+    if (firstBlock == lastBlock) {
+        applyMask(row + firstBlock, firstMask & lastMask, state);
+        return;
+    }
+    applyMask(row + firstBlock, firstMask, state);
+    memset(row + firstBlock + 1, state ? 0xFF : 0, (lastBlock - firstBlock - 1) * sizeof(idxpyr_block_t));
+    applyMask(row + lastBlock, lastMask, state);
+}
+
 // unittest
 // -----------------------------------------------------------------------------
 #ifdef UNITTEST
@@ -178,6 +951,10 @@ int idxpyrMacro_maxLastRowBlockCountLog2(void) {
     ASSERT(IDXPYR_MAX_LAST_ROW_BLOCK_COUNT_LOG2 == IDXPYR_MAX_INDEX_COUNT_LOG2 - 4);
 #undef idxpyr_block_t
 
+#define idxpyr_block_t uint64_t
+    ASSERT(IDXPYR_MAX_LAST_ROW_BLOCK_COUNT_LOG2 == IDXPYR_MAX_INDEX_COUNT_LOG2 - 6);
+#undef idxpyr_block_t
+
     return 0;
 }
 
@@ -193,6 +970,11 @@ int idxpyrMacro_maxHeight(void) {
     ASSERT(IDXPYR_MAX_HEIGHT == IDXPYR_MAX_LAST_ROW_BLOCK_COUNT_LOG2 / 4 + doesntDivideEvenly);
 #undef idxpyr_block_t
 
+#define idxpyr_block_t uint64_t
+    doesntDivideEvenly = (IDXPYR_MAX_LAST_ROW_BLOCK_COUNT_LOG2 % 6);
+    ASSERT(IDXPYR_MAX_HEIGHT == IDXPYR_MAX_LAST_ROW_BLOCK_COUNT_LOG2 / 6 + doesntDivideEvenly);
+#undef idxpyr_block_t
+
     return 0;
 }
 
@@ -212,17 +994,6 @@ int idxpyr_getHeight(void) {
     return 0;
 }
 
-int idxpyr_countTrailingZeros() {
-    ASSERT(countTrailingZeros(0) == -1);
-    ASSERT(countTrailingZeros(0x0F00) == 8);
-    ASSERT(countTrailingZeros(0x10000000) == 28);
-    ASSERT(countTrailingZeros(0x20000000) == 29);
-    ASSERT(countTrailingZeros(0x40000000) == 30);
-    ASSERT(countTrailingZeros(0x80000000) == 31);
-
-    return 0;
-}
-
 int idxpyr_plainMake(void) {
     idxpyr_t pyr = idxpyr_make(8, false);
     ASSERT(pyr.rows[0]);
@@ -289,6 +1060,104 @@ int idxpyr_getFirstWithSingleBlockPyramid(void) {
     return 0;
 }
 
+int idxpyr_plainNext(void) {
+    idxpyr_t pyr = idxpyr_make(12, false);
+    idxpyr_set(&pyr, 3, true);
+    idxpyr_set(&pyr, 42, true);
+    idxpyr_set(&pyr, 4000, true);
+    ASSERT(idxpyr_next(&pyr, 0) == 3);
+    ASSERT(idxpyr_next(&pyr, 3) == 3);
+    ASSERT(idxpyr_next(&pyr, 4) == 42);
+    ASSERT(idxpyr_next(&pyr, 43) == 4000);
+    ASSERT(idxpyr_next(&pyr, 4001) == IDXPYR_EMPTY);
+    ASSERT(idxpyr_next(&pyr, 4095) == IDXPYR_EMPTY);
+    ASSERT(idxpyr_next(&pyr, 1 << 20) == IDXPYR_EMPTY);
+
+    idxpyr_destroy(&pyr);
+    return 0;
+}
+
+int idxpyr_plainPrev(void) {
+    idxpyr_t pyr = idxpyr_make(12, false);
+    idxpyr_set(&pyr, 3, true);
+    idxpyr_set(&pyr, 42, true);
+    idxpyr_set(&pyr, 4000, true);
+    ASSERT(idxpyr_prev(&pyr, 4095) == 4000);
+    ASSERT(idxpyr_prev(&pyr, 4000) == 4000);
+    ASSERT(idxpyr_prev(&pyr, 3999) == 42);
+    ASSERT(idxpyr_prev(&pyr, 41) == 3);
+    ASSERT(idxpyr_prev(&pyr, 2) == IDXPYR_EMPTY);
+    ASSERT(idxpyr_prev(&pyr, 1 << 20) == 4000);
+
+    idxpyr_destroy(&pyr);
+    return 0;
+}
+
+int idxpyr_plainGetLast(void) {
+    idxpyr_t pyr = idxpyr_make(9, false);
+    ASSERT(idxpyr_getLast(&pyr) == IDXPYR_EMPTY);
+    idxpyr_set(&pyr, 0, true);
+    ASSERT(idxpyr_getLast(&pyr) == 0);
+    idxpyr_set(&pyr, 511, true);
+    ASSERT(idxpyr_getLast(&pyr) == 511);
+    idxpyr_destroy(&pyr);
+
+    pyr = idxpyr_make(0, true);
+    ASSERT(idxpyr_getLast(&pyr) == UM_BIT_COUNT(idxpyr_block_t) - 1);
+
+    idxpyr_destroy(&pyr);
+    return 0;
+}
+
+int idxpyr_nextAndPrevMatchLinearScan(void) {
+    const unsigned int indexCountLog2 = 13;
+    const size_t indexCount = (size_t) 1 << indexCountLog2;
+    idxpyr_t pyr = idxpyr_make(indexCountLog2, false);
+    uint32_t x = 2463534242;
+    for (int i = 0; i < 40; ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        idxpyr_set(&pyr, x & (indexCount - 1), true);
+    }
+
+    size_t expectedNext = IDXPYR_EMPTY;
+    for (size_t i = indexCount; i--; ) {
+        if (idxpyr_get(&pyr, i))
+            expectedNext = i;
+        ASSERT(idxpyr_next(&pyr, i) == expectedNext);
+    }
+    size_t expectedPrev = IDXPYR_EMPTY;
+    for (size_t i = 0; i < indexCount; ++i) {
+        if (idxpyr_get(&pyr, i))
+            expectedPrev = i;
+        ASSERT(idxpyr_prev(&pyr, i) == expectedPrev);
+    }
+
+    idxpyr_destroy(&pyr);
+    return 0;
+}
+
+int idxpyr_cursorVisitsSetIndicesInOrder(void) {
+    idxpyr_t pyr = idxpyr_make(10, false);
+    const size_t indices[] = { 0, 17, 18, 255, 256, 1023 };
+    for (size_t i = 0; i < ARRAY_LENGTH(indices); ++i)
+        idxpyr_set(&pyr, indices[i], true);
+
+    idxpyr_cursor_t cursor = idxpyr_makeCursor(&pyr, 0);
+    for (size_t i = 0; i < ARRAY_LENGTH(indices); ++i) {
+        size_t index = idxpyr_cursorNext(&cursor);
+        ASSERT(index == indices[i]);
+        // clearing the current index doesn't disturb the walk
+        idxpyr_set(&pyr, index, false);
+    }
+    ASSERT(idxpyr_cursorNext(&cursor) == IDXPYR_EMPTY);
+    ASSERT(idxpyr_cursorNext(&cursor) == IDXPYR_EMPTY);
+
+    idxpyr_destroy(&pyr);
+    return 0;
+}
+
 int idxpyr_plainPopFirst(void) {
     idxpyr_t pyr = idxpyr_make(6, false);
     idxpyr_set(&pyr, 42, true);
@@ -357,6 +1226,191 @@ int idxpyr_setAllFalseClearsEveryIndex(void) {
     return 0;
 }
 
+static bool testStoresEqual(const idxpyr_t *a, const idxpyr_t *b) {
+    return a->storeSize == b->storeSize && !memcmp(a->rows[0], b->rows[0], a->storeSize);
+}
+
+int idxpyr_setRangeWithinSingleBlock(void) {
+    idxpyr_t pyr = idxpyr_make(10, false);
+    idxpyr_setRange(&pyr, 2, 5, true);
+    ASSERT(!idxpyr_get(&pyr, 1));
+    ASSERT(idxpyr_get(&pyr, 2) && idxpyr_get(&pyr, 4));
+    ASSERT(!idxpyr_get(&pyr, 5));
+    ASSERT(idxpyr_getFirst(&pyr) == 2);
+    idxpyr_setRange(&pyr, 3, 3, false);
+    ASSERT(idxpyr_get(&pyr, 3));
+
+    idxpyr_destroy(&pyr);
+    return 0;
+}
+
+int idxpyr_setRangeMatchesSingleSets(void) {
+    const unsigned int indexCountLog2 = 14;
+    const size_t indexCount = (size_t) 1 << indexCountLog2;
+    idxpyr_t pyr = idxpyr_make(indexCountLog2, false);
+    idxpyr_t expected = idxpyr_make(indexCountLog2, false);
+    uint32_t x = 2463534242;
+    for (int i = 0; i < 200; ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        size_t begin = x & (indexCount - 1);
+        size_t end = begin + (x >> 16) % (i % 2 ? 64 : 4096);
+        end = end < indexCount ? end : indexCount;
+        bool state = i % 3;
+
+        idxpyr_setRange(&pyr, begin, end, state);
+        for (size_t j = begin; j < end; ++j)
+            idxpyr_set(&expected, j, state);
+        ASSERT(testStoresEqual(&pyr, &expected));
+    }
+    idxpyr_setRange(&pyr, 0, indexCount, false);
+    ASSERT(idxpyr_getFirst(&pyr) == IDXPYR_EMPTY);
+    idxpyr_setRange(&pyr, 0, indexCount, true);
+    idxpyr_setAll(&expected, true);
+    ASSERT(testStoresEqual(&pyr, &expected));
+
+    idxpyr_destroy(&expected);
+    idxpyr_destroy(&pyr);
+    return 0;
+}
+
+int idxpyr_makeFromSortedMatchesSingleSets(void) {
+    const size_t indices[] = { 0, 1, 1, 15, 16, 17, 255, 256, 4000, 4095, 70000 };
+    idxpyr_t pyr = idxpyr_makeFromSorted(indices, ARRAY_LENGTH(indices), 0);
+    ASSERT(pyr.indexCountLog2 == 17);
+
+    idxpyr_t expected = idxpyr_make(17, false);
+    for (size_t i = 0; i < ARRAY_LENGTH(indices); ++i)
+        idxpyr_set(&expected, indices[i], true);
+    ASSERT(testStoresEqual(&pyr, &expected));
+    idxpyr_destroy(&pyr);
+
+    pyr = idxpyr_makeFromSorted(NULL, 0, 5);
+    ASSERT(pyr.indexCountLog2 == MAX(5, UM_BIT_COUNT_LOG2(idxpyr_block_t)));
+    ASSERT(idxpyr_getFirst(&pyr) == IDXPYR_EMPTY);
+
+    idxpyr_destroy(&expected);
+    idxpyr_destroy(&pyr);
+    return 0;
+}
+
+static size_t testRankByScan(idxpyr_t *pyr, size_t index) {
+    size_t result = 0;
+    for (size_t i = 0; i < index; ++i)
+        result += idxpyr_get(pyr, i);
+    return result;
+}
+
+int idxpyr_rankAndSelectOnSingleBlock(void) {
+    idxpyr_t pyr = idxpyr_make(0, false);
+    ASSERT(!idxpyr_enableCounting(&pyr));
+    idxpyr_set(&pyr, 1, true);
+    idxpyr_set(&pyr, 5, true);
+    ASSERT(idxpyr_rank(&pyr, 0) == 0);
+    ASSERT(idxpyr_rank(&pyr, 2) == 1);
+    ASSERT(idxpyr_rank(&pyr, UM_BIT_COUNT(idxpyr_block_t)) == 2);
+    ASSERT(idxpyr_select(&pyr, 0) == 1);
+    ASSERT(idxpyr_select(&pyr, 1) == 5);
+    ASSERT(idxpyr_select(&pyr, 2) == IDXPYR_EMPTY);
+
+    idxpyr_destroy(&pyr);
+    return 0;
+}
+
+int idxpyr_rankAndSelectMatchScan(void) {
+    const unsigned int indexCountLog2 = 13;
+    const size_t indexCount = (size_t) 1 << indexCountLog2;
+    idxpyr_t pyr = idxpyr_make(indexCountLog2, false);
+    idxpyr_setRange(&pyr, 100, 300, true);
+    ASSERT(!idxpyr_enableCounting(&pyr));
+
+    uint32_t x = 2463534242;
+    for (int i = 0; i < 3000; ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        idxpyr_set(&pyr, x & (indexCount - 1), i % 4);
+    }
+    idxpyr_setRange(&pyr, 5000, 6000, false);
+    idxpyr_popFirst(&pyr);
+
+    size_t rank = 0;
+    for (size_t i = 0; i <= indexCount; ++i) {
+        ASSERT(idxpyr_rank(&pyr, i) == rank);
+        if (i < indexCount && idxpyr_get(&pyr, i)) {
+            ASSERT(idxpyr_select(&pyr, rank) == i);
+            ++rank;
+        }
+    }
+    ASSERT(idxpyr_select(&pyr, rank) == IDXPYR_EMPTY);
+
+    idxpyr_setAll(&pyr, true);
+    ASSERT(idxpyr_rank(&pyr, indexCount) == indexCount);
+    ASSERT(idxpyr_select(&pyr, 4242) == 4242);
+
+    idxpyr_destroy(&pyr);
+    return 0;
+}
+
+int idxpyr_rankAndSelectAfterPopFirstN(void) {
+    // full leaf blocks push the leaf prefixes to their maximum
+    const unsigned int indexCountLog2 = 3 * UM_BIT_COUNT_LOG2(idxpyr_block_t) + 1;
+    const size_t indexCount = (size_t) 1 << indexCountLog2;
+    idxpyr_t pyr = idxpyr_make(indexCountLog2, true);
+    ASSERT(!idxpyr_enableCounting(&pyr));
+    ASSERT(idxpyr_rank(&pyr, indexCount / 2 + 3) == indexCount / 2 + 3);
+
+    size_t out[300];
+    ASSERT(idxpyr_popFirstN(&pyr, out, ARRAY_LENGTH(out)) == ARRAY_LENGTH(out));
+    idxpyr_set(&pyr, indexCount - 1, false);
+    ASSERT(idxpyr_count(&pyr) == indexCount - ARRAY_LENGTH(out) - 1);
+    size_t rank = 0;
+    for (size_t i = 0; i < indexCount; rank += idxpyr_get(&pyr, i++))
+        ASSERT(idxpyr_rank(&pyr, i) == rank);
+    ASSERT(idxpyr_rank(&pyr, indexCount) == rank);
+    ASSERT(idxpyr_select(&pyr, 0) == ARRAY_LENGTH(out));
+    ASSERT(idxpyr_select(&pyr, indexCount - ARRAY_LENGTH(out) - 2) == indexCount - 2);
+    ASSERT(idxpyr_select(&pyr, indexCount - ARRAY_LENGTH(out) - 1) == IDXPYR_EMPTY);
+
+    idxpyr_destroy(&pyr);
+    return 0;
+}
+
+int idxpyr_increaseSizeKeepsCounting(void) {
+    idxpyr_t pyr = idxpyr_make(8, false);
+    idxpyr_enableCounting(&pyr);
+    idxpyr_set(&pyr, 200, true);
+    ASSERT(!idxpyr_increaseSize(&pyr));
+    ASSERT(pyr.isCounting);
+    idxpyr_set(&pyr, 300, true);
+    ASSERT(idxpyr_rank(&pyr, 301) == testRankByScan(&pyr, 301));
+    ASSERT(idxpyr_select(&pyr, 1) == 300);
+
+    idxpyr_disableCounting(&pyr);
+    ASSERT(!pyr.isCounting);
+    idxpyr_destroy(&pyr);
+    return 0;
+}
+
+int idxpyr_increaseSizeInPlaceKeepsCounting(void) {
+    // set pyramid -- the grown half is counted as well
+    const unsigned int indexCountLog2 = 2 * UM_BIT_COUNT_LOG2(idxpyr_block_t);
+    idxpyr_t pyr = idxpyr_makeReserved(indexCountLog2, indexCountLog2 + 2, true);
+    ASSERT(!idxpyr_enableCounting(&pyr));
+    idxpyr_set(&pyr, 3, false);
+    for (int i = 0; i < 2; ++i)
+        ASSERT(!idxpyr_increaseSize(&pyr));
+    const size_t indexCount = (size_t) 1 << (indexCountLog2 + 2);
+    ASSERT(idxpyr_count(&pyr) == indexCount - 1);
+    ASSERT(idxpyr_rank(&pyr, indexCount - 5) == indexCount - 6);
+    ASSERT(idxpyr_select(&pyr, 3) == 4);
+    ASSERT(idxpyr_select(&pyr, indexCount - 2) == indexCount - 1);
+
+    idxpyr_destroy(&pyr);
+    return 0;
+}
+
 int idxpyr_plainIncreaseSize(void) {
     idxpyr_t pyr = idxpyr_make(6, false);
     idxpyr_increaseSize(&pyr);
@@ -425,4 +1479,352 @@ int idxpyr_increaseSizeTopBlockCapturesPreviousStateAfterHeightIncrease(void) {
     return testIncreaseSizeTopBlockStateCapturing(indexCountLog2);
 }
 
+static bool testRowsEqual(const idxpyr_t *a, const idxpyr_t *b) {
+    if (a->indexCountLog2 != b->indexCountLog2 || a->height != b->height)
+        return false;
+    for (unsigned int i = 0; i < a->height; ++i) {
+        size_t rowSize = getRowBlockCount(a->indexCountLog2, i) * sizeof(idxpyr_block_t);
+        if (memcmp(a->rows[i], b->rows[i], rowSize))
+            return false;
+    }
+    return true;
+}
+
+int idxpyr_makeReservedGrowsLikeIncreaseSize(void) {
+    const unsigned int maxIndexCountLog2 = 3 * UM_BIT_COUNT_LOG2(idxpyr_block_t) + 1;
+    for (int stateInit = 0; stateInit < 2; ++stateInit) {
+        idxpyr_t plain = idxpyr_make(0, stateInit);
+        idxpyr_t reserved = idxpyr_makeReserved(0, maxIndexCountLog2, stateInit);
+        ASSERT(reserved.rows[0]);
+        idxpyr_block_t *store = reserved.rows[0];
+
+        for (unsigned int log2 = reserved.indexCountLog2; log2 < maxIndexCountLog2 + 2; ++log2) {
+            ASSERT(testRowsEqual(&plain, &reserved));
+            // flip a few bits so both the summaries and the top block carry state over
+            for (size_t index = 1; index < (size_t) 1 << log2; index = index * 3 + 1) {
+                idxpyr_set(&plain, index, !stateInit);
+                idxpyr_set(&reserved, index, !stateInit);
+            }
+            idxpyr_increaseSize(&plain);
+            idxpyr_increaseSize(&reserved);
+            ASSERT(reserved.indexCountLog2 > maxIndexCountLog2 || reserved.rows[0] == store);
+        }
+        ASSERT(testRowsEqual(&plain, &reserved));
+        ASSERT(!reserved.maxIndexCountLog2);
+
+        idxpyr_destroy(&reserved);
+        idxpyr_destroy(&plain);
+    }
+    return 0;
+}
+
+static size_t testCountResidentPages(const void *addr, size_t size) {
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    size_t pageCount = (size + pageSize - 1) / pageSize;
+    unsigned char *residency = malloc(pageCount);
+    size_t residentCount = 0;
+    if (!mincore((void *) addr, size, residency))
+        for (size_t i = 0; i < pageCount; ++i)
+            residentCount += residency[i] & 1;
+    free(residency);
+    return residentCount;
+}
+
+int idxpyr_makeReservedClearTouchesNoPages(void) {
+    const unsigned int indexCountLog2 = 28;
+    idxpyr_t pyr = idxpyr_makeReserved(indexCountLog2, indexCountLog2, false);
+    ASSERT(pyr.rows[0]);
+    ASSERT(!testCountResidentPages(pyr.rows[0], pyr.storeSize));
+
+    idxpyr_set(&pyr, 12345678, true);
+    ASSERT(idxpyr_getFirst(&pyr) == 12345678);
+    // one page per row at most
+    ASSERT(testCountResidentPages(pyr.rows[0], pyr.storeSize) <= pyr.height);
+
+    idxpyr_destroy(&pyr);
+    return 0;
+}
+
+int idxpyr_shrinkDropsEmptyTail(void) {
+    const unsigned int indexCountLog2 = 3 * UM_BIT_COUNT_LOG2(idxpyr_block_t);
+    idxpyr_t pyrs[] = { idxpyr_make(indexCountLog2, false), idxpyr_makeReserved(indexCountLog2, indexCountLog2, false) };
+    for (size_t i = 0; i < ARRAY_LENGTH(pyrs); ++i) {
+        idxpyr_t *pyr = pyrs + i;
+        idxpyr_set(pyr, 5, true);
+        idxpyr_set(pyr, 300, true);
+        idxpyr_set(pyr, ((size_t) 1 << indexCountLog2) - 1, true);
+        idxpyr_shrink(pyr);
+        ASSERT(pyr->indexCountLog2 == indexCountLog2);
+
+        idxpyr_set(pyr, ((size_t) 1 << indexCountLog2) - 1, false);
+        idxpyr_shrink(pyr);
+        ASSERT(pyr->indexCountLog2 == MAX(9u, UM_BIT_COUNT_LOG2(idxpyr_block_t)));
+        ASSERT(idxpyr_getFirst(pyr) == 5 && idxpyr_getLast(pyr) == 300);
+
+        idxpyr_set(pyr, 300, false);
+        idxpyr_set(pyr, 5, false);
+        idxpyr_shrink(pyr);
+        ASSERT(pyr->indexCountLog2 == UM_BIT_COUNT_LOG2(idxpyr_block_t));
+        ASSERT(pyr->height == 1 && idxpyr_getFirst(pyr) == IDXPYR_EMPTY);
+
+        // growing again brings back clean rows
+        while (pyr->indexCountLog2 < indexCountLog2)
+            idxpyr_increaseSize(pyr);
+        ASSERT(idxpyr_getFirst(pyr) == IDXPYR_EMPTY);
+        idxpyr_set(pyr, 7, true);
+        ASSERT(idxpyr_getLast(pyr) == 7);
+    }
+    ASSERT(testRowsEqual(pyrs, pyrs + 1));
+
+    idxpyr_destroy(pyrs);
+    idxpyr_destroy(pyrs + 1);
+    return 0;
+}
+
+int idxpyr_shrinkKeepsCounting(void) {
+    idxpyr_t pyr = idxpyr_makeReserved(16, 20, false);
+    idxpyr_enableCounting(&pyr);
+    idxpyr_set(&pyr, 100, true);
+    idxpyr_set(&pyr, 200, true);
+    ASSERT(!idxpyr_shrink(&pyr));
+    ASSERT(pyr.isCounting);
+    ASSERT(idxpyr_rank(&pyr, 201) == 2);
+    ASSERT(idxpyr_select(&pyr, 1) == 200);
+
+    idxpyr_destroy(&pyr);
+    return 0;
+}
+
+int idxpyr_popFirstNMatchesPopFirst(void) {
+    const unsigned int indexCountLog2 = 2 * UM_BIT_COUNT_LOG2(idxpyr_block_t) + 2;
+    const size_t indexCount = (size_t) 1 << indexCountLog2;
+    idxpyr_t pyr = idxpyr_make(indexCountLog2, false);
+    idxpyr_t expected = idxpyr_make(indexCountLog2, false);
+    idxpyr_enableCounting(&pyr);
+    size_t x = 88172645463325252u;
+    for (size_t i = 0; i < indexCount / 3; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        idxpyr_set(&pyr, x & (indexCount - 1), true);
+        idxpyr_set(&expected, x & (indexCount - 1), true);
+    }
+
+    size_t out[100];
+    for (size_t n = 0; idxpyr_getFirst(&expected) != IDXPYR_EMPTY; n = (n * 7 + 3) % ARRAY_LENGTH(out)) {
+        size_t count = idxpyr_popFirstN(&pyr, out, n);
+        for (size_t i = 0; i < count; ++i)
+            ASSERT(out[i] == idxpyr_popFirst(&expected));
+        ASSERT(count == n || idxpyr_getFirst(&expected) == IDXPYR_EMPTY);
+        ASSERT(testRowsEqual(&pyr, &expected));
+        ASSERT(idxpyr_rank(&pyr, indexCount) == testRankByScan(&pyr, indexCount));
+        ASSERT(idxpyr_rank(&pyr, indexCount / 2) == testRankByScan(&pyr, indexCount / 2));
+    }
+    ASSERT(!idxpyr_popFirstN(&pyr, out, ARRAY_LENGTH(out)));
+
+    idxpyr_destroy(&expected);
+    idxpyr_destroy(&pyr);
+    return 0;
+}
+
+int idxpyr_popNearestPicksClosest(void) {
+    idxpyr_t pyr = idxpyr_make(12, false);
+    ASSERT(idxpyr_popNearest(&pyr, 100) == IDXPYR_EMPTY);
+    idxpyr_set(&pyr, 10, true);
+    idxpyr_set(&pyr, 20, true);
+    idxpyr_set(&pyr, 3000, true);
+
+    ASSERT(idxpyr_getNearest(&pyr, 0) == 10);
+    ASSERT(idxpyr_getNearest(&pyr, 15) == 10);
+    ASSERT(idxpyr_getNearest(&pyr, 16) == 20);
+    ASSERT(idxpyr_getNearest(&pyr, 20) == 20);
+    ASSERT(idxpyr_getNearest(&pyr, 4095) == 3000);
+    ASSERT(idxpyr_popNearest(&pyr, 1600) == 3000);
+    ASSERT(idxpyr_popNearest(&pyr, 1600) == 20);
+    ASSERT(idxpyr_popNearest(&pyr, 1600) == 10);
+    ASSERT(idxpyr_getFirst(&pyr) == IDXPYR_EMPTY);
+
+    idxpyr_destroy(&pyr);
+    return 0;
+}
+
+static void testFillRandom(idxpyr_t *pyr, size_t seed, size_t setCount) {
+    size_t indexMask = ((size_t) 1 << pyr->indexCountLog2) - 1;
+    for (size_t i = 0; i < setCount; ++i) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        idxpyr_set(pyr, seed & indexMask, true);
+    }
+}
+
+int idxpyr_setAlgebraMatchesPerIndexOps(void) {
+    const unsigned int sizes[] = { UM_BIT_COUNT_LOG2(idxpyr_block_t), 5, 2 * UM_BIT_COUNT_LOG2(idxpyr_block_t) + 3 };
+    for (size_t k = 0; k < ARRAY_LENGTH(sizes); ++k) {
+        unsigned int indexCountLog2 = MAX(sizes[k], UM_BIT_COUNT_LOG2(idxpyr_block_t));
+        size_t indexCount = (size_t) 1 << indexCountLog2;
+        idxpyr_t a = idxpyr_make(indexCountLog2, false);
+        idxpyr_t b = idxpyr_make(indexCountLog2, false);
+        testFillRandom(&a, 88172645463325252u, indexCount / 2);
+        testFillRandom(&b, 2463534242u, indexCount / 2);
+
+        for (int op = 0; op < 3; ++op) {
+            idxpyr_t result = idxpyr_make(indexCountLog2, false);
+            idxpyr_t expected = idxpyr_make(indexCountLog2, false);
+            idxpyr_or(&result, &a);
+            idxpyr_enableCounting(&result);
+            for (size_t i = 0; i < indexCount; ++i) {
+                bool x = idxpyr_get(&a, i);
+                bool y = idxpyr_get(&b, i);
+                idxpyr_set(&expected, i, op == 0 ? x && y : op == 1 ? x || y : x && !y);
+            }
+            if (op == 0)
+                idxpyr_and(&result, &b);
+            else if (op == 1)
+                idxpyr_or(&result, &b);
+            else
+                idxpyr_andNot(&result, &b);
+
+            ASSERT(testRowsEqual(&result, &expected));
+            ASSERT(idxpyr_count(&result) == idxpyr_count(&expected));
+            ASSERT(idxpyr_count(&result) == testRankByScan(&expected, indexCount));
+            idxpyr_destroy(&expected);
+            idxpyr_destroy(&result);
+        }
+        idxpyr_destroy(&b);
+        idxpyr_destroy(&a);
+    }
+    return 0;
+}
+
+static int testMakeTmpPath(char *pathOut) {
+    strcpy(pathOut, "/tmp/idxpyrTest.XXXXXX");
+    int fd = mkstemp(pathOut);
+    if (fd == -1)
+        return -1;
+    close(fd);
+    return 0;
+}
+
+int idxpyr_saveAndMapFileRoundTrip(void) {
+    char path[32];
+    ASSERT(!testMakeTmpPath(path));
+    idxpyr_t pyrs[] = { idxpyr_make(2 * UM_BIT_COUNT_LOG2(idxpyr_block_t) + 1, false),
+        idxpyr_makeReserved(2 * UM_BIT_COUNT_LOG2(idxpyr_block_t) + 1, 24, true) };
+    for (size_t i = 0; i < ARRAY_LENGTH(pyrs); ++i) {
+        idxpyr_t *pyr = pyrs + i;
+        testFillRandom(pyr, 88172645463325252u + i, 100);
+        ASSERT(!idxpyr_save(pyr, path));
+
+        idxpyr_t mapped;
+        ASSERT(!idxpyr_mapFile(&mapped, path, false));
+        ASSERT(testRowsEqual(pyr, &mapped));
+        ASSERT(mapped.stateInit == pyr->stateInit);
+        ASSERT(idxpyr_getFirst(&mapped) == idxpyr_getFirst(pyr));
+        ASSERT(idxpyr_count(&mapped) == idxpyr_count(pyr));
+        idxpyr_destroy(&mapped);
+
+        // changes of a copy on write mapping don't reach the file
+        ASSERT(!idxpyr_mapFile(&mapped, path, true));
+        size_t first = idxpyr_popFirst(&mapped);
+        ASSERT(first == idxpyr_getFirst(pyr));
+        idxpyr_increaseSize(&mapped);
+        ASSERT(!mapped.isMapped && !idxpyr_get(&mapped, first));
+        idxpyr_destroy(&mapped);
+        ASSERT(!idxpyr_mapFile(&mapped, path, true));
+        ASSERT(idxpyr_get(&mapped, first));
+        idxpyr_destroy(&mapped);
+    }
+
+    idxpyr_destroy(pyrs);
+    idxpyr_destroy(pyrs + 1);
+    unlink(path);
+    return 0;
+}
+
+int idxpyr_mapFileReadsStoreAtUnmappableOffset(void) {
+    char path[32];
+    ASSERT(!testMakeTmpPath(path));
+    idxpyr_t pyr = idxpyr_make(2 * UM_BIT_COUNT_LOG2(idxpyr_block_t) + 1, false);
+    testFillRandom(&pyr, 2463534242, 100);
+    ASSERT(!idxpyr_save(&pyr, path));
+
+    // move the store right behind the header, off any page boundary
+    int fd = open(path, O_RDWR);
+    ASSERT(fd != -1);
+    idxpyr_fileHeader_t header;
+    ASSERT(pread(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header));
+    ASSERT(header.storeOffset == IDXPYR_FILE_STORE_OFFSET);
+    void *store = malloc(header.storeSize);
+    ASSERT(store);
+    ASSERT(pread(fd, store, header.storeSize, header.storeOffset) == (ssize_t) header.storeSize);
+    header.storeOffset = 64;
+    ASSERT(pwrite(fd, store, header.storeSize, header.storeOffset) == (ssize_t) header.storeSize);
+    ASSERT(pwrite(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header));
+    free(store);
+
+    idxpyr_t read;
+    ASSERT(!idxpyr_mapFile(&read, path, false));
+    ASSERT(!read.isMapped);
+    ASSERT(testRowsEqual(&pyr, &read));
+    idxpyr_destroy(&read);
+
+    // an offset overlapping the header is damage, not something to map
+    header.storeOffset = sizeof(header) - sizeof(idxpyr_block_t);
+    ASSERT(pwrite(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header));
+    errno = 0;
+    ASSERT(idxpyr_mapFile(&read, path, false) == -1 && errno == IDXPYR_ERROR_FORMAT);
+    // as is a misaligned one (or for byte blocks, the checksum of the shifted store)
+    header.storeOffset = 65;
+    ASSERT(pwrite(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header));
+    errno = 0;
+    ASSERT(idxpyr_mapFile(&read, path, false) == -1 && errno == IDXPYR_ERROR_FORMAT);
+
+    close(fd);
+    unlink(path);
+    idxpyr_destroy(&pyr);
+    return 0;
+}
+
+int idxpyr_mapFileRejectsDamagedFiles(void) {
+    char path[32];
+    ASSERT(!testMakeTmpPath(path));
+    idxpyr_t pyr;
+    errno = 0;
+    ASSERT(idxpyr_mapFile(&pyr, path, false) == -1 && errno == IDXPYR_ERROR_FORMAT);
+
+    pyr = idxpyr_make(12, false);
+    idxpyr_set(&pyr, 1234, true);
+    ASSERT(!idxpyr_save(&pyr, path));
+    idxpyr_destroy(&pyr);
+
+    // flip one bit of the store
+    int fd = open(path, O_RDWR);
+    ASSERT(fd != -1);
+    idxpyr_fileHeader_t header;
+    ASSERT(pread(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header));
+    unsigned char byte;
+    ASSERT(pread(fd, &byte, 1, (off_t) header.storeOffset + 3) == 1);
+    byte ^= 4;
+    ASSERT(pwrite(fd, &byte, 1, (off_t) header.storeOffset + 3) == 1);
+    errno = 0;
+    ASSERT(idxpyr_mapFile(&pyr, path, false) == -1 && errno == IDXPYR_ERROR_FORMAT);
+
+    // and a newer version
+    byte ^= 4;
+    ASSERT(pwrite(fd, &byte, 1, (off_t) header.storeOffset + 3) == 1);
+    ASSERT(!idxpyr_mapFile(&pyr, path, false));
+    idxpyr_destroy(&pyr);
+    ++header.version;
+    ASSERT(pwrite(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header));
+    errno = 0;
+    ASSERT(idxpyr_mapFile(&pyr, path, false) == -1 && errno == IDXPYR_ERROR_FORMAT);
+
+    close(fd);
+    unlink(path);
+    errno = 0;
+    ASSERT(idxpyr_mapFile(&pyr, path, false) == -1 && errno == ENOENT);
+    return 0;
+}
+
 #endif
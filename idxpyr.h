@@ -10,9 +10,38 @@
 
 #include "utilMacros.h"
 
+/* Block width in bits -- 8, 16, 32 or 64. Wider blocks make a flatter pyramid (2^32
+   indices are 8 rows deep with 16 bit blocks, 6 with 64 bit ones), i.e. fewer dependent
+   loads in getFirst/popFirst. Has to be the same for every translation unit, so set it
+   with -D on the whole build. */
+#ifndef IDXPYR_BLOCK_BITS
+#define IDXPYR_BLOCK_BITS 16
+#endif
+
+#if IDXPYR_BLOCK_BITS == 8
+typedef uint8_t idxpyr_block_t;
+#elif IDXPYR_BLOCK_BITS == 16
 typedef uint16_t idxpyr_block_t;
+#elif IDXPYR_BLOCK_BITS == 32
+typedef uint32_t idxpyr_block_t;
+#elif IDXPYR_BLOCK_BITS == 64
+typedef uint64_t idxpyr_block_t;
+#else
+#error "IDXPYR_BLOCK_BITS has to be 8, 16, 32 or 64"
+#endif
+
 #define IDXPYR_EMPTY   ((size_t) -1)
 
+// idxpyr_mapFile fails with errno IDXPYR_ERROR_FORMAT on a foreign, damaged or
+// mismatching (block width, version) file
+#define IDXPYR_ERROR_FORMAT 320
+
+#define IDXPYR_FILE_MAGIC 0x52595049 // "IPYR"
+#define IDXPYR_FILE_VERSION 1
+// where idxpyr_save puts the store -- a multiple of every common page size, so readers
+// with other pages than the writer can still map it
+#define IDXPYR_FILE_STORE_OFFSET 65536
+
 // - 1 at the end removes edge cases (e.g. ((size_t) 1 << BIT_COUNT(size_t)))
 #define IDXPYR_MAX_INDEX_COUNT_LOG2   (UM_BIT_COUNT(size_t) - 1)
 
@@ -27,17 +56,109 @@ typedef struct {
     idxpyr_block_t *rows[IDXPYR_MAX_HEIGHT];
     size_t storeSize;
     bool stateInit;
+    // 0 unless made by idxpyr_makeReserved -- then rows[i] sit in their own page aligned
+    // regions of one mapping sized for this many indices, and storeSize is its length
+    unsigned int maxIndexCountLog2;
+    // store is a private mapping of a file written by idxpyr_save
+    bool isMapped;
+    // optional counting layer -- prefixes[i][j] is the number of set indices below the
+    // blocks left of rows[i][j] under the same parent, so rank adds one per row; leaf
+    // prefixes are at most (bits - 1) * bits and fit 16 bits, and the top row has no
+    // parent, setCount holds the total instead
+    bool isCounting;
+    size_t setCount;
+    uint16_t *leafPrefixes;
+    size_t *prefixes[IDXPYR_MAX_HEIGHT]; // rows 1 .. height - 2
 } idxpyr_t;
 
+typedef struct {
+    idxpyr_t *pyr;
+    size_t next;
+} idxpyr_cursor_t;
+
+// file layout: this header, then the rows packed like idxpyr_make lays them out, starting
+// at storeOffset; native byte order
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t blockBits; // IDXPYR_BLOCK_BITS of the writer
+    uint32_t indexCountLog2;
+    uint32_t stateInit;
+    uint32_t storeOffset; // IDXPYR_FILE_STORE_OFFSET, so the store can be mapped on its own
+    uint64_t storeSize;
+    uint64_t checksum; // of the rows, lowest first
+} idxpyr_fileHeader_t;
+
+// rows[0] is NULL if the store could not be allocated
 idxpyr_t idxpyr_make(unsigned int indexCountLog2, bool stateInit);
+// reserves address space for up to 2^maxIndexCountLog2 indices; pages are only backed
+// once touched, so increaseSize grows in place and shrink hands memory back; rows[0]
+// is NULL if the reservation failed (errno from mmap)
+idxpyr_t idxpyr_makeReserved(unsigned int indexCountLog2, unsigned int maxIndexCountLog2, bool stateInit);
+// indices have to be ascending (duplicates are fine); indexCountLog2 is raised to fit
+// the biggest one; the upper rows are built on the way -- one pass over indices
+idxpyr_t idxpyr_makeFromSorted(const size_t *indices, size_t n, unsigned int indexCountLog2);
 // if no index is found IDXPYR_EMPTY is returned
 size_t idxpyr_getFirst(idxpyr_t *pyr);
 size_t idxpyr_popFirst(idxpyr_t *pyr);
+// pops up to n of the lowest set indices into out (ascending) and returns how many;
+// one descent for the whole batch, every emptied block is cleared from the row above once
+size_t idxpyr_popFirstN(idxpyr_t *pyr, size_t *out, size_t n);
+// set index closest to hint, ties go to the lower one
+size_t idxpyr_getNearest(idxpyr_t *pyr, size_t hint);
+size_t idxpyr_popNearest(idxpyr_t *pyr, size_t hint);
+size_t idxpyr_getLast(idxpyr_t *pyr);
+// first set index >= from / last set index <= from; empty subtrees are skipped through
+// the upper rows, so both take O(height) block reads
+size_t idxpyr_next(idxpyr_t *pyr, size_t from);
+size_t idxpyr_prev(idxpyr_t *pyr, size_t from);
+
+// ascending walk over the set indices starting at from; indices may be changed while
+// walking -- the cursor only remembers where to continue
+idxpyr_cursor_t idxpyr_makeCursor(idxpyr_t *pyr, size_t from);
+size_t idxpyr_cursorNext(idxpyr_cursor_t *cursor);
 
 // index has to be within currently allocated size -- guarded by assert()
 bool idxpyr_get(idxpyr_t *pyr, size_t index);
 void idxpyr_set(idxpyr_t *pur, size_t index, bool state);
 void idxpyr_setAll(idxpyr_t *pyr, bool state);
-void idxpyr_increaseSize(idxpyr_t *pyr);
+// [begin, end) -- whole blocks are memset, only the boundary blocks are patched
+void idxpyr_setRange(idxpyr_t *pyr, size_t begin, size_t end, bool state);
+// dst = dst op src over the whole leaf row (SIMD where available), then the upper rows
+// are rebuilt in one bottom-up pass; both pyramids need the same index count
+void idxpyr_and(idxpyr_t *dst, const idxpyr_t *src);
+void idxpyr_or(idxpyr_t *dst, const idxpyr_t *src);
+void idxpyr_andNot(idxpyr_t *dst, const idxpyr_t *src);
+// number of set indices -- popcount of the leaf row, or the top count when counting
+size_t idxpyr_count(const idxpyr_t *pyr);
+// doubles the index count; in place within the reservation, otherwise by copying into
+// a bigger plain pyramid; returns -1 with errno ENOMEM and leaves pyr as it was (still
+// counting if it did)
+int idxpyr_increaseSize(idxpyr_t *pyr);
+// lowers the index count to the smallest one that still holds the last set index;
+// a reserved pyramid releases the pages of the dropped tail with madvise, a plain one
+// is copied into a smaller store; fails like idxpyr_increaseSize
+int idxpyr_shrink(idxpyr_t *pyr);
+
+// counting layer for rank/select; set/setAll/setRange keep it up to date, a set that
+// flips a bit shifts the prefixes right of its path -- up to bits - 1 per row; returns
+// -1 with errno ENOMEM
+int idxpyr_enableCounting(idxpyr_t *pyr);
+void idxpyr_disableCounting(idxpyr_t *pyr);
+// number of set indices below index (index == index count is allowed); one prefix load
+// per row plus a popcount of the leaf block
+size_t idxpyr_rank(idxpyr_t *pyr, size_t index);
+// k-th set index counting from 0; IDXPYR_EMPTY if there are k or fewer; a binary search
+// over the prefixes of one block per row, then a pdep in the leaf block
+size_t idxpyr_select(idxpyr_t *pyr, size_t k);
+
+// snapshot for a fast restart; written to a temporary file next to path that is renamed
+// over path once complete, so a crash leaves either the old or the new snapshot
+int idxpyr_save(const idxpyr_t *pyr, const char *path);
+// maps a snapshot instead of replaying it; read only unless copyOnWrite -- a read only
+// pyramid must not be changed (set, popFirst ...), a copy on write one keeps its changes
+// private; the checksum is verified, i.e. the store is read once; a store at an offset
+// this page size cannot map is read into a plain pyramid instead
+int idxpyr_mapFile(idxpyr_t *pyrOut, const char *path, bool copyOnWrite);
 
 void idxpyr_destroy(idxpyr_t *pyr);
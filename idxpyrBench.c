@@ -0,0 +1,79 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+// usage: idxpyrBench<blockBits> [opCount] [maxIndexCountLog2]
+// one binary per block width (make bench builds idxpyrBench8 .. idxpyrBench64);
+// random set/get, popFirst and popFirstN of sparse indices, index counts from 2^10 up
+#include "idxpyr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define MIN_INDEX_COUNT_LOG2 10
+#define INDEX_COUNT_LOG2_STEP 4
+#define POP_BATCH_SIZE 64
+
+static double now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static uint64_t xorshift(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void bench(unsigned int indexCountLog2, size_t opCount) {
+    size_t indexMask = ((size_t) 1 << indexCountLog2) - 1;
+    idxpyr_t pyr = idxpyr_make(indexCountLog2, false);
+    const uint64_t seed = 0x2545F4914F6CDD1Du;
+    uint64_t rng = seed;
+
+    double t0 = now();
+    for (size_t i = 0; i < opCount; ++i)
+        idxpyr_set(&pyr, xorshift(&rng) & indexMask, true);
+    double setTime = now() - t0;
+
+    size_t hitCount = 0;
+    t0 = now();
+    for (size_t i = 0; i < opCount; ++i)
+        hitCount += idxpyr_get(&pyr, xorshift(&rng) & indexMask);
+    double getTime = now() - t0;
+
+    size_t popCount = 0;
+    t0 = now();
+    while (idxpyr_popFirst(&pyr) != IDXPYR_EMPTY)
+        ++popCount;
+    double popTime = now() - t0;
+
+    rng = seed;
+    for (size_t i = 0; i < opCount; ++i)
+        idxpyr_set(&pyr, xorshift(&rng) & indexMask, true);
+    size_t batch[POP_BATCH_SIZE];
+    t0 = now();
+    while (idxpyr_popFirstN(&pyr, batch, POP_BATCH_SIZE))
+        ;
+    double popNTime = now() - t0;
+
+    printf("2^%-2u  height %2u  set %6.1f ns  get %6.1f ns  popFirst %6.1f ns  popFirstN %6.1f ns  (%zu hits)\n",
+            indexCountLog2, pyr.height, setTime * 1e9 / (double) opCount,
+            getTime * 1e9 / (double) opCount, popTime * 1e9 / (double) popCount,
+            popNTime * 1e9 / (double) popCount, hitCount);
+    idxpyr_destroy(&pyr);
+}
+
+int main(int argc, char **argv) {
+    size_t opCount = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    unsigned int maxIndexCountLog2 = argc > 2 ? (unsigned int) strtoul(argv[2], NULL, 10) : 30;
+
+    printf("idxpyr_block_t: %d bit\n", IDXPYR_BLOCK_BITS);
+    for (unsigned int i = MIN_INDEX_COUNT_LOG2; i <= maxIndexCountLog2; i += INDEX_COUNT_LOG2_STEP)
+        bench(i, opCount);
+    return 0;
+}
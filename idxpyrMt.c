@@ -0,0 +1,288 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#include "idxpyrMt.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+#include "bitops.h"
+#include "unittestMacros.h"
+
+#define BLOCK_BIT_COUNT_LOG2   UM_BIT_COUNT_LOG2(idxpyr_block_t)
+#define BLOCK_BIT_MASK   (UM_BIT_COUNT(idxpyr_block_t) - 1)
+#define BIT(i)   ((idxpyr_block_t) ((idxpyr_block_t) 1 << (i)))
+
+// private declarations
+// -----------------------------------------------------------------------------
+// returns the index of a leaf block that was reachable through set summary bits
+static size_t findLeafBlock(idxpyrMt_t *pyr);
+// block at (level, blockIndex) became non-empty / empty
+static void setUpward(idxpyrMt_t *pyr, unsigned int level, size_t blockIndex);
+static void clearUpward(idxpyrMt_t *pyr, unsigned int level, size_t blockIndex);
+
+// interface functions
+// -----------------------------------------------------------------------------
+idxpyrMt_t idxpyrMt_make(unsigned int indexCountLog2, bool stateInit) {
+    // layout and initial state are taken over from a plain pyramid
+    idxpyr_t plain = idxpyr_make(indexCountLog2, stateInit);
+    size_t blockCount = plain.storeSize / sizeof(idxpyr_block_t);
+    idxpyrMt_t result = { .indexCountLog2 = plain.indexCountLog2, .height = plain.height,
+        .storeSize = blockCount * sizeof(idxpyrMt_block_t) };
+
+    idxpyrMt_block_t *store = malloc(result.storeSize);
+    for (size_t i = 0; i < blockCount; ++i)
+        atomic_init(store + i, plain.rows[0][i]);
+    for (unsigned int i = 0; i < plain.height; ++i)
+        result.rows[i] = store + (plain.rows[i] - plain.rows[0]);
+
+    idxpyr_destroy(&plain);
+    return result;
+}
+
+size_t idxpyrMt_getFirst(idxpyrMt_t *pyr) {
+    while (true) {
+        size_t blockIndex = findLeafBlock(pyr);
+        if (blockIndex == IDXPYR_EMPTY)
+            return IDXPYR_EMPTY;
+
+        idxpyr_block_t block = atomic_load(pyr->rows[0] + blockIndex);
+        if (block)
+            return blockIndex << BLOCK_BIT_COUNT_LOG2 | bitops_ctz(block);
+        if (pyr->height == 1)
+            return IDXPYR_EMPTY;
+        clearUpward(pyr, 0, blockIndex);
+    }
+}
+
+size_t idxpyrMt_popFirst(idxpyrMt_t *pyr) {
+    while (true) {
+        size_t blockIndex = findLeafBlock(pyr);
+        if (blockIndex == IDXPYR_EMPTY)
+            return IDXPYR_EMPTY;
+
+        idxpyrMt_block_t *leaf = pyr->rows[0] + blockIndex;
+        idxpyr_block_t block = atomic_load(leaf);
+        while (block) {
+            idxpyr_block_t cleared = (idxpyr_block_t) (block & (block - 1));
+            if (atomic_compare_exchange_weak(leaf, &block, cleared)) {
+                if (!cleared)
+                    clearUpward(pyr, 0, blockIndex);
+                return blockIndex << BLOCK_BIT_COUNT_LOG2 | bitops_ctz(block);
+            }
+        }
+        // others took the whole block while we were on our way down
+        if (pyr->height == 1)
+            return IDXPYR_EMPTY;
+        clearUpward(pyr, 0, blockIndex);
+    }
+}
+
+bool idxpyrMt_get(idxpyrMt_t *pyr, size_t index) {
+    assert(index < (size_t) 1 << pyr->indexCountLog2);
+    idxpyr_block_t block = atomic_load(pyr->rows[0] + (index >> BLOCK_BIT_COUNT_LOG2));
+    return block & BIT(index & BLOCK_BIT_MASK);
+}
+
+bool idxpyrMt_set(idxpyrMt_t *pyr, size_t index, bool state) {
+    assert(index < (size_t) 1 << pyr->indexCountLog2);
+    size_t blockIndex = index >> BLOCK_BIT_COUNT_LOG2;
+    idxpyr_block_t mask = BIT(index & BLOCK_BIT_MASK);
+    idxpyrMt_block_t *leaf = pyr->rows[0] + blockIndex;
+
+    idxpyr_block_t previous;
+    if (state) {
+        previous = atomic_fetch_or(leaf, mask);
+        if (!previous)
+            setUpward(pyr, 0, blockIndex);
+    } else {
+        previous = atomic_fetch_and(leaf, (idxpyr_block_t) ~mask);
+        if (previous == mask)
+            clearUpward(pyr, 0, blockIndex);
+    }
+    return previous & mask;
+}
+
+void idxpyrMt_destroy(idxpyrMt_t *pyr) {
+    free(pyr->rows[0]);
+    for (unsigned int i = 0; i < IDXPYR_MAX_HEIGHT; ++i)
+        pyr->rows[i] = NULL;
+}
+
+// private functions
+// -----------------------------------------------------------------------------
+static size_t findLeafBlock(idxpyrMt_t *pyr) {
+    while (true) {
+        size_t blockIndex = 0;
+        unsigned int level = pyr->height - 1;
+        for (; level; --level) {
+            idxpyr_block_t block = atomic_load(pyr->rows[level] + blockIndex);
+            if (!block)
+                break;
+            blockIndex = blockIndex << BLOCK_BIT_COUNT_LOG2 | bitops_ctz(block);
+        }
+        if (!level)
+            return blockIndex;
+        if (level == pyr->height - 1)
+            return IDXPYR_EMPTY;
+
+        // a summary bit led to an empty block - fix it on the way
+        clearUpward(pyr, level, blockIndex);
+    }
+}
+
+static void setUpward(idxpyrMt_t *pyr, unsigned int level, size_t blockIndex) {
+    while (level + 1 < pyr->height) {
+        idxpyr_block_t mask = BIT(blockIndex & BLOCK_BIT_MASK);
+        blockIndex >>= BLOCK_BIT_COUNT_LOG2;
+        ++level;
+        // whoever made the parent non-empty took care of the rows above it
+        if (atomic_fetch_or(pyr->rows[level] + blockIndex, mask))
+            return;
+    }
+}
+
+static void clearUpward(idxpyrMt_t *pyr, unsigned int level, size_t blockIndex) {
+    while (level + 1 < pyr->height) {
+        idxpyr_block_t mask = BIT(blockIndex & BLOCK_BIT_MASK);
+        size_t parentIndex = blockIndex >> BLOCK_BIT_COUNT_LOG2;
+        idxpyr_block_t previous = atomic_fetch_and(pyr->rows[level + 1] + parentIndex,
+                (idxpyr_block_t) ~mask);
+
+        // a concurrent set may have refilled the block before its summary bit was gone
+        if (atomic_load(pyr->rows[level] + blockIndex)) {
+            setUpward(pyr, level, blockIndex);
+            return;
+        }
+        // the bit was already cleared by someone else, or the parent is still non-empty
+        if (previous != mask)
+            return;
+
+        ++level;
+        blockIndex = parentIndex;
+    }
+}
+
+// unittest
+// -----------------------------------------------------------------------------
+#ifdef UNITTEST
+#include <pthread.h>
+
+int idxpyrMtMakeTakesOverPlainState(void) {
+    idxpyrMt_t pyr = idxpyrMt_make(8, true);
+    ASSERT(pyr.rows[0]);
+    ASSERT(pyr.indexCountLog2 == 8);
+    ASSERT(idxpyrMt_getFirst(&pyr) == 0);
+    ASSERT(idxpyrMt_get(&pyr, 255));
+    idxpyrMt_destroy(&pyr);
+
+    pyr = idxpyrMt_make(0, false);
+    ASSERT(pyr.indexCountLog2 == UM_BIT_COUNT_LOG2(idxpyr_block_t));
+    ASSERT(idxpyrMt_getFirst(&pyr) == IDXPYR_EMPTY);
+
+    idxpyrMt_destroy(&pyr);
+    return 0;
+}
+
+int idxpyrMtSetReturnsPreviousState(void) {
+    idxpyrMt_t pyr = idxpyrMt_make(10, false);
+    ASSERT(!idxpyrMt_set(&pyr, 42, true));
+    ASSERT(idxpyrMt_set(&pyr, 42, true));
+    ASSERT(idxpyrMt_get(&pyr, 42));
+    ASSERT(idxpyrMt_set(&pyr, 42, false));
+    ASSERT(!idxpyrMt_set(&pyr, 42, false));
+    ASSERT(!atomic_load(pyr.rows[pyr.height - 1]));
+
+    idxpyrMt_destroy(&pyr);
+    return 0;
+}
+
+int idxpyrMtPopFirstReturnsIndicesInOrder(void) {
+    idxpyrMt_t pyr = idxpyrMt_make(10, false);
+    idxpyrMt_set(&pyr, 700, true);
+    idxpyrMt_set(&pyr, 42, true);
+    ASSERT(idxpyrMt_getFirst(&pyr) == 42);
+    ASSERT(idxpyrMt_popFirst(&pyr) == 42);
+    ASSERT(idxpyrMt_popFirst(&pyr) == 700);
+    ASSERT(idxpyrMt_popFirst(&pyr) == IDXPYR_EMPTY);
+    // summary rows are cleared on the way
+    for (unsigned int i = 1; i < pyr.height; ++i)
+        ASSERT(!atomic_load(pyr.rows[i]));
+
+    idxpyrMt_destroy(&pyr);
+    return 0;
+}
+
+int idxpyrMtPopFirstRepairsStaleSummaryBit(void) {
+    idxpyrMt_t pyr = idxpyrMt_make(12, false);
+    ASSERT(pyr.height > 1);
+    idxpyrMt_set(&pyr, 4000, true);
+    // summary bit over an empty subtree, as left behind by a preempted popFirst
+    atomic_fetch_or(pyr.rows[pyr.height - 1], 1);
+    ASSERT(idxpyrMt_popFirst(&pyr) == 4000);
+    ASSERT(idxpyrMt_popFirst(&pyr) == IDXPYR_EMPTY);
+    ASSERT(!atomic_load(pyr.rows[pyr.height - 1]));
+
+    idxpyrMt_destroy(&pyr);
+    return 0;
+}
+
+#define IDXPYRMT_TEST_THREAD_COUNT 4
+#define IDXPYRMT_TEST_ROUNDS 20000
+#define IDXPYRMT_TEST_HELD_PER_THREAD 16
+#define IDXPYRMT_TEST_INDEX_COUNT_LOG2 8
+STATIC_ASSERT(IDXPYRMT_TEST_THREAD_COUNT * IDXPYRMT_TEST_HELD_PER_THREAD
+        < 1 << IDXPYRMT_TEST_INDEX_COUNT_LOG2, idxpyrMtTestKeepsIndicesAvailable);
+
+typedef struct {
+    idxpyrMt_t *pyr;
+    atomic_bool *owned;
+    atomic_int failures;
+} idxpyrMtTestShared_t;
+
+static void *idxpyrMtTestWorker(void *p) {
+    idxpyrMtTestShared_t *shared = p;
+    size_t held[IDXPYRMT_TEST_HELD_PER_THREAD];
+    for (int round = 0; round < IDXPYRMT_TEST_ROUNDS; ++round) {
+        size_t count = (size_t) round % IDXPYRMT_TEST_HELD_PER_THREAD + 1;
+        for (size_t i = 0; i < count; ++i) {
+            held[i] = idxpyrMt_popFirst(shared->pyr);
+            // never empty - at most THREAD_COUNT * HELD_PER_THREAD are taken at once
+            if (held[i] == IDXPYR_EMPTY || atomic_exchange(shared->owned + held[i], true)) {
+                atomic_fetch_add(&shared->failures, 1);
+                return NULL;
+            }
+        }
+        for (size_t i = 0; i < count; ++i) {
+            atomic_store(shared->owned + held[i], false);
+            idxpyrMt_set(shared->pyr, held[i], true);
+        }
+    }
+    return NULL;
+}
+
+int idxpyrMtConcurrentPopAndSetNeitherDuplicatesNorLoses(void) {
+    const size_t indexCount = (size_t) 1 << IDXPYRMT_TEST_INDEX_COUNT_LOG2;
+    idxpyrMt_t pyr = idxpyrMt_make(IDXPYRMT_TEST_INDEX_COUNT_LOG2, true);
+    idxpyrMtTestShared_t shared = { .pyr = &pyr, .owned = calloc(indexCount, sizeof(atomic_bool)) };
+    atomic_init(&shared.failures, 0);
+
+    pthread_t threads[IDXPYRMT_TEST_THREAD_COUNT];
+    for (size_t i = 0; i < IDXPYRMT_TEST_THREAD_COUNT; ++i)
+        ASSERT(!pthread_create(threads + i, NULL, idxpyrMtTestWorker, &shared));
+    for (size_t i = 0; i < IDXPYRMT_TEST_THREAD_COUNT; ++i)
+        pthread_join(threads[i], NULL);
+    ASSERT(!atomic_load(&shared.failures));
+
+    // every index came back and is reachable through the summary rows
+    for (size_t i = 0; i < indexCount; ++i)
+        ASSERT(idxpyrMt_popFirst(&pyr) == i);
+    ASSERT(idxpyrMt_popFirst(&pyr) == IDXPYR_EMPTY);
+
+    free(shared.owned);
+    idxpyrMt_destroy(&pyr);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,45 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "idxpyr.h"
+
+/* Thread safe variant of idxpyr_t, e.g. for a free id allocator shared by many threads.
+   Same layout, but every block is updated with atomic RMW operations and the size is
+   fixed at make time.
+
+   Summary bits are kept up to date by whoever changes a block's emptiness: a thread
+   that makes a block non-empty sets the bit above it (and goes on up while that block
+   was empty before); a thread that empties a block clears the bit above, then looks at
+   the block again and puts the bit back if someone refilled it in the meantime. A set
+   summary bit over an empty block is possible for a moment -- popFirst repairs it the
+   same way and retries. popFirst claims an index with a CAS on its leaf block, so no
+   index is handed out twice. */
+
+typedef _Atomic(idxpyr_block_t) idxpyrMt_block_t;
+
+typedef struct {
+    unsigned int indexCountLog2;
+    unsigned int height;
+    idxpyrMt_block_t *rows[IDXPYR_MAX_HEIGHT];
+    size_t storeSize;
+} idxpyrMt_t;
+
+idxpyrMt_t idxpyrMt_make(unsigned int indexCountLog2, bool stateInit);
+// if no index is found IDXPYR_EMPTY is returned; getFirst is only a snapshot
+size_t idxpyrMt_getFirst(idxpyrMt_t *pyr);
+size_t idxpyrMt_popFirst(idxpyrMt_t *pyr);
+
+// index has to be within the pyramid -- guarded by assert()
+bool idxpyrMt_get(idxpyrMt_t *pyr, size_t index);
+// returns the previous state of index
+bool idxpyrMt_set(idxpyrMt_t *pyr, size_t index, bool state);
+
+void idxpyrMt_destroy(idxpyrMt_t *pyr);
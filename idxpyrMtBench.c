@@ -0,0 +1,94 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+// usage: idxpyrMtBench [maxThreadCount] [opsPerThread]
+// id allocation pattern: every thread pops a free index and sets it free again;
+// idxpyrMt_t against a plain idxpyr_t behind a mutex
+#include "idxpyrMt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#define INDEX_COUNT_LOG2 16
+#define HELD_PER_THREAD 8
+
+typedef struct {
+    idxpyrMt_t *pyrMt;
+    idxpyr_t *pyr;
+    pthread_mutex_t *lock;
+    size_t opCount;
+} benchArg_t;
+
+static double now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static void *workerMt(void *p) {
+    benchArg_t *arg = p;
+    size_t held[HELD_PER_THREAD];
+    for (size_t i = 0; i < arg->opCount; i += HELD_PER_THREAD) {
+        for (size_t j = 0; j < HELD_PER_THREAD; ++j)
+            held[j] = idxpyrMt_popFirst(arg->pyrMt);
+        for (size_t j = 0; j < HELD_PER_THREAD; ++j)
+            idxpyrMt_set(arg->pyrMt, held[j], true);
+    }
+    return NULL;
+}
+
+static void *workerLocked(void *p) {
+    benchArg_t *arg = p;
+    size_t held[HELD_PER_THREAD];
+    for (size_t i = 0; i < arg->opCount; i += HELD_PER_THREAD) {
+        for (size_t j = 0; j < HELD_PER_THREAD; ++j) {
+            pthread_mutex_lock(arg->lock);
+            held[j] = idxpyr_popFirst(arg->pyr);
+            pthread_mutex_unlock(arg->lock);
+        }
+        for (size_t j = 0; j < HELD_PER_THREAD; ++j) {
+            pthread_mutex_lock(arg->lock);
+            idxpyr_set(arg->pyr, held[j], true);
+            pthread_mutex_unlock(arg->lock);
+        }
+    }
+    return NULL;
+}
+
+static double run(void *(*worker)(void *), size_t threadCount, size_t opsPerThread) {
+    idxpyrMt_t pyrMt = idxpyrMt_make(INDEX_COUNT_LOG2, true);
+    idxpyr_t pyr = idxpyr_make(INDEX_COUNT_LOG2, true);
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_t *threads = malloc(sizeof(pthread_t) * threadCount);
+    benchArg_t arg = { .pyrMt = &pyrMt, .pyr = &pyr, .lock = &lock, .opCount = opsPerThread };
+
+    double t0 = now();
+    for (size_t i = 0; i < threadCount; ++i)
+        pthread_create(threads + i, NULL, worker, &arg);
+    for (size_t i = 0; i < threadCount; ++i)
+        pthread_join(threads[i], NULL);
+    double elapsed = now() - t0;
+
+    free(threads);
+    idxpyr_destroy(&pyr);
+    idxpyrMt_destroy(&pyrMt);
+    return elapsed;
+}
+
+int main(int argc, char **argv) {
+    size_t maxThreadCount = argc > 1 ? strtoul(argv[1], NULL, 10) : 8;
+    size_t opsPerThread = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+
+    printf("threads  idxpyrMt pop+set/s  mutex pop+set/s\n");
+    for (size_t n = 1; n <= maxThreadCount; ++n) {
+        double total = (double) (n * opsPerThread);
+        double mt = total / run(workerMt, n, opsPerThread);
+        double locked = total / run(workerLocked, n, opsPerThread);
+        printf("%7zu  %17.3gM  %14.3gM\n", n, mt * 1e-6, locked * 1e-6);
+    }
+
+    return 0;
+}
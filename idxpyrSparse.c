@@ -0,0 +1,271 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#include "idxpyrSparse.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "bitops.h"
+#include "unittestMacros.h"
+
+#define BLOCK_BIT_COUNT_LOG2   UM_BIT_COUNT_LOG2(idxpyr_block_t)
+#define BLOCK_BIT_MASK   (UM_BIT_COUNT(idxpyr_block_t) - 1)
+#define BIT(i)   ((idxpyr_block_t) ((idxpyr_block_t) 1 << (i)))
+
+// private declarations
+// -----------------------------------------------------------------------------
+// slot of index in a node of the given row (>= 1)
+static inline unsigned int getDigit(size_t index, unsigned int row);
+static inline idxpyrSparse_node_t **getChildren(idxpyrSparse_node_t *node);
+static inline idxpyr_block_t *getLeaves(idxpyrSparse_node_t *node);
+static void destroyNode(idxpyrSparse_node_t *node, unsigned int row);
+
+// interface functions
+// -----------------------------------------------------------------------------
+int idxpyrSparse_init(idxpyrSparse_t *pyr, unsigned int indexCountLog2) {
+    if (indexCountLog2 < 2 * BLOCK_BIT_COUNT_LOG2)
+        indexCountLog2 = 2 * BLOCK_BIT_COUNT_LOG2;
+    assert(indexCountLog2 <= IDXPYR_MAX_INDEX_COUNT_LOG2);
+
+    // same height as the dense pyramid
+    unsigned int lastRowBlockCountLog2 = indexCountLog2 - BLOCK_BIT_COUNT_LOG2;
+    unsigned int height = 1 + lastRowBlockCountLog2 / BLOCK_BIT_COUNT_LOG2
+        + !!(lastRowBlockCountLog2 % BLOCK_BIT_COUNT_LOG2);
+
+    size_t nodeSize = offsetof(idxpyrSparse_node_t, slots)
+        + UM_BIT_COUNT(idxpyr_block_t) * sizeof(idxpyrSparse_node_t *);
+    size_t leafNodeSize = offsetof(idxpyrSparse_node_t, slots)
+        + UM_BIT_COUNT(idxpyr_block_t) * sizeof(idxpyr_block_t);
+    idxpyrSparse_node_t *root = calloc(1, height == 2 ? leafNodeSize : nodeSize);
+    if (!root) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    *pyr = (idxpyrSparse_t) { .indexCountLog2 = indexCountLog2, .height = height, .root = root,
+        .nodeSize = nodeSize, .leafNodeSize = leafNodeSize, .nodeCount = 1 };
+    return 0;
+}
+
+size_t idxpyrSparse_getFirst(idxpyrSparse_t *pyr) {
+    if (!pyr->root->mask)
+        return IDXPYR_EMPTY;
+
+    idxpyrSparse_node_t *node = pyr->root;
+    size_t position = 0;
+    for (unsigned int row = pyr->height - 1; row > 1; --row) {
+        unsigned int digit = bitops_ctz(node->mask);
+        position = position << BLOCK_BIT_COUNT_LOG2 | digit;
+        node = getChildren(node)[digit];
+    }
+    unsigned int digit = bitops_ctz(node->mask);
+    position = position << BLOCK_BIT_COUNT_LOG2 | digit;
+    return position << BLOCK_BIT_COUNT_LOG2 | bitops_ctz(getLeaves(node)[digit]);
+}
+
+size_t idxpyrSparse_popFirst(idxpyrSparse_t *pyr) {
+    size_t result = idxpyrSparse_getFirst(pyr);
+    if (result != IDXPYR_EMPTY)
+        idxpyrSparse_set(pyr, result, false);
+
+    return result;
+}
+
+bool idxpyrSparse_get(idxpyrSparse_t *pyr, size_t index) {
+    assert(index < (size_t) 1 << pyr->indexCountLog2);
+    idxpyrSparse_node_t *node = pyr->root;
+    for (unsigned int row = pyr->height - 1; row > 1; --row) {
+        unsigned int digit = getDigit(index, row);
+        if (!(node->mask & BIT(digit)))
+            return false;
+        node = getChildren(node)[digit];
+    }
+    return getLeaves(node)[getDigit(index, 1)] & BIT(index & BLOCK_BIT_MASK);
+}
+
+int idxpyrSparse_set(idxpyrSparse_t *pyr, size_t index, bool state) {
+    assert(index < (size_t) 1 << pyr->indexCountLog2);
+    idxpyrSparse_node_t *path[IDXPYR_MAX_HEIGHT];
+    path[pyr->height - 1] = pyr->root;
+
+    if (state) {
+        // allocate first, so a failure leaves the pyramid as it was
+        unsigned int firstNewRow = 0;
+        for (unsigned int row = pyr->height - 1; row > 1; --row) {
+            idxpyrSparse_node_t **child = getChildren(path[row]) + getDigit(index, row);
+            if (!*child) {
+                *child = calloc(1, row - 1 == 1 ? pyr->leafNodeSize : pyr->nodeSize);
+                if (!*child) {
+                    if (firstNewRow) {
+                        idxpyrSparse_node_t **first = getChildren(path[firstNewRow]) + getDigit(index, firstNewRow);
+                        destroyNode(*first, firstNewRow - 1);
+                        *first = NULL;
+                        pyr->nodeCount -= firstNewRow - row;
+                    }
+                    errno = ENOMEM;
+                    return -1;
+                }
+                ++pyr->nodeCount;
+                firstNewRow = firstNewRow ? firstNewRow : row;
+            }
+            path[row - 1] = *child;
+        }
+
+        getLeaves(path[1])[getDigit(index, 1)] |= BIT(index & BLOCK_BIT_MASK);
+        for (unsigned int row = 1; row < pyr->height; ++row)
+            path[row]->mask |= BIT(getDigit(index, row));
+        return 0;
+    }
+
+    for (unsigned int row = pyr->height - 1; row > 1; --row) {
+        unsigned int digit = getDigit(index, row);
+        if (!(path[row]->mask & BIT(digit)))
+            return 0;
+        path[row - 1] = getChildren(path[row])[digit];
+    }
+    idxpyr_block_t *leaf = getLeaves(path[1]) + getDigit(index, 1);
+    *leaf &= (idxpyr_block_t) ~BIT(index & BLOCK_BIT_MASK);
+    if (*leaf)
+        return 0;
+
+    // free the nodes that became empty, bottom up
+    path[1]->mask &= (idxpyr_block_t) ~BIT(getDigit(index, 1));
+    for (unsigned int row = 1; row < pyr->height - 1 && !path[row]->mask; ++row) {
+        unsigned int digit = getDigit(index, row + 1);
+        free(path[row]);
+        --pyr->nodeCount;
+        getChildren(path[row + 1])[digit] = NULL;
+        path[row + 1]->mask &= (idxpyr_block_t) ~BIT(digit);
+    }
+    return 0;
+}
+
+void idxpyrSparse_destroy(idxpyrSparse_t *pyr) {
+    destroyNode(pyr->root, pyr->height - 1);
+    pyr->root = NULL;
+    pyr->nodeCount = 0;
+}
+
+// private functions
+// -----------------------------------------------------------------------------
+static inline unsigned int getDigit(size_t index, unsigned int row) {
+    return (index >> (row * BLOCK_BIT_COUNT_LOG2)) & BLOCK_BIT_MASK;
+}
+
+static inline idxpyrSparse_node_t **getChildren(idxpyrSparse_node_t *node) {
+    return (idxpyrSparse_node_t **) (void *) node->slots;
+}
+
+static inline idxpyr_block_t *getLeaves(idxpyrSparse_node_t *node) {
+    return (idxpyr_block_t *) (void *) node->slots;
+}
+
+static void destroyNode(idxpyrSparse_node_t *node, unsigned int row) {
+    if (row > 1) {
+        idxpyrSparse_node_t **children = getChildren(node);
+        for (size_t i = 0; i < UM_BIT_COUNT(idxpyr_block_t); ++i) {
+            if (children[i])
+                destroyNode(children[i], row - 1);
+        }
+    }
+    free(node);
+}
+
+// unittest
+// -----------------------------------------------------------------------------
+#ifdef UNITTEST
+
+int idxpyrSparseInit(void) {
+    idxpyrSparse_t pyr;
+    ASSERT(!idxpyrSparse_init(&pyr, 0));
+    ASSERT(pyr.indexCountLog2 == 2 * UM_BIT_COUNT_LOG2(idxpyr_block_t));
+    ASSERT(pyr.height == 2);
+    ASSERT(pyr.nodeCount == 1);
+    ASSERT(idxpyrSparse_getFirst(&pyr) == IDXPYR_EMPTY);
+    // leaf blocks are packed, only the children need pointer wide slots
+    ASSERT(pyr.leafNodeSize - offsetof(idxpyrSparse_node_t, slots)
+            == UM_BIT_COUNT(idxpyr_block_t) * sizeof(idxpyr_block_t));
+    ASSERT(pyr.nodeSize - offsetof(idxpyrSparse_node_t, slots)
+            == UM_BIT_COUNT(idxpyr_block_t) * sizeof(void *));
+    idxpyrSparse_destroy(&pyr);
+
+    ASSERT(!idxpyrSparse_init(&pyr, 48));
+    ASSERT(idxpyrSparse_get(&pyr, ((size_t) 1 << 48) - 1) == false);
+    idxpyrSparse_destroy(&pyr);
+
+    ASSERT(!idxpyrSparse_init(&pyr, 20));
+    idxpyr_t dense = idxpyr_make(20, false);
+    ASSERT(pyr.height == dense.height);
+    idxpyr_destroy(&dense);
+    idxpyrSparse_destroy(&pyr);
+    return 0;
+}
+
+int idxpyrSparseSetAllocatesAndClearFrees(void) {
+    idxpyrSparse_t pyr;
+    idxpyrSparse_init(&pyr, 48);
+    size_t far = ((size_t) 1 << 47) + 12345;
+    ASSERT(!idxpyrSparse_set(&pyr, far, true));
+    ASSERT(pyr.nodeCount == pyr.height - 1);
+    ASSERT(!idxpyrSparse_set(&pyr, far + 1, true));
+    ASSERT(pyr.nodeCount == pyr.height - 1);
+    ASSERT(!idxpyrSparse_set(&pyr, 7, true));
+    ASSERT(pyr.nodeCount == 2 * (pyr.height - 1) - 1);
+
+    ASSERT(idxpyrSparse_get(&pyr, far));
+    ASSERT(!idxpyrSparse_get(&pyr, far + 2));
+    ASSERT(!idxpyrSparse_get(&pyr, 12345));
+    ASSERT(idxpyrSparse_getFirst(&pyr) == 7);
+
+    ASSERT(idxpyrSparse_popFirst(&pyr) == 7);
+    ASSERT(pyr.nodeCount == pyr.height - 1);
+    ASSERT(idxpyrSparse_popFirst(&pyr) == far);
+    ASSERT(idxpyrSparse_popFirst(&pyr) == far + 1);
+    ASSERT(idxpyrSparse_popFirst(&pyr) == IDXPYR_EMPTY);
+    ASSERT(pyr.nodeCount == 1);
+    ASSERT(!pyr.root->mask);
+    // clearing what isn't there is a no-op
+    ASSERT(!idxpyrSparse_set(&pyr, far, false));
+
+    idxpyrSparse_destroy(&pyr);
+    return 0;
+}
+
+int idxpyrSparseMatchesDensePyramid(void) {
+    const unsigned int indexCountLog2 = 14;
+    const size_t indexCount = (size_t) 1 << indexCountLog2;
+    idxpyrSparse_t pyr;
+    idxpyrSparse_init(&pyr, indexCountLog2);
+    idxpyr_t dense = idxpyr_make(indexCountLog2, false);
+    ASSERT(pyr.height == dense.height);
+
+    uint32_t x = 2463534242;
+    for (int i = 0; i < 20000; ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        size_t index = x & (indexCount - 1);
+        if (i % 5 == 4) {
+            ASSERT(idxpyrSparse_popFirst(&pyr) == idxpyr_popFirst(&dense));
+        } else {
+            bool state = (x >> 20) % 3;
+            ASSERT(!idxpyrSparse_set(&pyr, index, state));
+            idxpyr_set(&dense, index, state);
+        }
+        ASSERT(idxpyrSparse_getFirst(&pyr) == idxpyr_getFirst(&dense));
+        ASSERT(idxpyrSparse_get(&pyr, index) == idxpyr_get(&dense, index));
+    }
+    while (idxpyr_getFirst(&dense) != IDXPYR_EMPTY)
+        ASSERT(idxpyrSparse_popFirst(&pyr) == idxpyr_popFirst(&dense));
+    ASSERT(pyr.nodeCount == 1);
+
+    idxpyr_destroy(&dense);
+    idxpyrSparse_destroy(&pyr);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "idxpyr.h"
+
+/* Sparse variant of idxpyr_t for huge index spaces (e.g. 48 bit addresses). Same rows
+   and same getFirst order, but every block of an upper row lives in a node together
+   with the pointers to its children, and nodes only exist while something below them is
+   set. The nodes right above the leaf row keep the leaf blocks inline, packed as
+   idxpyr_block_t -- not pointer wide. Memory grows with the number of populated regions
+   instead of the index count. */
+
+typedef struct idxpyrSparse_node_t {
+    idxpyr_block_t mask; // bit set <=> slot is non-empty
+    // row 1: idxpyr_block_t leaf blocks, upper rows: idxpyrSparse_node_t * children
+    _Alignas(void *) unsigned char slots[];
+} idxpyrSparse_node_t;
+
+typedef struct {
+    unsigned int indexCountLog2;
+    unsigned int height; // rows including the leaf row, like idxpyr_t
+    idxpyrSparse_node_t *root;
+    size_t nodeSize; // rows above 1
+    size_t leafNodeSize; // row 1
+    size_t nodeCount; // root included
+} idxpyrSparse_t;
+
+// indexCountLog2 is raised to at least two blocks worth of bits; -1 with errno ENOMEM
+int idxpyrSparse_init(idxpyrSparse_t *pyr, unsigned int indexCountLog2);
+// if no index is found IDXPYR_EMPTY is returned
+size_t idxpyrSparse_getFirst(idxpyrSparse_t *pyr);
+size_t idxpyrSparse_popFirst(idxpyrSparse_t *pyr);
+
+// index has to be within the pyramid -- guarded by assert()
+bool idxpyrSparse_get(idxpyrSparse_t *pyr, size_t index);
+// allocates the missing nodes on the way; -1 with errno ENOMEM (nothing changed then)
+int idxpyrSparse_set(idxpyrSparse_t *pyr, size_t index, bool state);
+
+void idxpyrSparse_destroy(idxpyrSparse_t *pyr);
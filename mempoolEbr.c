@@ -10,18 +10,25 @@
 
 #include "kvec.h"
 #include "utilMacros.h"
+#include "bitops.h"
 #include "unittestMacros.h"
 
 // private declarations
 // -----------------------------------------------------------------------------
+STATIC_ASSERT(sizeof(mp_location_t) > sizeof(mp_id_t), locationsNeedMoreBitsThanIds);
+
 static int testInitSettingsArg(mp_poolSettings_t s);
 static void initClusterFifos(mp_pool_t *pool);
 
 static unsigned int log2Envelope(size_t val);
 static inline bool _idExists(const mp_pool_t *pool, mp_id_t id);
 static int testIdExists(const mp_pool_t *pool, mp_id_t id);
-static mp_id_t takeNextLocation(mp_pool_t *pool);
-static inline uint8_t *getElementStore(const mp_pool_t *pool, mp_id_t location);
+static mp_location_t takeNextLocation(mp_pool_t *pool);
+static inline uint8_t *getElementStore(const mp_pool_t *pool, mp_location_t location);
+static mp_location_t getBackLocation(const mp_pool_t *pool);
+// after the back element was freed or moved away
+static void advanceBack(mp_pool_t *pool);
+static void addIds(mp_pool_t *pool);
 
 static void addFrontCluster(mp_pool_t *pool);
 static void addClusterIndices(mp_pool_t *pool);
@@ -47,12 +54,11 @@ int mp_init(mp_pool_t *poolOut, mp_poolSettings_t settings) {
     size_t elementStoreSize = settings.elementSize + sizeof(mp_id_t);
     poolOut->clusterSize = elementStoreSize * poolOut->elementsPerCluster;
 
-    kv_resize(mp_id_t, poolOut->locationLut, UM_BIT_COUNT(idxpyr_block_t));
-    // FIXME kv_push(mp_id_t, poolOut->locationLut, (mp_id_t) -1); // advance past illegal id 0
-    // init index pyramid
-    poolOut->freeIds = idxpyr_make(UM_BIT_COUNT_LOG2(idxpyr_block_t));
-    idxpyr_setAll(&poolOut->freeIds, true);
+    // set bits of freeIds are free ids; locationLut has an entry for every one of them
+    poolOut->freeIds = idxpyr_make(UM_BIT_COUNT_LOG2(idxpyr_block_t), true);
     idxpyr_set(&poolOut->freeIds, 0, false); // scratch illegal id 0
+    kv_resize(mp_location_t, poolOut->locationLut, UM_BIT_COUNT(idxpyr_block_t));
+    kv_size(poolOut->locationLut) = kv_max(poolOut->locationLut);
 
     initClusterFifos(poolOut);
 
@@ -63,23 +69,18 @@ int mp_init(mp_pool_t *poolOut, mp_poolSettings_t settings) {
 }
 
 void mp_alloc(mp_pool_t *pool, mp_id_t *idOut) {
-    mp_id_t location = takeNextLocation(pool);
     size_t id = idxpyr_popFirst(&pool->freeIds);
     if (id == IDXPYR_EMPTY) {
-        size_t newId = kv_size(pool->locationLut);
-        id = (mp_id_t) newId;
-        // FIXME ids are denser than clusters - move this assert to cluster creation
-        assert(id == newId); // new id fits into mp_id_t
-        kv_push(mp_id_t, pool->locationLut, location);
-        idxpyr_increaseSize(&pool->freeIds, true);
-        // FIXME ?
-        idxpyr_set(&pool->freeIds, kv_size(pool->locationLut) - 1, false);
-    } else {
-        kv_A(pool->locationLut, id) = location;
+        addIds(pool);
+        id = idxpyr_popFirst(&pool->freeIds);
     }
+    assert(id == (mp_id_t) id); // id fits into mp_id_t
 
+    mp_location_t location = takeNextLocation(pool);
+    kv_A(pool->locationLut, id) = location;
     uint8_t *elementIdStore = getElementStore(pool, location) + pool->elementSize;
     memcpy(elementIdStore, &id, sizeof(mp_id_t));
+    ++pool->elementCount;
 
     *idOut = (mp_id_t) id;
 }
@@ -89,10 +90,20 @@ int mp_free(mp_pool_t *pool, mp_id_t id) {
     if (error)
         return error;
 
-    // FIXME free (overwrite with tail, update tails location)
-    idxpyr_set(&pool->freeIds, id, false);
-    // FIXME only use freeIds to check whether the location is free
-    kv_A(pool->locationLut, id) = (mp_id_t) -1;
+    // the back element fills the hole, its id behind the data leads to its lut entry
+    mp_location_t location = kv_A(pool->locationLut, id);
+    mp_location_t backLocation = getBackLocation(pool);
+    if (location != backLocation) {
+        uint8_t *back = getElementStore(pool, backLocation);
+        memcpy(getElementStore(pool, location), back, pool->elementSize + sizeof(mp_id_t));
+        mp_id_t backId;
+        memcpy(&backId, back + pool->elementSize, sizeof(mp_id_t));
+        kv_A(pool->locationLut, backId) = location;
+    }
+
+    idxpyr_set(&pool->freeIds, id, true);
+    --pool->elementCount;
+    advanceBack(pool);
     return 0;
 }
 
@@ -129,6 +140,27 @@ int mp_set(mp_pool_t *pool, mp_id_t id, const void *in) {
     return 0;
 }
 
+size_t mp_count(const mp_pool_t *pool) {
+    return pool->elementCount;
+}
+
+void mp_forEach(mp_pool_t *pool, void (*fn)(mp_id_t id, void *data, void *arg), void *arg) {
+    size_t elementStoreSize = pool->elementSize + sizeof(mp_id_t);
+    circbuf_t allocated = pool->allocatedClusterIndices;
+    size_t iter = allocated.start;
+    for (size_t i = 0; i < allocated.length; ++i) {
+        uint8_t *cluster = kv_A(pool->clusterLut, (size_t) CIRCBUF_NEXT(allocated, iter));
+        size_t begin = i ? 0 : pool->backElementIndex;
+        size_t end = i == allocated.length - 1 ? pool->frontElementIndex : pool->elementsPerCluster;
+        for (size_t j = begin; j < end; ++j) {
+            uint8_t *elem = cluster + j * elementStoreSize;
+            mp_id_t id;
+            memcpy(&id, elem + pool->elementSize, sizeof(mp_id_t));
+            fn(id, elem, arg);
+        }
+    }
+}
+
 void mp_destroy(mp_pool_t *pool) {
     kv_destroy(pool->locationLut);
     idxpyr_destroy(&pool->freeIds);
@@ -143,14 +175,12 @@ void mp_destroy(mp_pool_t *pool) {
 // private functions
 // -----------------------------------------------------------------------------
 static int testInitSettingsArg(mp_poolSettings_t settings) {
-    // FIXME test: enveloped elementsPerCluster <= 1 << sizeof(mp_id_t) / 2
-    // also free cluster wouldn't make sense at this constellation
-    // (max (elements in mp_id_t / elementsPerCluster) - catch
     if (!settings.elementSize) {
         errno = MP_ERROR_ELEMENT_SIZE;
         return -1;
     }
-    if (!settings.elementsPerCluster) {
+    // a cluster bigger than the id space could never be filled
+    if (!settings.elementsPerCluster || log2Envelope(settings.elementsPerCluster) > UM_BIT_COUNT(mp_id_t)) {
         errno = MP_ERROR_ELEMENTS_PER_CLUSTER;
         return -1;
     }
@@ -172,28 +202,6 @@ static void initClusterFifos(mp_pool_t *pool) {
         circbuf_put(&pool->unallocatedClusterIndices, (void *) i);
 }
 
-// FIXME move bit stuff into own module
-static int findLastSet(size_t val) {
-    if (!val)
-        return -1;
-
-    int result = 0;
-    if (val & 0xFFFFFFFF00000000)
-        val >>= 32, result += 32;
-    if (val & 0xFFFF0000)
-        val >>= 16, result += 16;
-    if (val & 0xFF00)
-        val >>= 8, result += 8;
-    if (val & 0xF0)
-        val >>= 4, result += 4;
-    if (val & 0xC)
-        val >>= 2, result += 2;
-    if (val & 0x2)
-        result += 1;
-
-    return result;
-}
-
 static inline bool multipleBits(size_t val) {
     return (val & ~(val - 1)) != val;
 }
@@ -202,12 +210,13 @@ static unsigned int log2Envelope(size_t val) {
     if (!val)
         return 0;
 
-    unsigned int lastSet = (unsigned int) findLastSet(val);
+    unsigned int lastSet = (unsigned int) bitops_findLastSet(val);
     return multipleBits(val) ? lastSet + 1 : lastSet;
 }
 
 static inline bool _idExists(const mp_pool_t *pool, mp_id_t id) {
-    return id < kv_size(pool->locationLut) && kv_A(pool->locationLut, id) != (mp_id_t) -1;
+    // id 0 is never free, but doesn't exist either
+    return id && id < kv_size(pool->locationLut) && !idxpyr_get((idxpyr_t *) &pool->freeIds, id);
 }
 
 static int testIdExists(const mp_pool_t *pool, mp_id_t id) {
@@ -219,26 +228,57 @@ static int testIdExists(const mp_pool_t *pool, mp_id_t id) {
     return 0;
 }
 
-static mp_id_t takeNextLocation(mp_pool_t *pool) {
+static mp_location_t takeNextLocation(mp_pool_t *pool) {
     bool isFrontElementIndexAtEnd = (pool->frontElementIndex == pool->elementsPerCluster);
     if (isFrontElementIndexAtEnd)
         addFrontCluster(pool);
-    // FIXME frontClusterIndex has nothing to do with clusterLut - it's the end of allocatedClusterIndices
     size_t frontClusterIndexIndex = CIRCBUF_FRONT_INDEX(pool->allocatedClusterIndices);
     size_t frontClusterIndex = (size_t) pool->allocatedClusterIndices.a[frontClusterIndexIndex];
     size_t location = frontClusterIndex << pool->clusterIndexOffset | pool->frontElementIndex;
+    assert(location == (mp_location_t) location); // location fits into mp_location_t
     ++pool->frontElementCount;
     ++pool->frontElementIndex;
-    return (mp_id_t) location;
+    return (mp_location_t) location;
 }
 
-static inline uint8_t *getElementStore(const mp_pool_t *pool, mp_id_t location) {
-    mp_id_t clusterIndex = location >> pool->clusterIndexOffset;
+static inline uint8_t *getElementStore(const mp_pool_t *pool, mp_location_t location) {
+    size_t clusterIndex = (size_t) location >> pool->clusterIndexOffset;
     size_t elementStoreSize = pool->elementSize + sizeof(mp_id_t);
-    size_t elementStoreOffset = location & pool->elementIndexMask * elementStoreSize;
+    size_t elementStoreOffset = (location & pool->elementIndexMask) * elementStoreSize;
     return (uint8_t *) pool->clusterLut.a[clusterIndex] + elementStoreOffset;
 }
 
+static mp_location_t getBackLocation(const mp_pool_t *pool) {
+    const circbuf_t *allocated = &pool->allocatedClusterIndices;
+    size_t backClusterIndex = (size_t) allocated->a[allocated->start];
+    return (mp_location_t) (backClusterIndex << pool->clusterIndexOffset | pool->backElementIndex);
+}
+
+static void advanceBack(mp_pool_t *pool) {
+    // empty -- start over in the front cluster
+    if (!pool->elementCount) {
+        while (pool->allocatedClusterIndices.length > 1)
+            removeBackCluster(pool);
+        pool->backElementIndex = 0;
+        pool->frontElementIndex = 0;
+        pool->frontElementCount = 0;
+        return;
+    }
+
+    if (++pool->backElementIndex == pool->elementsPerCluster) {
+        removeBackCluster(pool);
+        pool->backElementIndex = 0;
+    }
+}
+
+static void addIds(mp_pool_t *pool) {
+    // the new half of freeIds is free like at init
+    idxpyr_increaseSize(&pool->freeIds);
+    size_t idCount = (size_t) 1 << pool->freeIds.indexCountLog2;
+    kv_resize(mp_location_t, pool->locationLut, idCount);
+    kv_size(pool->locationLut) = idCount;
+}
+
 static void addFrontCluster(mp_pool_t *pool) {
     bool isClusterIndexAvailable = pool->unallocatedClusterIndices.length;
     if (!isClusterIndexAvailable)
@@ -273,6 +313,7 @@ static void removeBackCluster(mp_pool_t *pool) {
     void *backIndex = circbuf_popBack(&pool->allocatedClusterIndices);
     circbuf_dynamicPut(&pool->unallocatedClusterIndices, backIndex);
     void *back = kv_A(pool->clusterLut, (size_t) backIndex);
+    kv_A(pool->clusterLut, (size_t) backIndex) = NULL;
 
     if (!kv_full(pool->freeClusters))
         kv_staticPush(pool->freeClusters, back);
@@ -329,6 +370,21 @@ int mp_initWithElementSizeOfZeroFails(void) {
     return 0;
 }
 
+int mp_initWithClusterBiggerThanIdSpaceFails(void) {
+    mp_pool_t pool;
+    mp_poolSettings_t s = { .elementSize = 4, .elementsPerCluster = (size_t) 1 << UM_BIT_COUNT(mp_id_t),
+        .freeClusterCountMax = 1 };
+    ASSERT(!mp_init(&pool, s));
+    mp_destroy(&pool);
+
+    ++s.elementsPerCluster;
+    int error = mp_init(&pool, s);
+    ASSERT(error);
+    ASSERT(errno == MP_ERROR_ELEMENTS_PER_CLUSTER);
+
+    return 0;
+}
+
 int mp_initWithZeroElementsPerClusterFails(void) {
     mp_pool_t pool;
     mp_poolSettings_t s = { .elementSize = 4, .elementsPerCluster = 0, .freeClusterCountMax = 1 };
@@ -347,6 +403,8 @@ int mp_initInitializesClusterFifos(void) {
     size_t supportingClusterFifoElementCount = pool.allocatedClusterIndices.length
         + pool.unallocatedClusterIndices.length;
     ASSERT(reservedClusterIndexCount == supportingClusterFifoElementCount);
+
+    mp_destroy(&pool);
     return 0;
 }
 
@@ -521,6 +579,157 @@ int mp_setNonexistentElementFails(void) {
     return 0;
 }
 
+// compaction
+int mp_freeMovesBackElementIntoHole(void) {
+    mp_pool_t pool = initPool(sizeof(uint32_t), 4, 4);
+    mp_id_t ids[6];
+    for (uint32_t i = 0; i < 6; ++i) {
+        mp_alloc(&pool, ids + i);
+        mp_set(&pool, ids[i], &i);
+    }
+    // element stores aren't aligned - only compare the pointers
+    void *hole;
+    mp_getPtr(&pool, ids[3], &hole);
+
+    ASSERT(!mp_free(&pool, ids[3]));
+    void *moved;
+    mp_getPtr(&pool, ids[0], &moved);
+    ASSERT(moved == hole);
+    ASSERT(pool.backElementIndex == 1 && mp_count(&pool) == 5);
+    for (uint32_t i = 0; i < 6; ++i) {
+        uint32_t val;
+        if (i == 3)
+            continue;
+        ASSERT(!mp_get(&pool, ids[i], &val));
+        ASSERT(val == i);
+    }
+
+    mp_destroy(&pool);
+    return 0;
+}
+
+int mp_emptiedBackClusterBecomesFreeCluster(void) {
+    mp_pool_t pool = initPool(1, 2, 1);
+    mp_id_t ids[6];
+    for (size_t i = 0; i < 6; ++i)
+        mp_alloc(&pool, ids + i);
+    ASSERT(pool.allocatedClusterIndices.length == 3);
+
+    mp_free(&pool, ids[5]);
+    mp_free(&pool, ids[4]);
+    ASSERT(pool.allocatedClusterIndices.length == 2);
+    ASSERT(kv_size(pool.freeClusters) == 1);
+    // freeClusterCountMax is reached - the next one is released
+    mp_free(&pool, ids[3]);
+    mp_free(&pool, ids[2]);
+    ASSERT(pool.allocatedClusterIndices.length == 1);
+    ASSERT(kv_size(pool.freeClusters) == 1);
+
+    // the free cluster is reused
+    mp_id_t id;
+    mp_alloc(&pool, &id);
+    mp_alloc(&pool, &id);
+    ASSERT(!kv_size(pool.freeClusters));
+    ASSERT(mp_count(&pool) == 4);
+
+    mp_destroy(&pool);
+    return 0;
+}
+
+int mp_churnAtIdCapacityKeepsLocationsValid(void) {
+    mp_pool_t pool = initPool(sizeof(uint32_t), 64, 1);
+    const uint32_t idCountMax = (uint32_t) (mp_id_t) -1;
+    for (uint32_t i = 1; i <= idCountMax; ++i) {
+        mp_id_t id;
+        mp_alloc(&pool, &id);
+        ASSERT(id == i);
+        mp_set(&pool, id, &i);
+    }
+
+    // every free moves the back forward while allocs append at the front, so the live
+    // elements span one cluster more than they fill
+    for (uint32_t i = 1; i <= 3; ++i) {
+        ASSERT(!mp_free(&pool, (mp_id_t) i));
+        mp_id_t id;
+        mp_alloc(&pool, &id);
+        ASSERT(id == i);
+        mp_set(&pool, id, &i);
+    }
+    ASSERT(pool.allocatedClusterIndices.length == idCountMax / 64 + 2);
+    ASSERT(mp_count(&pool) == idCountMax);
+
+    for (uint32_t i = 1; i <= idCountMax; ++i) {
+        uint32_t val;
+        ASSERT(!mp_get(&pool, (mp_id_t) i, &val));
+        ASSERT(val == i);
+    }
+
+    mp_destroy(&pool);
+    return 0;
+}
+
+static void sumElement(mp_id_t id, void *data, void *arg) {
+    size_t *sums = arg;
+    uint32_t val;
+    memcpy(&val, data, sizeof(val));
+    sums[0] += id;
+    sums[1] += val;
+    ++sums[2];
+}
+
+int mp_randomAllocFreeMatchesReference(void) {
+    mp_pool_t pool = initPool(sizeof(uint32_t), 8, 2);
+    enum { idCount = 1000 };
+    static uint32_t reference[idCount];
+    static bool isLive[idCount];
+    mp_id_t live[idCount];
+    size_t liveCount = 0;
+    uint32_t x = 88172645;
+    for (int step = 0; step < 30000; ++step) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        // drift between filling up and draining to exercise both ends of the cluster FIFO
+        bool isAllocBiased = step / 5000 % 2 == 0;
+        if (!liveCount || (liveCount < idCount - 1 && x % 8 < (isAllocBiased ? 5u : 3u))) {
+            mp_id_t id;
+            mp_alloc(&pool, &id);
+            ASSERT(id && id < idCount && !isLive[id]);
+            isLive[id] = true;
+            reference[id] = x;
+            mp_set(&pool, id, &x);
+            live[liveCount++] = id;
+        } else {
+            size_t i = (x >> 8) % liveCount;
+            mp_id_t id = live[i];
+            ASSERT(!mp_free(&pool, id));
+            isLive[id] = false;
+            live[i] = live[--liveCount];
+        }
+
+        if (step % 97)
+            continue;
+        size_t expectedSums[3] = { 0, 0, liveCount };
+        for (size_t i = 0; i < liveCount; ++i) {
+            uint32_t val;
+            ASSERT(!mp_get(&pool, live[i], &val));
+            ASSERT(val == reference[live[i]]);
+            expectedSums[0] += live[i];
+            expectedSums[1] += val;
+        }
+        size_t sums[3] = { 0 };
+        mp_forEach(&pool, sumElement, sums);
+        ASSERT(!memcmp(sums, expectedSums, sizeof(sums)));
+        ASSERT(mp_count(&pool) == liveCount);
+        // dense: no more clusters than needed for the live elements, plus a partial one
+        size_t clusterCountMax = liveCount / pool.elementsPerCluster + 2;
+        ASSERT(pool.allocatedClusterIndices.length <= clusterCountMax);
+    }
+
+    mp_destroy(&pool);
+    return 0;
+}
+
 // private
 // FIXME taken circbuf hast to be checked for clusterCount - replace clusterLut.length
 int mp_plainAddFrontCluster(void) {
@@ -561,17 +770,6 @@ int mp_plainRemoveBackCluster(void) {
     return 0;
 }
 
-int mp_findLastSet(void) {
-    ASSERT(findLastSet(0) == -1);
-    ASSERT(findLastSet(1 << 0) == 0);
-    ASSERT(findLastSet(1 << 1) == 1);
-    ASSERT(findLastSet(1 << 2) == 2);
-    ASSERT(findLastSet(1 << 15) == 15);
-    ASSERT(findLastSet(0x5555) == 14);
-    ASSERT(findLastSet(0xAAAA) == 15);
-    return 0;
-}
-
 int mp_testMultipleBits(void) {
     ASSERT(!multipleBits(0));
     ASSERT(!multipleBits(1));
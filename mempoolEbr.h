@@ -14,7 +14,12 @@
 #include "idxpyr.h"
 #include "circbuf.h"
 
-// FIXME implementation is broken and put on hold -- use mempool.h for faster and slimmer version
+/* Pool of fixed size elements addressed by stable ids. Elements are kept dense: they
+   live in a FIFO of clusters, new ones are appended at the front, and a freed element's
+   slot is refilled with the element at the back. Every element carries its id behind
+   the data, so the moved element's locationLut entry can be patched. Emptied back
+   clusters go to freeClusters (up to freeClusterCountMax) or are freed -- memory use
+   and mp_forEach follow the live element count, not its peak. */
 
 //  functions return -1 on error; errno can be checked for specific value
 #define MP_ERROR_ELEMENT_SIZE 300
@@ -26,13 +31,19 @@
 
 typedef struct {
     size_t elementSize;
-    size_t elementsPerCluster; // suggested value - implementation might choose to modify it
+    // suggested value - rounded up to a power of two, at most 2^(bits of mp_id_t)
+    size_t elementsPerCluster;
     size_t freeClusterCountMax; // memory is freed more agressively with smaller values
 } mp_poolSettings_t;
 
 /* Defines ID size for every pool in the application. If there is no need for more than
    65K IDs uint16_t would reduce memory overhead. */
 typedef uint16_t mp_id_t;
+/* Element address: cluster index << log2(elementsPerCluster) | element index. Holes are
+   filled from the back while elements are appended at the front, so n live elements
+   can span one cluster more than they fill, and cluster indices are handed out up to
+   the next power of two -- locations need about two bits more than ids. */
+typedef uint32_t mp_location_t;
 
 // opaque mempool type - shouldn't be changed directly
 typedef struct {
@@ -41,8 +52,7 @@ typedef struct {
     size_t clusterSize;
     size_t clusterIndexOffset;
     size_t elementIndexMask;
-    // there is no need to address more locations than maximum number of keys - hence mp_id_t
-    kvec_t(mp_id_t) locationLut;
+    kvec_t(mp_location_t) locationLut;
     idxpyr_t freeIds;
 
     kvec_t(void *) clusterLut;
@@ -54,12 +64,13 @@ typedef struct {
     size_t frontElementCount;
     size_t frontElementIndex;
     size_t backElementIndex;
+    size_t elementCount;
 
     kvec_t(void *) freeClusters;
 } mp_pool_t;
 
 int mp_init(mp_pool_t *poolOut, mp_poolSettings_t settings);
-// id 0 is invalid and won't be returned
+// id 0 is invalid and won't be returned; ids of freed elements are reused lowest first
 void mp_alloc(mp_pool_t *pool, mp_id_t *idOut);
 int mp_free(mp_pool_t *pool, mp_id_t id);
 bool mp_idExists(mp_pool_t *pool, mp_id_t id); // exception to no 0 id rule - simply returns false
@@ -68,4 +79,7 @@ int mp_get(mp_pool_t *pool, mp_id_t id, void *out);
 // result pointer shouldn't be saved - it could change after any mp_free call
 int mp_getPtr(mp_pool_t *pool, mp_id_t id, void **data);
 int mp_set(mp_pool_t *pool, mp_id_t id, const void *in);
+size_t mp_count(const mp_pool_t *pool);
+// visits the live elements back to front; fn mustn't alloc or free
+void mp_forEach(mp_pool_t *pool, void (*fn)(mp_id_t id, void *data, void *arg), void *arg);
 void mp_destroy(mp_pool_t *pool);
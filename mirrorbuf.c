@@ -0,0 +1,205 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#define _GNU_SOURCE
+#include "mirrorbuf.h"
+
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "unittestMacros.h"
+
+// private declarations
+// -----------------------------------------------------------------------------
+static unsigned int getPageSizeLog2(void);
+static uint8_t *mapMirrored(size_t capacity);
+
+// interface functions
+// -----------------------------------------------------------------------------
+int mirrorbuf_init(mirrorbuf_t *bufOut, unsigned int capacityLog2) {
+    unsigned int pageSizeLog2 = getPageSizeLog2();
+    if (capacityLog2 < pageSizeLog2)
+        capacityLog2 = pageSizeLog2;
+    assert(capacityLog2 < sizeof(size_t) * 8 - 1);
+
+    size_t capacity = (size_t) 1 << capacityLog2;
+    uint8_t *a = mapMirrored(capacity);
+    if (!a)
+        return -1;
+
+    *bufOut = (mirrorbuf_t) { .a = a, .capacityLog2 = capacityLog2, .rotationMask = capacity - 1 };
+    return 0;
+}
+
+const uint8_t *mirrorbuf_readPtr(const mirrorbuf_t *buf, size_t *lengthOut) {
+    *lengthOut = buf->length;
+    return buf->a + buf->start;
+}
+
+void mirrorbuf_commitRead(mirrorbuf_t *buf, size_t count) {
+    assert(count <= buf->length);
+    buf->start = buf->start + count & buf->rotationMask;
+    buf->length -= count;
+}
+
+uint8_t *mirrorbuf_writePtr(const mirrorbuf_t *buf, size_t *lengthOut) {
+    *lengthOut = buf->rotationMask + 1 - buf->length;
+    return buf->a + (buf->start + buf->length & buf->rotationMask);
+}
+
+void mirrorbuf_commitWrite(mirrorbuf_t *buf, size_t count) {
+    assert(count <= buf->rotationMask + 1 - buf->length);
+    buf->length += count;
+}
+
+size_t mirrorbuf_write(mirrorbuf_t *buf, const void *in, size_t count) {
+    size_t space;
+    uint8_t *dst = mirrorbuf_writePtr(buf, &space);
+    count = count < space ? count : space;
+    memcpy(dst, in, count);
+    mirrorbuf_commitWrite(buf, count);
+    return count;
+}
+
+size_t mirrorbuf_read(mirrorbuf_t *buf, void *out, size_t count) {
+    size_t available;
+    const uint8_t *src = mirrorbuf_readPtr(buf, &available);
+    count = count < available ? count : available;
+    memcpy(out, src, count);
+    mirrorbuf_commitRead(buf, count);
+    return count;
+}
+
+void mirrorbuf_destroy(mirrorbuf_t *buf) {
+    if (buf->a)
+        munmap(buf->a, 2 * (buf->rotationMask + 1));
+    buf->a = NULL;
+}
+
+// private functions
+// -----------------------------------------------------------------------------
+static unsigned int getPageSizeLog2(void) {
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    unsigned int result = 0;
+    while ((size_t) 1 << result < pageSize)
+        ++result;
+    return result;
+}
+
+static uint8_t *mapMirrored(size_t capacity) {
+    int fd = memfd_create("mirrorbuf", MFD_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+
+    uint8_t *result = NULL;
+    if (ftruncate(fd, (off_t) capacity))
+        goto closeFd;
+
+    // reserve both halves in one go, so the second mapping can't collide with anything
+    void *reserved = mmap(NULL, 2 * capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (reserved == MAP_FAILED)
+        goto closeFd;
+
+    uint8_t *base = reserved;
+    const int prot = PROT_READ | PROT_WRITE;
+    const int flags = MAP_SHARED | MAP_FIXED;
+    if (mmap(base, capacity, prot, flags, fd, 0) == MAP_FAILED
+            || mmap(base + capacity, capacity, prot, flags, fd, 0) == MAP_FAILED) {
+        int error = errno;
+        munmap(base, 2 * capacity);
+        errno = error;
+        goto closeFd;
+    }
+    result = base;
+
+closeFd:
+    close(fd); // mappings keep the memory alive
+    return result;
+}
+
+// unittest
+// -----------------------------------------------------------------------------
+#ifdef UNITTEST
+int mirrorbufInitRaisesCapacityToPageSize(void) {
+    mirrorbuf_t buf;
+    ASSERT(!mirrorbuf_init(&buf, 0));
+    ASSERT(buf.a);
+    ASSERT(buf.rotationMask + 1 == (size_t) sysconf(_SC_PAGESIZE));
+    ASSERT(buf.length == 0);
+
+    mirrorbuf_destroy(&buf);
+    return 0;
+}
+
+int mirrorbufHalvesAreMirrored(void) {
+    mirrorbuf_t buf;
+    ASSERT(!mirrorbuf_init(&buf, 0));
+    size_t capacity = buf.rotationMask + 1;
+    buf.a[3] = 42;
+    ASSERT(buf.a[capacity + 3] == 42);
+    buf.a[capacity + 5] = 43;
+    ASSERT(buf.a[5] == 43);
+
+    mirrorbuf_destroy(&buf);
+    return 0;
+}
+
+int mirrorbufReadPtrIsContiguousAcrossWrap(void) {
+    mirrorbuf_t buf;
+    ASSERT(!mirrorbuf_init(&buf, 0));
+    size_t capacity = buf.rotationMask + 1;
+    buf.start = capacity - 2; // cause wrapping
+
+    const char msg[] = "straddle";
+    ASSERT(mirrorbuf_write(&buf, msg, sizeof(msg)) == sizeof(msg));
+    ASSERT(buf.a[0] == 'r'); // wrapped into the first half
+
+    size_t length;
+    const uint8_t *p = mirrorbuf_readPtr(&buf, &length);
+    ASSERT(length == sizeof(msg));
+    ASSERT(!memcmp(p, msg, sizeof(msg)));
+
+    mirrorbuf_commitRead(&buf, length);
+    ASSERT(buf.start == sizeof(msg) - 2);
+    ASSERT(!buf.length);
+
+    mirrorbuf_destroy(&buf);
+    return 0;
+}
+
+int mirrorbufWritePtrCoversFreeSpace(void) {
+    mirrorbuf_t buf;
+    ASSERT(!mirrorbuf_init(&buf, 0));
+    size_t capacity = buf.rotationMask + 1;
+    buf.start = 10;
+    buf.length = 20;
+    size_t space;
+    uint8_t *p = mirrorbuf_writePtr(&buf, &space);
+    ASSERT(p == buf.a + 30);
+    ASSERT(space == capacity - 20);
+
+    mirrorbuf_commitWrite(&buf, space);
+    ASSERT(buf.length == capacity);
+    ASSERT(!mirrorbuf_write(&buf, "x", 1));
+
+    mirrorbuf_destroy(&buf);
+    return 0;
+}
+
+int mirrorbufReadCopiesOut(void) {
+    mirrorbuf_t buf;
+    ASSERT(!mirrorbuf_init(&buf, 0));
+    mirrorbuf_write(&buf, "abc", 3);
+    char out[4] = { 0 };
+    ASSERT(mirrorbuf_read(&buf, out, sizeof(out)) == 3);
+    ASSERT(!strcmp(out, "abc"));
+
+    mirrorbuf_destroy(&buf);
+    return 0;
+}
+
+#endif
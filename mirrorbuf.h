@@ -0,0 +1,39 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Byte ring whose store is mapped twice back to back (Linux memfd). a[i] and
+   a[i + capacity] are the same byte, so readable and writable regions are always
+   contiguous -- data straddling the wrap point can be parsed in place. */
+
+//  functions return -1 on error; errno can be checked for specific value
+
+typedef struct {
+    uint8_t *a;
+    size_t start;
+    size_t length;
+    unsigned int capacityLog2;
+    size_t rotationMask;
+} mirrorbuf_t;
+
+// capacity is raised to page size if capacityLog2 is smaller
+int mirrorbuf_init(mirrorbuf_t *bufOut, unsigned int capacityLog2);
+
+// returns pointer to all readable bytes; count is written to lengthOut
+const uint8_t *mirrorbuf_readPtr(const mirrorbuf_t *buf, size_t *lengthOut);
+void mirrorbuf_commitRead(mirrorbuf_t *buf, size_t count);
+// returns pointer to all free bytes; count is written to lengthOut
+uint8_t *mirrorbuf_writePtr(const mirrorbuf_t *buf, size_t *lengthOut);
+void mirrorbuf_commitWrite(mirrorbuf_t *buf, size_t count);
+
+// copying convenience functions; return number of bytes transferred
+size_t mirrorbuf_write(mirrorbuf_t *buf, const void *in, size_t count);
+size_t mirrorbuf_read(mirrorbuf_t *buf, void *out, size_t count);
+
+void mirrorbuf_destroy(mirrorbuf_t *buf);
@@ -1,4 +1,5 @@
 #include "utilMacros.h"
+#include "circbufT.h"
 
 #include <stdint.h>
 
@@ -44,4 +45,53 @@ int utlmac_bitCount(void) {
     return 0;
 }
 
+typedef struct {
+    int x, y;
+} miscPoint_t;
+
+CIRCBUF_INIT(miscPt, miscPoint_t)
+
+int circbufT_putAndPopByValue(void) {
+    circbufT(miscPt) buf = circbuf_make_miscPt(2);
+    buf.start = 3; // cause wrapping
+    circbuf_put_miscPt(&buf, (miscPoint_t) { 1, 2 });
+    circbuf_put_miscPt(&buf, (miscPoint_t) { 3, 4 });
+    ASSERT(buf.length == 2);
+    ASSERT(buf.a[0].x == 3);
+
+    miscPoint_t p = circbuf_popBack_miscPt(&buf);
+    ASSERT(p.x == 1 && p.y == 2);
+    p = circbuf_popBack_miscPt(&buf);
+    ASSERT(p.x == 3 && p.y == 4);
+    ASSERT(!buf.length);
+
+    circbuf_destroy_miscPt(&buf);
+    return 0;
+}
+
+int circbufT_peekModifiesInPlace(void) {
+    circbufT(miscPt) buf = circbuf_make_miscPt(2);
+    circbuf_put_miscPt(&buf, (miscPoint_t) { 1, 2 });
+    circbuf_put_miscPt(&buf, (miscPoint_t) { 3, 4 });
+    ASSERT(circbuf_peek_miscPt(&buf, 1)->y == 4);
+    circbuf_peek_miscPt(&buf, 0)->y = 5;
+    ASSERT(circbuf_popBack_miscPt(&buf).y == 5);
+
+    circbuf_destroy_miscPt(&buf);
+    return 0;
+}
+
+int circbufT_dynamicPutKeepsWrappedElements(void) {
+    circbufT(miscPt) buf = circbuf_make_miscPt(1);
+    buf.start = 1; // cause wrapping
+    for (int i = 0; i < 5; ++i)
+        circbuf_dynamicPut_miscPt(&buf, (miscPoint_t) { i, -i });
+    ASSERT(buf.capacityLog2 == 3);
+    for (int i = 0; i < 5; ++i)
+        ASSERT(circbuf_peek_miscPt(&buf, (size_t) i)->x == i);
+
+    circbuf_destroy_miscPt(&buf);
+    return 0;
+}
+
 #endif
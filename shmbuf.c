@@ -0,0 +1,389 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#define _GNU_SOURCE
+#include "shmbuf.h"
+
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "unittestMacros.h"
+
+#define ROUND_UP(val, align) (((val) + (align) - 1) / (align) * (align))
+
+// private declarations
+// -----------------------------------------------------------------------------
+static int mapFd(shmbuf_t *bufOut, int fd, size_t mapSize);
+// the header comes from another process -- everything that locates records is checked
+static bool isHeaderValid(const shmbuf_header_t *header, size_t fileSize);
+static long futex(_Atomic uint32_t *word, int op, uint32_t val, const struct timespec *timeout);
+static bool getRemaining(const struct timespec *deadline, struct timespec *remainingOut);
+
+// interface functions
+// -----------------------------------------------------------------------------
+int shmbuf_create(shmbuf_t *bufOut, const char *name, unsigned int capacityLog2, size_t recordSize) {
+    assert(recordSize && capacityLog2 < sizeof(size_t) * 8 - 1);
+
+    size_t recordStride = ROUND_UP(recordSize, _Alignof(max_align_t));
+    size_t recordsOffset = ROUND_UP(sizeof(shmbuf_header_t), CIRCBUF_CACHE_LINE_SIZE);
+    size_t mapSize = recordsOffset + (recordStride << capacityLog2);
+
+    int fd = name ? shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600) : memfd_create("shmbuf", 0);
+    if (fd == -1)
+        return -1;
+    if (ftruncate(fd, (off_t) mapSize) || mapFd(bufOut, fd, mapSize)) {
+        int error = errno;
+        close(fd);
+        if (name)
+            shm_unlink(name);
+        errno = error;
+        return -1;
+    }
+
+    shmbuf_header_t *header = bufOut->header;
+    // a lock based fallback wouldn't work across processes
+    assert(atomic_is_lock_free(&header->start) && atomic_is_lock_free(&header->readerWaiting));
+    header->capacityLog2 = capacityLog2;
+    header->rotationMask = ((size_t) 1 << capacityLog2) - 1;
+    header->recordSize = recordSize;
+    header->recordStride = recordStride;
+    header->recordsOffset = recordsOffset;
+    header->mapSize = mapSize;
+    atomic_init(&header->start, 0);
+    atomic_init(&header->end, 0);
+    atomic_init(&header->readerWaiting, 0);
+    header->version = SHMBUF_VERSION;
+    // magic last -- marks the header as complete
+    atomic_thread_fence(memory_order_release);
+    header->magic = SHMBUF_MAGIC;
+
+    bufOut->records = (uint8_t *) header + recordsOffset;
+    return 0;
+}
+
+int shmbuf_open(shmbuf_t *bufOut, const char *name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1)
+        return -1;
+    return shmbuf_openFd(bufOut, fd);
+}
+
+int shmbuf_openFd(shmbuf_t *bufOut, int fd) {
+    struct stat st;
+    if (fstat(fd, &st))
+        goto closeFd;
+    if ((size_t) st.st_size < sizeof(shmbuf_header_t)) {
+        errno = SHMBUF_ERROR_FORMAT;
+        goto closeFd;
+    }
+    if (mapFd(bufOut, fd, (size_t) st.st_size))
+        goto closeFd;
+
+    shmbuf_header_t *header = bufOut->header;
+    if (!isHeaderValid(header, (size_t) st.st_size)) {
+        munmap(header, (size_t) st.st_size);
+        errno = SHMBUF_ERROR_FORMAT;
+        goto closeFd;
+    }
+
+    bufOut->records = (uint8_t *) header + header->recordsOffset;
+    bufOut->cachedStart = atomic_load(&header->start);
+    bufOut->cachedEnd = atomic_load(&header->end);
+    return 0;
+
+closeFd:
+    close(fd);
+    return -1;
+}
+
+void shmbuf_close(shmbuf_t *buf) {
+    if (buf->header)
+        munmap(buf->header, buf->mapSize);
+    if (buf->fd != -1)
+        close(buf->fd);
+    buf->header = NULL;
+    buf->records = NULL;
+    buf->fd = -1;
+}
+
+int shmbuf_unlink(const char *name) {
+    return shm_unlink(name);
+}
+
+void *shmbuf_reserve(shmbuf_t *buf) {
+    shmbuf_header_t *header = buf->header;
+    size_t end = atomic_load_explicit(&header->end, memory_order_relaxed);
+    if (end - buf->cachedStart > header->rotationMask) {
+        buf->cachedStart = atomic_load_explicit(&header->start, memory_order_acquire);
+        if (end - buf->cachedStart > header->rotationMask)
+            return NULL;
+    }
+    return buf->records + (end & header->rotationMask) * header->recordStride;
+}
+
+void shmbuf_commit(shmbuf_t *buf) {
+    shmbuf_header_t *header = buf->header;
+    size_t end = atomic_load_explicit(&header->end, memory_order_relaxed);
+    // seq_cst pairs with the reader announcing itself before rechecking end
+    atomic_store_explicit(&header->end, end + 1, memory_order_seq_cst);
+    if (atomic_load_explicit(&header->readerWaiting, memory_order_seq_cst))
+        futex(&header->readerWaiting, FUTEX_WAKE, 1, NULL);
+}
+
+bool shmbuf_put(shmbuf_t *buf, const void *record) {
+    void *slot = shmbuf_reserve(buf);
+    if (!slot)
+        return false;
+
+    memcpy(slot, record, buf->header->recordSize);
+    shmbuf_commit(buf);
+    return true;
+}
+
+const void *shmbuf_peek(shmbuf_t *buf) {
+    shmbuf_header_t *header = buf->header;
+    size_t start = atomic_load_explicit(&header->start, memory_order_relaxed);
+    if (start == buf->cachedEnd) {
+        buf->cachedEnd = atomic_load_explicit(&header->end, memory_order_acquire);
+        if (start == buf->cachedEnd)
+            return NULL;
+    }
+    return buf->records + (start & header->rotationMask) * header->recordStride;
+}
+
+void shmbuf_release(shmbuf_t *buf) {
+    shmbuf_header_t *header = buf->header;
+    size_t start = atomic_load_explicit(&header->start, memory_order_relaxed);
+    assert(start != buf->cachedEnd);
+    atomic_store_explicit(&header->start, start + 1, memory_order_release);
+}
+
+bool shmbuf_pop(shmbuf_t *buf, void *recordOut) {
+    const void *record = shmbuf_peek(buf);
+    if (!record)
+        return false;
+
+    memcpy(recordOut, record, buf->header->recordSize);
+    shmbuf_release(buf);
+    return true;
+}
+
+int shmbuf_wait(shmbuf_t *buf, int timeoutMs) {
+    shmbuf_header_t *header = buf->header;
+    size_t start = atomic_load_explicit(&header->start, memory_order_relaxed);
+
+    struct timespec deadline;
+    if (timeoutMs >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeoutMs / 1000;
+        deadline.tv_nsec += timeoutMs % 1000 * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    while (true) {
+        if (atomic_load_explicit(&header->end, memory_order_acquire) != start)
+            return 0;
+
+        struct timespec remaining;
+        if (timeoutMs >= 0 && !getRemaining(&deadline, &remaining)) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        atomic_store_explicit(&header->readerWaiting, 1, memory_order_seq_cst);
+        if (atomic_load_explicit(&header->end, memory_order_seq_cst) == start)
+            futex(&header->readerWaiting, FUTEX_WAIT, 1, timeoutMs >= 0 ? &remaining : NULL);
+        atomic_store_explicit(&header->readerWaiting, 0, memory_order_relaxed);
+    }
+}
+
+// private functions
+// -----------------------------------------------------------------------------
+static int mapFd(shmbuf_t *bufOut, int fd, size_t mapSize) {
+    void *p = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        return -1;
+
+    *bufOut = (shmbuf_t) { .header = p, .fd = fd, .mapSize = mapSize };
+    return 0;
+}
+
+static bool isHeaderValid(const shmbuf_header_t *header, size_t fileSize) {
+    if (header->magic != SHMBUF_MAGIC)
+        return false;
+    // pairs with the creator's release fence before it wrote magic
+    atomic_thread_fence(memory_order_acquire);
+    if (header->version != SHMBUF_VERSION || header->mapSize > fileSize)
+        return false;
+
+    unsigned int capacityLog2 = header->capacityLog2;
+    if (capacityLog2 >= sizeof(size_t) * 8 - 1 || header->rotationMask != ((size_t) 1 << capacityLog2) - 1)
+        return false;
+    if (!header->recordSize || header->recordSize > header->recordStride)
+        return false;
+    if (header->recordsOffset < sizeof(shmbuf_header_t) || header->recordsOffset > header->mapSize)
+        return false;
+    // recordStride << capacityLog2 <= room behind recordsOffset, without overflowing
+    return header->recordStride <= (header->mapSize - header->recordsOffset) >> capacityLog2;
+}
+
+// no FUTEX_PRIVATE_FLAG -- the word is shared between processes
+static long futex(_Atomic uint32_t *word, int op, uint32_t val, const struct timespec *timeout) {
+    return syscall(SYS_futex, word, op, val, timeout, NULL, 0);
+}
+
+static bool getRemaining(const struct timespec *deadline, struct timespec *remainingOut) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    remainingOut->tv_sec = deadline->tv_sec - now.tv_sec;
+    remainingOut->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (remainingOut->tv_nsec < 0) {
+        --remainingOut->tv_sec;
+        remainingOut->tv_nsec += 1000000000L;
+    }
+    return remainingOut->tv_sec >= 0;
+}
+
+// unittest
+// -----------------------------------------------------------------------------
+#ifdef UNITTEST
+#include <stdio.h>
+#include <sys/wait.h>
+
+int shmbufCreateInitializesHeader(void) {
+    shmbuf_t buf;
+    ASSERT(!shmbuf_create(&buf, NULL, 4, 12));
+    ASSERT(buf.header->magic == SHMBUF_MAGIC);
+    ASSERT(buf.header->rotationMask == 0xF);
+    ASSERT(buf.header->recordStride >= 12);
+    ASSERT(buf.records == (uint8_t *) buf.header + buf.header->recordsOffset);
+    ASSERT(!shmbuf_peek(&buf));
+
+    shmbuf_close(&buf);
+    return 0;
+}
+
+int shmbufPutFailsWhenFull(void) {
+    shmbuf_t buf;
+    ASSERT(!shmbuf_create(&buf, NULL, 2, sizeof(int)));
+    for (int i = 0; i < 4; ++i)
+        ASSERT(shmbuf_put(&buf, &i));
+    int foo = 42;
+    ASSERT(!shmbuf_put(&buf, &foo));
+
+    for (int i = 0; i < 4; ++i) {
+        ASSERT(shmbuf_pop(&buf, &foo));
+        ASSERT(foo == i);
+    }
+    ASSERT(!shmbuf_pop(&buf, &foo));
+
+    shmbuf_close(&buf);
+    return 0;
+}
+
+int shmbufSecondMappingSeesRecords(void) {
+    char name[64];
+    snprintf(name, sizeof(name), "/utilcShmbufTest%d", (int) getpid());
+    shmbuf_t writer, reader;
+    ASSERT(!shmbuf_create(&writer, name, 3, sizeof(double)));
+    ASSERT(!shmbuf_open(&reader, name));
+    ASSERT(!shmbuf_unlink(name));
+    ASSERT(reader.header != writer.header);
+
+    double pi = 3.14159;
+    *(double *) shmbuf_reserve(&writer) = pi;
+    shmbuf_commit(&writer);
+    const double *p = shmbuf_peek(&reader);
+    ASSERT(p && *p == pi);
+    shmbuf_release(&reader);
+    ASSERT(!shmbuf_peek(&reader));
+
+    shmbuf_close(&reader);
+    shmbuf_close(&writer);
+    return 0;
+}
+
+int shmbufOpenRejectsForeignFile(void) {
+    int fd = memfd_create("foreign", 0);
+    ASSERT(fd != -1);
+    ASSERT(!ftruncate(fd, 4096));
+    shmbuf_t buf;
+    ASSERT(shmbuf_openFd(&buf, fd));
+    ASSERT(errno == SHMBUF_ERROR_FORMAT);
+    return 0;
+}
+
+int shmbufOpenRejectsInconsistentHeader(void) {
+    for (int field = 0; field < 5; ++field) {
+        shmbuf_t creator;
+        ASSERT(!shmbuf_create(&creator, NULL, 4, 12));
+        shmbuf_header_t *header = creator.header;
+        switch (field) {
+        case 0: header->rotationMask = 0x1F; break;
+        case 1: header->capacityLog2 = 5; break;
+        case 2: header->recordSize = header->recordStride + 1; break;
+        case 3: header->recordsOffset = 0; break;
+        default: header->recordStride *= 2; break;
+        }
+
+        shmbuf_t buf;
+        ASSERT(shmbuf_openFd(&buf, dup(creator.fd)));
+        ASSERT(errno == SHMBUF_ERROR_FORMAT);
+        shmbuf_close(&creator);
+    }
+    return 0;
+}
+
+int shmbufWaitTimesOut(void) {
+    shmbuf_t buf;
+    ASSERT(!shmbuf_create(&buf, NULL, 2, 1));
+    ASSERT(shmbuf_wait(&buf, 10));
+    ASSERT(errno == ETIMEDOUT);
+    ASSERT(!atomic_load(&buf.header->readerWaiting));
+
+    shmbuf_close(&buf);
+    return 0;
+}
+
+#define SHMBUF_TEST_RECORD_COUNT 10000
+
+int shmbufTwoProcessesExchangeRecords(void) {
+    shmbuf_t buf;
+    ASSERT(!shmbuf_create(&buf, NULL, 4, sizeof(uint64_t)));
+
+    pid_t pid = fork();
+    ASSERT(pid != -1);
+    if (!pid) {
+        for (uint64_t i = 1; i <= SHMBUF_TEST_RECORD_COUNT; ++i)
+            while (!shmbuf_put(&buf, &i))
+                ;
+        _exit(0);
+    }
+
+    for (size_t i = 0; i < SHMBUF_TEST_RECORD_COUNT; ++i) {
+        uint64_t record;
+        ASSERT(!shmbuf_wait(&buf, 5000));
+        ASSERT(shmbuf_pop(&buf, &record));
+        ASSERT(record == i + 1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    ASSERT(WIFEXITED(status) && !WEXITSTATUS(status));
+
+    shmbuf_close(&buf);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "circbufSpsc.h"
+
+/* Single producer / single consumer ring living in shared memory (shm_open or memfd),
+   so two processes can exchange records without syscalls or kernel copies. Records
+   are fixed size and stored inline. The shared header only holds indices and offsets
+   -- every process may map it at a different address. An idle reader can sleep on a
+   futex in the header; the writer only issues the wake syscall if somebody sleeps. */
+
+//  functions return -1 on error; errno can be checked for specific value
+#define SHMBUF_ERROR_FORMAT 310
+
+#define SHMBUF_MAGIC 0x53484d42 // "SHMB"
+#define SHMBUF_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    unsigned int capacityLog2;
+    size_t rotationMask;
+    size_t recordSize;
+    size_t recordStride;
+    size_t recordsOffset; // from start of the mapping
+    size_t mapSize;
+
+    _Alignas(CIRCBUF_CACHE_LINE_SIZE) atomic_size_t start;
+    _Alignas(CIRCBUF_CACHE_LINE_SIZE) atomic_size_t end;
+    _Alignas(CIRCBUF_CACHE_LINE_SIZE) _Atomic uint32_t readerWaiting; // futex word
+} shmbuf_header_t;
+
+// process local handle
+typedef struct {
+    shmbuf_header_t *header;
+    uint8_t *records;
+    int fd;
+    size_t mapSize;
+    size_t cachedStart; // producer
+    size_t cachedEnd; // consumer
+} shmbuf_t;
+
+// name NULL creates an anonymous memfd -- share it through fork() or fd passing
+int shmbuf_create(shmbuf_t *bufOut, const char *name, unsigned int capacityLog2, size_t recordSize);
+int shmbuf_open(shmbuf_t *bufOut, const char *name);
+// takes ownership of fd
+int shmbuf_openFd(shmbuf_t *bufOut, int fd);
+void shmbuf_close(shmbuf_t *buf);
+int shmbuf_unlink(const char *name);
+
+// producer: reserve returns NULL if full; write the record in place, then commit
+void *shmbuf_reserve(shmbuf_t *buf);
+void shmbuf_commit(shmbuf_t *buf);
+bool shmbuf_put(shmbuf_t *buf, const void *record);
+
+// consumer: peek returns NULL if empty; release frees the peeked record
+const void *shmbuf_peek(shmbuf_t *buf);
+void shmbuf_release(shmbuf_t *buf);
+bool shmbuf_pop(shmbuf_t *buf, void *recordOut);
+// blocks until a record is available; timeoutMs < 0 waits forever; fails with ETIMEDOUT
+int shmbuf_wait(shmbuf_t *buf, int timeoutMs);
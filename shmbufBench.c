@@ -0,0 +1,107 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+// usage: shmbufBench [recordCount] [pingCount]
+// forks a second process; measures one way throughput and round trip latency
+#define _GNU_SOURCE
+#include "shmbuf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define CAPACITY_LOG2 12
+
+typedef struct {
+    uint64_t seq;
+    uint64_t payload[7];
+} record_t;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static void receive(shmbuf_t *buf, record_t *record) {
+    while (!shmbuf_pop(buf, record))
+        shmbuf_wait(buf, -1);
+}
+
+static void send(shmbuf_t *buf, const record_t *record) {
+    while (!shmbuf_put(buf, record))
+        ;
+}
+
+static double throughput(size_t recordCount) {
+    shmbuf_t buf;
+    if (shmbuf_create(&buf, NULL, CAPACITY_LOG2, sizeof(record_t))) {
+        perror("shmbuf_create");
+        exit(1);
+    }
+
+    pid_t pid = fork();
+    if (!pid) {
+        record_t record = { 0 };
+        for (size_t i = 0; i < recordCount; ++i) {
+            record.seq = i;
+            send(&buf, &record);
+        }
+        _exit(0);
+    }
+
+    double t0 = now();
+    record_t record;
+    for (size_t i = 0; i < recordCount; ++i)
+        receive(&buf, &record);
+    double elapsed = now() - t0;
+
+    waitpid(pid, NULL, 0);
+    shmbuf_close(&buf);
+    return (double) recordCount / elapsed;
+}
+
+static double roundTrip(size_t pingCount) {
+    shmbuf_t ping, pong;
+    if (shmbuf_create(&ping, NULL, CAPACITY_LOG2, sizeof(record_t))
+            || shmbuf_create(&pong, NULL, CAPACITY_LOG2, sizeof(record_t))) {
+        perror("shmbuf_create");
+        exit(1);
+    }
+
+    pid_t pid = fork();
+    record_t record = { 0 };
+    if (!pid) {
+        for (size_t i = 0; i < pingCount; ++i) {
+            receive(&ping, &record);
+            send(&pong, &record);
+        }
+        _exit(0);
+    }
+
+    double t0 = now();
+    for (size_t i = 0; i < pingCount; ++i) {
+        record.seq = i;
+        send(&ping, &record);
+        receive(&pong, &record);
+    }
+    double elapsed = now() - t0;
+
+    waitpid(pid, NULL, 0);
+    shmbuf_close(&pong);
+    shmbuf_close(&ping);
+    return elapsed / (double) pingCount;
+}
+
+int main(int argc, char **argv) {
+    size_t recordCount = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+    size_t pingCount = argc > 2 ? strtoul(argv[2], NULL, 10) : 100000;
+
+    printf("throughput: %.3g M records/s (%zu byte records)\n",
+            throughput(recordCount) * 1e-6, sizeof(record_t));
+    printf("round trip: %.3g us\n", roundTrip(pingCount) * 1e6);
+    return 0;
+}
@@ -0,0 +1,317 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#define _POSIX_C_SOURCE 200809L
+#include "taskpool.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <sched.h>
+
+#include "unittestMacros.h"
+
+#define DEQUE_INITIAL_CAPACITY_LOG2 6
+
+typedef struct {
+    taskpool_t *pool;
+    size_t begin;
+    size_t end;
+    size_t grain;
+    taskpool_rangeFn_t fn;
+    void *arg;
+} range_t;
+
+static _Thread_local taskpool_worker_t *currentWorker;
+
+// private declarations
+// -----------------------------------------------------------------------------
+static void *workerMain(void *arg);
+static bool findWork(taskpool_worker_t *worker, taskpool_task_t **taskOut);
+static void execute(taskpool_task_t *task);
+static void runRange(void *arg);
+static uint32_t nextRand(uint32_t *state);
+// joins workers 1 .. threadCount - 1
+static void stopWorkers(taskpool_t *pool, size_t threadCount);
+static void freeWorkers(taskpool_t *pool);
+
+// interface functions
+// -----------------------------------------------------------------------------
+int taskpool_init(taskpool_t *pool, size_t workerCount) {
+    if (!workerCount) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pool->workers = calloc(workerCount, sizeof(taskpool_worker_t));
+    if (!pool->workers)
+        return -1;
+    pool->workerCount = workerCount;
+    atomic_init(&pool->isRunning, false);
+    atomic_init(&pool->isShutdown, false);
+    pthread_mutex_init(&pool->idleMutex, NULL);
+    pthread_cond_init(&pool->idleCond, NULL);
+
+    for (size_t i = 0; i < workerCount; ++i) {
+        taskpool_worker_t *worker = pool->workers + i;
+        wsdeque_init(&worker->deque, DEQUE_INITIAL_CAPACITY_LOG2);
+        worker->pool = pool;
+        worker->index = i;
+        worker->randState = (uint32_t) i * 2654435761u + 1;
+    }
+
+    // worker 0 is the thread calling taskpool_run()
+    for (size_t i = 1; i < workerCount; ++i) {
+        int error = pthread_create(&pool->workers[i].thread, NULL, workerMain, pool->workers + i);
+        if (error) {
+            // all deques exist already, only the threads stop at i
+            stopWorkers(pool, i);
+            freeWorkers(pool);
+            errno = error;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void taskpool_run(taskpool_t *pool, taskpool_fn_t fn, void *arg) {
+    pthread_mutex_lock(&pool->idleMutex);
+    atomic_store(&pool->isRunning, true);
+    pthread_cond_broadcast(&pool->idleCond);
+    pthread_mutex_unlock(&pool->idleMutex);
+
+    taskpool_worker_t *previousWorker = currentWorker;
+    currentWorker = pool->workers;
+    fn(arg);
+    currentWorker = previousWorker;
+
+    atomic_store(&pool->isRunning, false);
+}
+
+void taskpool_spawn(taskpool_t *pool, taskpool_task_t *task, taskpool_fn_t fn, void *arg) {
+    assert(currentWorker && currentWorker->pool == pool);
+    (void) pool;
+
+    task->fn = fn;
+    task->arg = arg;
+    atomic_init(&task->isDone, false);
+    wsdeque_push(&currentWorker->deque, task);
+}
+
+void taskpool_join(taskpool_t *pool, taskpool_task_t *task) {
+    assert(currentWorker && currentWorker->pool == pool);
+    (void) pool;
+
+    // help out instead of blocking -- most of the time the popped task is the joined one
+    while (!atomic_load_explicit(&task->isDone, memory_order_acquire)) {
+        taskpool_task_t *other;
+        if (findWork(currentWorker, &other))
+            execute(other);
+        else
+            sched_yield();
+    }
+}
+
+void taskpool_parallelFor(taskpool_t *pool, size_t begin, size_t end, size_t grain,
+        taskpool_rangeFn_t fn, void *arg) {
+    range_t range = { .pool = pool, .begin = begin, .end = end, .grain = grain ? grain : 1,
+        .fn = fn, .arg = arg };
+
+    bool isInsideTask = currentWorker && currentWorker->pool == pool;
+    if (isInsideTask)
+        runRange(&range);
+    else
+        taskpool_run(pool, runRange, &range);
+}
+
+void taskpool_destroy(taskpool_t *pool) {
+    stopWorkers(pool, pool->workerCount);
+    freeWorkers(pool);
+}
+
+// private functions
+// -----------------------------------------------------------------------------
+static void *workerMain(void *arg) {
+    taskpool_worker_t *worker = arg;
+    taskpool_t *pool = worker->pool;
+    currentWorker = worker;
+
+    while (!atomic_load_explicit(&pool->isShutdown, memory_order_relaxed)) {
+        taskpool_task_t *task;
+        if (findWork(worker, &task)) {
+            execute(task);
+            continue;
+        }
+
+        if (atomic_load_explicit(&pool->isRunning, memory_order_relaxed)) {
+            sched_yield();
+            continue;
+        }
+
+        // park until the next taskpool_run
+        pthread_mutex_lock(&pool->idleMutex);
+        while (!atomic_load(&pool->isRunning) && !atomic_load(&pool->isShutdown))
+            pthread_cond_wait(&pool->idleCond, &pool->idleMutex);
+        pthread_mutex_unlock(&pool->idleMutex);
+    }
+    return NULL;
+}
+
+static bool findWork(taskpool_worker_t *worker, taskpool_task_t **taskOut) {
+    void *elem;
+    if (wsdeque_pop(&worker->deque, &elem)) {
+        *taskOut = elem;
+        return true;
+    }
+
+    taskpool_t *pool = worker->pool;
+    size_t victim = nextRand(&worker->randState) % pool->workerCount;
+    for (size_t i = 0; i < pool->workerCount; ++i, victim = (victim + 1) % pool->workerCount) {
+        if (victim == worker->index)
+            continue;
+        if (wsdeque_steal(&pool->workers[victim].deque, &elem)) {
+            *taskOut = elem;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void execute(taskpool_task_t *task) {
+    task->fn(task->arg);
+    atomic_store_explicit(&task->isDone, true, memory_order_release);
+}
+
+static void runRange(void *arg) {
+    range_t *range = arg;
+    size_t count = range->end - range->begin;
+    if (count <= range->grain) {
+        if (count)
+            range->fn(range->begin, range->end, range->arg);
+        return;
+    }
+
+    size_t middle = range->begin + count / 2;
+    range_t upper = *range;
+    upper.begin = middle;
+    range_t lower = *range;
+    lower.end = middle;
+
+    taskpool_task_t upperTask;
+    taskpool_spawn(range->pool, &upperTask, runRange, &upper);
+    runRange(&lower);
+    taskpool_join(range->pool, &upperTask);
+}
+
+static uint32_t nextRand(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static void stopWorkers(taskpool_t *pool, size_t threadCount) {
+    pthread_mutex_lock(&pool->idleMutex);
+    atomic_store(&pool->isShutdown, true);
+    pthread_cond_broadcast(&pool->idleCond);
+    pthread_mutex_unlock(&pool->idleMutex);
+
+    for (size_t i = 1; i < threadCount; ++i)
+        pthread_join(pool->workers[i].thread, NULL);
+}
+
+static void freeWorkers(taskpool_t *pool) {
+    for (size_t i = 0; i < pool->workerCount; ++i)
+        wsdeque_destroy(&pool->workers[i].deque);
+
+    pthread_cond_destroy(&pool->idleCond);
+    pthread_mutex_destroy(&pool->idleMutex);
+    free(pool->workers);
+    pool->workers = NULL;
+}
+
+// unittest
+// -----------------------------------------------------------------------------
+#ifdef UNITTEST
+typedef struct {
+    taskpool_t *pool;
+    unsigned int n;
+    uint64_t result;
+} taskpoolTestFib_t;
+
+static void taskpoolTestFib(void *arg) {
+    taskpoolTestFib_t *fib = arg;
+    if (fib->n < 2) {
+        fib->result = fib->n;
+        return;
+    }
+
+    taskpoolTestFib_t a = { .pool = fib->pool, .n = fib->n - 1 };
+    taskpoolTestFib_t b = { .pool = fib->pool, .n = fib->n - 2 };
+    taskpool_task_t task;
+    taskpool_spawn(fib->pool, &task, taskpoolTestFib, &a);
+    taskpoolTestFib(&b);
+    taskpool_join(fib->pool, &task);
+    fib->result = a.result + b.result;
+}
+
+int taskpoolInitWithZeroWorkersFails(void) {
+    taskpool_t pool;
+    ASSERT(taskpool_init(&pool, 0));
+    ASSERT(errno == EINVAL);
+    return 0;
+}
+
+int taskpoolRunWithSingleWorker(void) {
+    taskpool_t pool;
+    ASSERT(!taskpool_init(&pool, 1));
+    taskpoolTestFib_t fib = { .pool = &pool, .n = 15 };
+    taskpool_run(&pool, taskpoolTestFib, &fib);
+    ASSERT(fib.result == 610);
+
+    taskpool_destroy(&pool);
+    return 0;
+}
+
+int taskpoolForkJoinWithMultipleWorkers(void) {
+    taskpool_t pool;
+    ASSERT(!taskpool_init(&pool, 4));
+    taskpoolTestFib_t fib = { .pool = &pool, .n = 20 };
+    taskpool_run(&pool, taskpoolTestFib, &fib);
+    ASSERT(fib.result == 6765);
+
+    // pool is reusable
+    fib.n = 10;
+    taskpool_run(&pool, taskpoolTestFib, &fib);
+    ASSERT(fib.result == 55);
+
+    taskpool_destroy(&pool);
+    return 0;
+}
+
+static void taskpoolTestMarkRange(size_t begin, size_t end, void *arg) {
+    atomic_uchar *marks = arg;
+    for (size_t i = begin; i < end; ++i)
+        atomic_fetch_add(marks + i, 1);
+}
+
+int taskpoolParallelForVisitsEveryIndexOnce(void) {
+    taskpool_t pool;
+    ASSERT(!taskpool_init(&pool, 3));
+    enum { count = 1000 };
+    static atomic_uchar marks[count];
+    for (size_t i = 0; i < count; ++i)
+        atomic_init(marks + i, 0);
+
+    taskpool_parallelFor(&pool, 0, count, 7, taskpoolTestMarkRange, marks);
+    for (size_t i = 0; i < count; ++i)
+        ASSERT(atomic_load(marks + i) == 1);
+
+    taskpool_destroy(&pool);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "wsdeque.h"
+
+/* Fork-join scheduler on top of wsdeque_t. Every worker owns a deque; idle workers
+   steal from random victims. The thread calling taskpool_run() acts as worker 0 until
+   the root task returns -- only one thread may call it at a time.
+
+   Tasks are caller owned (e.g. on the stack of the spawning task) and have to be
+   joined before they go out of scope:
+
+    taskpool_task_t child;
+    taskpool_spawn(pool, &child, fn, arg);
+    ... // do other work
+    taskpool_join(pool, &child); // runs other tasks while waiting */
+
+//  functions return -1 on error; errno can be checked for specific value
+
+typedef void (*taskpool_fn_t)(void *arg);
+// processes indices [begin, end)
+typedef void (*taskpool_rangeFn_t)(size_t begin, size_t end, void *arg);
+
+typedef struct {
+    taskpool_fn_t fn;
+    void *arg;
+    atomic_bool isDone;
+} taskpool_task_t;
+
+struct taskpool_t;
+
+typedef struct {
+    wsdeque_t deque;
+    struct taskpool_t *pool;
+    size_t index;
+    uint32_t randState;
+    pthread_t thread;
+} taskpool_worker_t;
+
+typedef struct taskpool_t {
+    taskpool_worker_t *workers;
+    size_t workerCount;
+    atomic_bool isRunning;
+    atomic_bool isShutdown;
+    pthread_mutex_t idleMutex;
+    pthread_cond_t idleCond;
+} taskpool_t;
+
+// workerCount includes the thread calling taskpool_run()
+int taskpool_init(taskpool_t *pool, size_t workerCount);
+// runs fn on the calling thread with the pool at its disposal; returns after fn returned
+void taskpool_run(taskpool_t *pool, taskpool_fn_t fn, void *arg);
+
+// only from within a task of this pool
+void taskpool_spawn(taskpool_t *pool, taskpool_task_t *task, taskpool_fn_t fn, void *arg);
+void taskpool_join(taskpool_t *pool, taskpool_task_t *task);
+
+// splits [begin, end) in halves until a range is at most grain long; may be called from
+// within a task or from outside (then it's wrapped in taskpool_run)
+void taskpool_parallelFor(taskpool_t *pool, size_t begin, size_t end, size_t grain,
+        taskpool_rangeFn_t fn, void *arg);
+
+void taskpool_destroy(taskpool_t *pool);
@@ -0,0 +1,94 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+// usage: taskpoolBench [maxWorkerCount] [fibN]
+#include "taskpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define SEQUENTIAL_CUTOFF 12
+#define FOR_COUNT_LOG2 22
+#define FOR_GRAIN_LOG2 10
+
+typedef struct {
+    taskpool_t *pool;
+    unsigned int n;
+    uint64_t result;
+} fib_t;
+
+static double now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static uint64_t fibSequential(unsigned int n) {
+    return n < 2 ? n : fibSequential(n - 1) + fibSequential(n - 2);
+}
+
+static void fib(void *arg) {
+    fib_t *f = arg;
+    if (f->n < SEQUENTIAL_CUTOFF) {
+        f->result = fibSequential(f->n);
+        return;
+    }
+
+    fib_t a = { .pool = f->pool, .n = f->n - 1 };
+    fib_t b = { .pool = f->pool, .n = f->n - 2 };
+    taskpool_task_t task;
+    taskpool_spawn(f->pool, &task, fib, &a);
+    fib(&b);
+    taskpool_join(f->pool, &task);
+    f->result = a.result + b.result;
+}
+
+// every grain sized range has its own accumulator - workers never write the same one
+static void xorSum(size_t begin, size_t end, void *arg) {
+    double sum = 0;
+    for (size_t i = begin; i < end; ++i)
+        for (size_t j = 0; j < 64; ++j)
+            sum += (double) (i ^ j) * 0.5;
+    ((double *) arg)[begin >> FOR_GRAIN_LOG2] = sum;
+}
+
+int main(int argc, char **argv) {
+    size_t maxWorkerCount = argc > 1 ? strtoul(argv[1], NULL, 10) : 8;
+    unsigned int fibN = argc > 2 ? (unsigned int) strtoul(argv[2], NULL, 10) : 36;
+
+    printf("workers  fib(%u) s  speedup  parallelFor s  speedup\n", fibN);
+    double fibBase = 0, forBase = 0;
+    for (size_t n = 1; n <= maxWorkerCount; ++n) {
+        taskpool_t pool;
+        if (taskpool_init(&pool, n)) {
+            perror("taskpool_init");
+            return 1;
+        }
+
+        fib_t f = { .pool = &pool, .n = fibN };
+        double t0 = now();
+        taskpool_run(&pool, fib, &f);
+        double fibTime = now() - t0;
+
+        static double sums[1 << (FOR_COUNT_LOG2 - FOR_GRAIN_LOG2)];
+        t0 = now();
+        taskpool_parallelFor(&pool, 0, (size_t) 1 << FOR_COUNT_LOG2, (size_t) 1 << FOR_GRAIN_LOG2,
+                xorSum, sums);
+        double forTime = now() - t0;
+        volatile double sink = 0;
+        for (size_t i = 0; i < sizeof(sums) / sizeof(*sums); ++i)
+            sink += sums[i];
+
+        if (n == 1) {
+            fibBase = fibTime;
+            forBase = forTime;
+        }
+        printf("%7zu  %9.3f  %7.2f  %13.3f  %7.2f\n", n, fibTime, fibBase / fibTime,
+                forTime, forBase / forTime);
+        taskpool_destroy(&pool);
+    }
+
+    return 0;
+}
@@ -0,0 +1,302 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#include "timerwheel.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "bitops.h"
+#include "unittestMacros.h"
+
+#define DUE_BUCKET   (TIMERWHEEL_BUCKET_COUNT - 1)
+#define INITIAL_BUCKET_CAPACITY_LOG2 2
+
+// private declarations
+// -----------------------------------------------------------------------------
+// bucket by the highest digit in which deadline differs from the wheel's time
+static size_t getBucket(const timerwheel_t *wheel, uint64_t deadline);
+static void putTimer(timerwheel_t *wheel, timerwheel_timer_t *timer, size_t bucket);
+static void removeTimer(timerwheel_t *wheel, timerwheel_timer_t *timer);
+static int findLowestOccupiedLevel(timerwheel_t *wheel);
+// start of a slot given the wheel's time -- the digits above the level are shared
+static uint64_t getSlotStart(uint64_t now, unsigned int level, size_t slot);
+// moves everything due up to now into the due bucket
+static void advance(timerwheel_t *wheel, uint64_t now);
+
+// interface functions
+// -----------------------------------------------------------------------------
+int timerwheel_init(timerwheel_t *wheel, uint64_t now) {
+    // zeroed buckets get their array on first use
+    circbuf_t *buckets = calloc(TIMERWHEEL_BUCKET_COUNT, sizeof(circbuf_t));
+    if (!buckets) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    *wheel = (timerwheel_t) { .now = now, .buckets = buckets };
+    for (unsigned int i = 0; i < TIMERWHEEL_LEVEL_COUNT; ++i) {
+        wheel->occupied[i] = idxpyr_make(TIMERWHEEL_LEVEL_BITS, false);
+        if (!wheel->occupied[i].rows[0]) {
+            while (i--)
+                idxpyr_destroy(wheel->occupied + i);
+            free(buckets);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void timerwheel_schedule(timerwheel_t *wheel, timerwheel_timer_t *timer, uint64_t deadline) {
+    if (timer->bucket)
+        removeTimer(wheel, timer);
+    else
+        ++wheel->length;
+
+    timer->deadline = deadline;
+    putTimer(wheel, timer, getBucket(wheel, deadline));
+}
+
+void timerwheel_cancel(timerwheel_t *wheel, timerwheel_timer_t *timer) {
+    if (!timer->bucket)
+        return;
+
+    removeTimer(wheel, timer);
+    --wheel->length;
+}
+
+bool timerwheel_isScheduled(const timerwheel_timer_t *timer) {
+    return timer->bucket;
+}
+
+timerwheel_timer_t *timerwheel_poll(timerwheel_t *wheel, uint64_t now) {
+    circbuf_t *due = wheel->buckets + DUE_BUCKET;
+    if (!due->length)
+        advance(wheel, now);
+    if (!due->length)
+        return NULL;
+
+    timerwheel_timer_t *timer = circbuf_popBack(due);
+    timer->bucket = 0;
+    --wheel->length;
+    return timer;
+}
+
+uint64_t timerwheel_nextDeadline(timerwheel_t *wheel) {
+    if (wheel->buckets[DUE_BUCKET].length)
+        return wheel->now;
+
+    int level = findLowestOccupiedLevel(wheel);
+    if (level < 0)
+        return UINT64_MAX;
+    size_t slot = idxpyr_getFirst(wheel->occupied + level);
+    return getSlotStart(wheel->now, (unsigned int) level, slot);
+}
+
+void timerwheel_destroy(timerwheel_t *wheel) {
+    for (size_t i = 0; i < TIMERWHEEL_BUCKET_COUNT; ++i)
+        free(wheel->buckets[i].a);
+    free(wheel->buckets);
+    for (unsigned int i = 0; i < TIMERWHEEL_LEVEL_COUNT; ++i)
+        idxpyr_destroy(wheel->occupied + i);
+    wheel->buckets = NULL;
+    wheel->length = 0;
+}
+
+// private functions
+// -----------------------------------------------------------------------------
+static size_t getBucket(const timerwheel_t *wheel, uint64_t deadline) {
+    if (deadline <= wheel->now)
+        return DUE_BUCKET;
+
+    unsigned int level = (unsigned int) bitops_findLastSet(deadline ^ wheel->now) / TIMERWHEEL_LEVEL_BITS;
+    size_t slot = deadline >> (level * TIMERWHEEL_LEVEL_BITS) & (TIMERWHEEL_SLOT_COUNT - 1);
+    return level * TIMERWHEEL_SLOT_COUNT + slot;
+}
+
+static void putTimer(timerwheel_t *wheel, timerwheel_timer_t *timer, size_t bucket) {
+    circbuf_t *buf = wheel->buckets + bucket;
+    if (!buf->a)
+        *buf = circbuf_make(INITIAL_BUCKET_CAPACITY_LOG2);
+    if (!buf->length && bucket != DUE_BUCKET)
+        idxpyr_set(wheel->occupied + bucket / TIMERWHEEL_SLOT_COUNT, bucket % TIMERWHEEL_SLOT_COUNT, true);
+
+    unsigned int capacityLog2 = buf->capacityLog2;
+    circbuf_dynamicPut(buf, timer);
+    timer->bucket = bucket + 1;
+    timer->position = CIRCBUF_FRONT_INDEX(*buf);
+    // resize packs the elements to the start of a new array
+    if (buf->capacityLog2 != capacityLog2) {
+        for (size_t i = 0; i < buf->length; ++i)
+            ((timerwheel_timer_t *) buf->a[i])->position = i;
+    }
+}
+
+static void removeTimer(timerwheel_t *wheel, timerwheel_timer_t *timer) {
+    size_t bucket = timer->bucket - 1;
+    circbuf_t *buf = wheel->buckets + bucket;
+    // the newest timer fills the hole
+    timerwheel_timer_t *newest = buf->a[CIRCBUF_FRONT_INDEX(*buf)];
+    buf->a[timer->position] = newest;
+    newest->position = timer->position;
+    --buf->length;
+    timer->bucket = 0;
+
+    if (!buf->length && bucket != DUE_BUCKET)
+        idxpyr_set(wheel->occupied + bucket / TIMERWHEEL_SLOT_COUNT, bucket % TIMERWHEEL_SLOT_COUNT, false);
+}
+
+static int findLowestOccupiedLevel(timerwheel_t *wheel) {
+    for (int i = 0; i < TIMERWHEEL_LEVEL_COUNT; ++i) {
+        idxpyr_t *occupied = wheel->occupied + i;
+        if (*occupied->rows[occupied->height - 1])
+            return i;
+    }
+    return -1;
+}
+
+static uint64_t getSlotStart(uint64_t now, unsigned int level, size_t slot) {
+    unsigned int shift = level * TIMERWHEEL_LEVEL_BITS;
+    unsigned int aboveShift = shift + TIMERWHEEL_LEVEL_BITS;
+    uint64_t above = aboveShift < 64 ? now >> aboveShift << aboveShift : 0;
+    return above | (uint64_t) slot << shift;
+}
+
+static void advance(timerwheel_t *wheel, uint64_t now) {
+    /* The lowest occupied level holds the earliest slot: every timer of a level shares
+       the digits above it with the wheel's time, and lower levels share that level's
+       digit too. So jump to that slot, hand out or cascade its timers, repeat. */
+    while (true) {
+        int level = findLowestOccupiedLevel(wheel);
+        if (level < 0)
+            break;
+        size_t slot = idxpyr_getFirst(wheel->occupied + level);
+        uint64_t slotStart = getSlotStart(wheel->now, (unsigned int) level, slot);
+        if (slotStart > now)
+            break;
+
+        wheel->now = slotStart;
+        circbuf_t *buf = wheel->buckets + (size_t) level * TIMERWHEEL_SLOT_COUNT + slot;
+        idxpyr_set(wheel->occupied + level, slot, false);
+        while (buf->length) {
+            timerwheel_timer_t *timer = circbuf_popBack(buf);
+            putTimer(wheel, timer, getBucket(wheel, timer->deadline));
+        }
+    }
+    // slots still occupied start after now, so their digits stay above now's
+    if (now > wheel->now)
+        wheel->now = now;
+}
+
+// unittest
+// -----------------------------------------------------------------------------
+#ifdef UNITTEST
+
+int timerwheelFiresInDeadlineOrderOfSlots(void) {
+    timerwheel_t wheel;
+    ASSERT(!timerwheel_init(&wheel, 1000));
+    ASSERT(timerwheel_nextDeadline(&wheel) == UINT64_MAX);
+    timerwheel_timer_t timers[4] = { { 0 } };
+    const uint64_t deadlines[] = { 1005, 1000 + 5000, 1000 + 70, 999 };
+    for (size_t i = 0; i < 4; ++i)
+        timerwheel_schedule(&wheel, timers + i, deadlines[i]);
+    ASSERT(wheel.length == 4);
+
+    // already due
+    ASSERT(timerwheel_nextDeadline(&wheel) == 1000);
+    ASSERT(timerwheel_poll(&wheel, 1000) == timers + 3);
+    ASSERT(!timerwheel_poll(&wheel, 1004));
+    ASSERT(timerwheel_nextDeadline(&wheel) == 1005);
+    ASSERT(timerwheel_poll(&wheel, 1005) == timers + 0);
+    ASSERT(!timerwheel_isScheduled(timers + 0));
+    ASSERT(!timerwheel_poll(&wheel, 1069));
+    ASSERT(timerwheel_poll(&wheel, 1070) == timers + 2);
+    // cascaded down a level on the way, but not early
+    ASSERT(!timerwheel_poll(&wheel, 5999));
+    ASSERT(timerwheel_poll(&wheel, 6000) == timers + 1);
+    ASSERT(!wheel.length);
+
+    timerwheel_destroy(&wheel);
+    return 0;
+}
+
+int timerwheelCancelAndReschedule(void) {
+    timerwheel_t wheel;
+    ASSERT(!timerwheel_init(&wheel, 0));
+    timerwheel_timer_t timers[20] = { { 0 } };
+    // all in one bucket, so cancel has to patch positions -- and the bucket grows
+    for (size_t i = 0; i < 20; ++i)
+        timerwheel_schedule(&wheel, timers + i, 10);
+    for (size_t i = 0; i < 20; i += 2)
+        timerwheel_cancel(&wheel, timers + i);
+    timerwheel_cancel(&wheel, timers + 0);
+    ASSERT(wheel.length == 10);
+
+    timerwheel_schedule(&wheel, timers + 1, 3);
+    ASSERT(timerwheel_poll(&wheel, 5) == timers + 1);
+    for (size_t i = 3; i < 20; i += 2)
+        timerwheel_cancel(&wheel, timers + i);
+    ASSERT(!wheel.length);
+    ASSERT(!timerwheel_poll(&wheel, 100));
+    ASSERT(timerwheel_nextDeadline(&wheel) == UINT64_MAX);
+
+    timerwheel_destroy(&wheel);
+    return 0;
+}
+
+int timerwheelMatchesLinearScan(void) {
+    timerwheel_t wheel;
+    const uint64_t start = ((uint64_t) 1 << 40) - 12345;
+    ASSERT(!timerwheel_init(&wheel, start));
+    timerwheel_timer_t timers[200] = { { 0 } };
+    uint64_t now = start;
+    uint64_t x = 88172645463325252u;
+    for (int step = 0; step < 20000; ++step) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        timerwheel_timer_t *timer = timers + x % 200;
+        // deadlines from a few ticks up to 2^36 ticks ahead
+        uint64_t delta = (x >> 8) & (((uint64_t) 1 << (x >> 58 & 31) << 5) - 1);
+        switch (x >> 56 & 3) {
+        case 0:
+        case 1:
+            timerwheel_schedule(&wheel, timer, now + delta);
+            break;
+        case 2:
+            timerwheel_cancel(&wheel, timer);
+            break;
+        default: {
+            now += delta >> (x >> 52 & 15);
+            // the next deadline is a lower bound of all scheduled ones
+            uint64_t minDeadline = UINT64_MAX;
+            for (size_t i = 0; i < 200; ++i) {
+                if (timerwheel_isScheduled(timers + i) && timers[i].deadline < minDeadline)
+                    minDeadline = timers[i].deadline;
+            }
+            ASSERT(timerwheel_nextDeadline(&wheel) <= minDeadline || minDeadline <= wheel.now);
+
+            size_t dueCount = 0;
+            for (size_t i = 0; i < 200; ++i)
+                dueCount += timerwheel_isScheduled(timers + i) && timers[i].deadline <= now;
+            timerwheel_timer_t *due;
+            while ((due = timerwheel_poll(&wheel, now))) {
+                ASSERT(due->deadline <= now);
+                --dueCount;
+            }
+            ASSERT(!dueCount);
+        }
+        }
+    }
+    while (timerwheel_poll(&wheel, UINT64_MAX))
+        ;
+    ASSERT(!wheel.length);
+
+    timerwheel_destroy(&wheel);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,64 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "circbuf.h"
+#include "idxpyr.h"
+
+/* Hierarchical timing wheel for many timeouts, e.g. one per connection. Level l has
+   TIMERWHEEL_SLOT_COUNT slots of 2^(l * TIMERWHEEL_LEVEL_BITS) ticks each; a timer goes
+   to the level of the highest digit in which its deadline differs from the wheel's
+   time, so no slot ever wraps around. Every slot is a circbuf_t bucket of timer
+   pointers and every level has an idxpyr_t of its non-empty slots -- poll jumps from
+   one non-empty slot to the next, so a big step in time costs the occupied slots on
+   the way, not the ticks. A drained higher level slot cascades its timers down.
+
+   schedule and cancel are O(1) (amortized -- buckets grow like circbuf_dynamicPut):
+   a timer remembers its bucket and position, and cancel moves the newest timer of the
+   bucket into the hole. Timers are owned by the caller; zeroed ones are idle. */
+
+#define TIMERWHEEL_LEVEL_BITS 6
+#define TIMERWHEEL_SLOT_COUNT (1 << TIMERWHEEL_LEVEL_BITS)
+#define TIMERWHEEL_LEVEL_COUNT ((64 + TIMERWHEEL_LEVEL_BITS - 1) / TIMERWHEEL_LEVEL_BITS)
+// all slots plus one bucket for due timers not yet handed out by poll
+#define TIMERWHEEL_BUCKET_COUNT (TIMERWHEEL_LEVEL_COUNT * TIMERWHEEL_SLOT_COUNT + 1)
+
+typedef struct {
+    uint64_t deadline;
+    void *data; // for the caller
+    size_t bucket; // 0 if idle, otherwise the bucket index + 1
+    size_t position; // in the bucket's array
+} timerwheel_timer_t;
+
+typedef struct {
+    uint64_t now;
+    idxpyr_t occupied[TIMERWHEEL_LEVEL_COUNT];
+    circbuf_t *buckets;
+    size_t length; // scheduled timers, due ones included
+} timerwheel_t;
+
+// -1 with errno ENOMEM
+int timerwheel_init(timerwheel_t *wheel, uint64_t now);
+
+// a scheduled timer is moved; a deadline that is not after the wheel's time is due at
+// the next poll
+void timerwheel_schedule(timerwheel_t *wheel, timerwheel_timer_t *timer, uint64_t deadline);
+// no-op for idle timers
+void timerwheel_cancel(timerwheel_t *wheel, timerwheel_timer_t *timer);
+bool timerwheel_isScheduled(const timerwheel_timer_t *timer);
+
+// advances the wheel to now (never back) and returns one due timer, NULL if there is
+// none; the returned timer is idle again
+timerwheel_timer_t *timerwheel_poll(timerwheel_t *wheel, uint64_t now);
+// no timer is due before the returned time -- exact for deadlines less than
+// TIMERWHEEL_SLOT_COUNT ticks ahead; UINT64_MAX if nothing is scheduled
+uint64_t timerwheel_nextDeadline(timerwheel_t *wheel);
+
+// the timers themselves belong to the caller
+void timerwheel_destroy(timerwheel_t *wheel);
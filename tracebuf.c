@@ -0,0 +1,432 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#include "tracebuf.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "utilMacros.h"
+#include "unittestMacros.h"
+
+// private declarations
+// -----------------------------------------------------------------------------
+#define STAMP_STATE_MASK (((size_t) 1 << TRACEBUF_STATE_BITS) - 1)
+#define STAMP_WRITER_COUNT_MASK ((((size_t) 1 << TRACEBUF_WRITER_COUNT_BITS) - 1) << TRACEBUF_STATE_BITS)
+#define STAMP_WRITER_ONE ((size_t) 1 << TRACEBUF_STATE_BITS)
+
+/* Record bytes are copied word wise with relaxed atomics: the reader races with writers
+   by design (seqlock), and plain memcpy would make that race undefined. */
+static atomic_size_t *getStamp(tracebuf_t *buf, size_t pos);
+static void storeRecord(atomic_size_t *words, const uint8_t *record, size_t size);
+static void loadRecord(uint8_t *record, atomic_size_t *words, size_t size);
+static inline size_t getStampPosition(size_t stamp);
+// 0 if the slot is already past pos, otherwise the claimed stamp; isDirty is set if an
+// older writer is still storing into the slot
+static size_t claimSlot(atomic_size_t *stamp, size_t pos, bool *isDirty);
+// publishes the record if the slot is still ours, otherwise only leaves it
+static void releaseSlot(atomic_size_t *stamp, size_t pos, size_t claimed, bool isDirty);
+
+// interface functions
+// -----------------------------------------------------------------------------
+int tracebuf_init(tracebuf_t *buf, unsigned int capacityLog2, size_t recordSize) {
+    // stamps keep the position shifted by TRACEBUF_POSITION_SHIFT
+    assert(capacityLog2 < sizeof(size_t) * 8 - TRACEBUF_POSITION_SHIFT - 4);
+    assert(recordSize > 0);
+
+    size_t capacity = (size_t) 1 << capacityLog2;
+    size_t wordCount = (recordSize + sizeof(size_t) - 1) / sizeof(size_t);
+    size_t slotStride = (1 + wordCount) * sizeof(atomic_size_t);
+    uint8_t *slots = malloc(slotStride * capacity);
+    if (!slots) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t i = 0; i < capacity; ++i) {
+        atomic_size_t *slot = (atomic_size_t *) (slots + i * slotStride);
+        for (size_t j = 0; j < 1 + wordCount; ++j)
+            atomic_init(slot + j, 0);
+    }
+
+    atomic_init(&buf->end, 0);
+    buf->slots = slots;
+    buf->slotStride = slotStride;
+    buf->recordSize = recordSize;
+    buf->capacityLog2 = capacityLog2;
+    buf->rotationMask = capacity - 1;
+    return 0;
+}
+
+void tracebuf_put(tracebuf_t *buf, const void *record) {
+    size_t pos = atomic_fetch_add_explicit(&buf->end, 1, memory_order_relaxed);
+    atomic_size_t *stamp = getStamp(buf, pos);
+    bool isDirty;
+    size_t claimed = claimSlot(stamp, pos, &isDirty);
+    if (!claimed)
+        return; // lapped before we even started - the record is simply lost
+
+    storeRecord(stamp + 1, record, buf->recordSize);
+    releaseSlot(stamp, pos, claimed, isDirty);
+}
+
+tracebuf_cursor_t tracebuf_makeCursor(tracebuf_t *buf) {
+    size_t end = atomic_load_explicit(&buf->end, memory_order_acquire);
+    size_t capacity = buf->rotationMask + 1;
+    return (tracebuf_cursor_t) { .next = end > capacity ? end - capacity : 0 };
+}
+
+size_t tracebuf_read(tracebuf_t *buf, tracebuf_cursor_t *cursor, void *out, size_t maxCount) {
+    size_t end = atomic_load_explicit(&buf->end, memory_order_acquire);
+    size_t capacity = buf->rotationMask + 1;
+    if (end - cursor->next > capacity) {
+        cursor->lostCount += end - capacity - cursor->next;
+        cursor->next = end - capacity;
+    }
+
+    uint8_t *o = out;
+    size_t count = 0;
+    while (count < maxCount && cursor->next != end) {
+        size_t pos = cursor->next;
+        atomic_size_t *stamp = getStamp(buf, pos);
+        size_t before = atomic_load_explicit(stamp, memory_order_acquire);
+        size_t stampPos = getStampPosition(before);
+        if (stampPos < pos || (stampPos == pos && (before & STAMP_STATE_MASK) < TRACEBUF_STATE_DONE))
+            break; // reserved, but not written yet
+
+        ++cursor->next;
+        if (stampPos > pos) {
+            ++cursor->lostCount;
+            continue;
+        }
+        if ((before & STAMP_STATE_MASK) == TRACEBUF_STATE_TORN) {
+            ++cursor->tornCount;
+            continue;
+        }
+
+        loadRecord(o, stamp + 1, buf->recordSize);
+        // the record loads can't move below the second stamp check
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(stamp, memory_order_relaxed) != before) {
+            ++cursor->lostCount; // overwritten while we were copying
+            continue;
+        }
+        o += buf->recordSize;
+        ++count;
+    }
+    return count;
+}
+
+void tracebuf_destroy(tracebuf_t *buf) {
+    free(buf->slots);
+    buf->slots = NULL;
+}
+
+// private functions
+// -----------------------------------------------------------------------------
+static atomic_size_t *getStamp(tracebuf_t *buf, size_t pos) {
+    return (atomic_size_t *) (buf->slots + (pos & buf->rotationMask) * buf->slotStride);
+}
+
+static void storeRecord(atomic_size_t *words, const uint8_t *record, size_t size) {
+    for (size_t i = 0; i < size; i += sizeof(size_t)) {
+        size_t word = 0;
+        memcpy(&word, record + i, size - i < sizeof(size_t) ? size - i : sizeof(size_t));
+        atomic_store_explicit(words + i / sizeof(size_t), word, memory_order_relaxed);
+    }
+}
+
+static void loadRecord(uint8_t *record, atomic_size_t *words, size_t size) {
+    for (size_t i = 0; i < size; i += sizeof(size_t)) {
+        size_t word = atomic_load_explicit(words + i / sizeof(size_t), memory_order_relaxed);
+        memcpy(record + i, &word, size - i < sizeof(size_t) ? size - i : sizeof(size_t));
+    }
+}
+
+static inline size_t getStampPosition(size_t stamp) {
+    return stamp >> TRACEBUF_POSITION_SHIFT;
+}
+
+static size_t claimSlot(atomic_size_t *stamp, size_t pos, bool *isDirty) {
+    size_t current = atomic_load_explicit(stamp, memory_order_relaxed);
+    size_t claimed;
+    do {
+        if (getStampPosition(current) > pos)
+            return 0;
+        assert((current & STAMP_WRITER_COUNT_MASK) != STAMP_WRITER_COUNT_MASK);
+        claimed = pos << TRACEBUF_POSITION_SHIFT | ((current & STAMP_WRITER_COUNT_MASK) + STAMP_WRITER_ONE)
+            | TRACEBUF_STATE_WRITING;
+        // acquire: the bytes of writers that already left are ordered before ours
+    } while (!atomic_compare_exchange_weak_explicit(stamp, &current, claimed,
+                memory_order_acquire, memory_order_relaxed));
+    // the stamp has to be visible before any of the record bytes
+    atomic_thread_fence(memory_order_release);
+
+    // older writers can't join anymore, but the ones still copying may overwrite our
+    // bytes until they leave
+    *isDirty = current & STAMP_WRITER_COUNT_MASK;
+    return claimed;
+}
+
+static void releaseSlot(atomic_size_t *stamp, size_t pos, size_t claimed, bool isDirty) {
+    size_t current = claimed;
+    size_t released;
+    do {
+        size_t left = current - STAMP_WRITER_ONE;
+        if (getStampPosition(current) == pos) {
+            size_t state = isDirty ? TRACEBUF_STATE_TORN : TRACEBUF_STATE_DONE;
+            released = (left & ~STAMP_STATE_MASK) | state;
+        } else {
+            // taken over by a newer lap while we were copying -- its owner is dirty
+            // because of us and won't publish "done"
+            released = left;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(stamp, &current, released,
+                memory_order_release, memory_order_relaxed));
+}
+
+// unittest
+// -----------------------------------------------------------------------------
+#ifdef UNITTEST
+#include <pthread.h>
+
+typedef struct {
+    uint64_t writer;
+    uint64_t seq;
+    uint64_t check;
+} tracebufTestRecord_t;
+
+static tracebufTestRecord_t tracebufTestMakeRecord(uint64_t writer, uint64_t seq) {
+    return (tracebufTestRecord_t) { writer, seq, writer * 0x9e3779b97f4a7c15u ^ seq };
+}
+
+int tracebufInit(void) {
+    tracebuf_t buf;
+    ASSERT(!tracebuf_init(&buf, 3, 5));
+    ASSERT(buf.slots);
+    ASSERT(buf.rotationMask == 0x7);
+    ASSERT(buf.slotStride == 2 * sizeof(size_t));
+    tracebuf_cursor_t cursor = tracebuf_makeCursor(&buf);
+    uint8_t out[5];
+    ASSERT(tracebuf_read(&buf, &cursor, out, 1) == 0);
+
+    tracebuf_destroy(&buf);
+    return 0;
+}
+
+int tracebufReadReturnsRecordsInOrder(void) {
+    tracebuf_t buf;
+    tracebuf_init(&buf, 3, sizeof(tracebufTestRecord_t));
+    for (uint64_t i = 0; i < 5; ++i) {
+        tracebufTestRecord_t r = tracebufTestMakeRecord(1, i);
+        tracebuf_put(&buf, &r);
+    }
+
+    tracebufTestRecord_t out[8];
+    tracebuf_cursor_t cursor = tracebuf_makeCursor(&buf);
+    ASSERT(tracebuf_read(&buf, &cursor, out, 2) == 2);
+    ASSERT(tracebuf_read(&buf, &cursor, out + 2, 8) == 3);
+    for (uint64_t i = 0; i < 5; ++i) {
+        tracebufTestRecord_t expected = tracebufTestMakeRecord(1, i);
+        ASSERT(!memcmp(out + i, &expected, sizeof(expected)));
+    }
+    ASSERT(tracebuf_read(&buf, &cursor, out, 8) == 0);
+    ASSERT(!cursor.lostCount && !cursor.tornCount);
+
+    tracebuf_destroy(&buf);
+    return 0;
+}
+
+int tracebufOverwritesOldest(void) {
+    tracebuf_t buf;
+    tracebuf_init(&buf, 2, sizeof(uint32_t));
+    tracebuf_cursor_t cursor = tracebuf_makeCursor(&buf);
+    for (uint32_t i = 0; i < 10; ++i)
+        tracebuf_put(&buf, &i);
+
+    uint32_t out[4];
+    ASSERT(tracebuf_read(&buf, &cursor, out, 4) == 4);
+    ASSERT(cursor.lostCount == 6);
+    for (uint32_t i = 0; i < 4; ++i)
+        ASSERT(out[i] == 6 + i);
+
+    tracebuf_cursor_t fresh = tracebuf_makeCursor(&buf);
+    ASSERT(fresh.next == 6);
+
+    tracebuf_destroy(&buf);
+    return 0;
+}
+
+int tracebufReadStopsAtUnfinishedRecord(void) {
+    tracebuf_t buf;
+    tracebuf_init(&buf, 3, sizeof(uint32_t));
+    uint32_t v = 1;
+    tracebuf_put(&buf, &v);
+    // a writer that reserved position 1 but didn't stamp it yet
+    atomic_fetch_add(&buf.end, 1);
+    tracebuf_put(&buf, &v);
+
+    uint32_t out[4];
+    tracebuf_cursor_t cursor = tracebuf_makeCursor(&buf);
+    ASSERT(tracebuf_read(&buf, &cursor, out, 4) == 1);
+    ASSERT(cursor.next == 1);
+
+    tracebuf_destroy(&buf);
+    return 0;
+}
+
+int tracebufDetectsTornAndLappedSlots(void) {
+    tracebuf_t buf;
+    tracebuf_init(&buf, 2, sizeof(uint32_t));
+    for (uint32_t i = 0; i < 4; ++i)
+        tracebuf_put(&buf, &i);
+    // slot 1 torn by a lapped writer, slot 2 already claimed by the next lap
+    atomic_store(getStamp(&buf, 1), (size_t) 1 << TRACEBUF_POSITION_SHIFT | TRACEBUF_STATE_TORN);
+    atomic_store(getStamp(&buf, 2),
+            (size_t) 6 << TRACEBUF_POSITION_SHIFT | STAMP_WRITER_ONE | TRACEBUF_STATE_WRITING);
+
+    uint32_t out[4];
+    tracebuf_cursor_t cursor = tracebuf_makeCursor(&buf);
+    ASSERT(tracebuf_read(&buf, &cursor, out, 4) == 2);
+    ASSERT(out[0] == 0 && out[1] == 3);
+    ASSERT(cursor.tornCount == 1);
+    ASSERT(cursor.lostCount == 1);
+
+    tracebuf_destroy(&buf);
+    return 0;
+}
+
+int tracebufLateWriterMarksSlotTorn(void) {
+    tracebuf_t buf;
+    tracebuf_init(&buf, 1, sizeof(uint32_t));
+    const size_t torn3 = (size_t) 3 << TRACEBUF_POSITION_SHIFT | TRACEBUF_STATE_TORN;
+    // the owner of position 1 is still copying when position 3 takes the slot over
+    atomic_size_t *stamp = getStamp(&buf, 1);
+    bool isDirty;
+    size_t claimed1 = claimSlot(stamp, 1, &isDirty);
+    ASSERT(claimed1 && !isDirty);
+    size_t claimed3 = claimSlot(stamp, 3, &isDirty);
+    ASSERT(claimed3 && isDirty);
+    releaseSlot(stamp, 3, claimed3, isDirty);
+    ASSERT(atomic_load(stamp) == (torn3 | STAMP_WRITER_ONE));
+    releaseSlot(stamp, 1, claimed1, false);
+    ASSERT(atomic_load(stamp) == torn3);
+
+    // writers that find a newer stamp drop their record
+    atomic_store(&buf.end, 1);
+    uint32_t v = 7;
+    tracebuf_put(&buf, &v);
+    ASSERT(atomic_load(stamp) == torn3);
+
+    tracebuf_destroy(&buf);
+    return 0;
+}
+
+int tracebufLappedWriterCannotCorruptDoneRecord(void) {
+    tracebuf_t buf;
+    tracebuf_init(&buf, 1, sizeof(uint32_t));
+    // writer A reserves position 0 and claims the slot
+    size_t posA = atomic_fetch_add(&buf.end, 1);
+    atomic_size_t *stamp = getStamp(&buf, posA);
+    bool isDirtyA;
+    size_t claimedA = claimSlot(stamp, posA, &isDirtyA);
+    ASSERT(claimedA);
+
+    // meanwhile position 1 is written, and writer B takes slot 0 over for position 2
+    uint32_t v = 1;
+    tracebuf_put(&buf, &v);
+    v = 0xbbbb;
+    tracebuf_put(&buf, &v);
+
+    // A's late bytes land in B's record before A leaves
+    uint32_t late = 0xaaaa;
+    storeRecord(stamp + 1, (const uint8_t *) &late, sizeof(late));
+    uint32_t out[4];
+    tracebuf_cursor_t cursor = tracebuf_makeCursor(&buf);
+    ASSERT(tracebuf_read(&buf, &cursor, out, 4) == 1);
+    ASSERT(out[0] == 1);
+    ASSERT(cursor.tornCount == 1);
+    releaseSlot(stamp, posA, claimedA, isDirtyA);
+
+    // once A has left, the slot is clean again
+    v = 3;
+    tracebuf_put(&buf, &v);
+    v = 4;
+    tracebuf_put(&buf, &v);
+    ASSERT(tracebuf_read(&buf, &cursor, out, 4) == 2);
+    ASSERT(out[0] == 3 && out[1] == 4);
+    ASSERT(cursor.tornCount == 1);
+
+    tracebuf_destroy(&buf);
+    return 0;
+}
+
+#define TRACEBUF_TEST_WRITER_COUNT 4
+#define TRACEBUF_TEST_RECORDS_PER_WRITER 50000
+
+typedef struct {
+    tracebuf_t *buf;
+    uint64_t writer;
+} tracebufTestArg_t;
+
+static void *tracebufTestWriter(void *p) {
+    tracebufTestArg_t *arg = p;
+    for (uint64_t i = 0; i < TRACEBUF_TEST_RECORDS_PER_WRITER; ++i) {
+        tracebufTestRecord_t r = tracebufTestMakeRecord(arg->writer, i);
+        tracebuf_put(arg->buf, &r);
+    }
+    return NULL;
+}
+
+static int tracebufTestCheck(tracebufTestRecord_t *records, size_t n, uint64_t *lastSeq) {
+    for (size_t i = 0; i < n; ++i) {
+        tracebufTestRecord_t *r = records + i;
+        ASSERT(r->writer < TRACEBUF_TEST_WRITER_COUNT);
+        ASSERT(r->check == tracebufTestMakeRecord(r->writer, r->seq).check);
+        // per writer order survives even with drops
+        ASSERT(lastSeq[r->writer] == UINT64_MAX || r->seq > lastSeq[r->writer]);
+        lastSeq[r->writer] = r->seq;
+    }
+    return 0;
+}
+
+int tracebufConcurrentWritersNeverTearReadRecords(void) {
+    tracebuf_t buf;
+    tracebuf_init(&buf, 6, sizeof(tracebufTestRecord_t));
+    tracebuf_cursor_t cursor = tracebuf_makeCursor(&buf);
+    pthread_t threads[TRACEBUF_TEST_WRITER_COUNT];
+    tracebufTestArg_t args[TRACEBUF_TEST_WRITER_COUNT];
+    for (uint64_t i = 0; i < TRACEBUF_TEST_WRITER_COUNT; ++i) {
+        args[i] = (tracebufTestArg_t) { .buf = &buf, .writer = i };
+        ASSERT(!pthread_create(threads + i, NULL, tracebufTestWriter, args + i));
+    }
+
+    uint64_t lastSeq[TRACEBUF_TEST_WRITER_COUNT];
+    for (size_t i = 0; i < TRACEBUF_TEST_WRITER_COUNT; ++i)
+        lastSeq[i] = UINT64_MAX;
+    tracebufTestRecord_t out[16];
+    size_t readCount = 0;
+    size_t total = TRACEBUF_TEST_WRITER_COUNT * TRACEBUF_TEST_RECORDS_PER_WRITER;
+    while (atomic_load(&buf.end) < total) {
+        size_t n = tracebuf_read(&buf, &cursor, out, ARRAY_LENGTH(out));
+        ASSERT(!tracebufTestCheck(out, n, lastSeq));
+        readCount += n;
+    }
+    for (size_t i = 0; i < TRACEBUF_TEST_WRITER_COUNT; ++i)
+        pthread_join(threads[i], NULL);
+
+    size_t n;
+    while ((n = tracebuf_read(&buf, &cursor, out, ARRAY_LENGTH(out)))) {
+        ASSERT(!tracebufTestCheck(out, n, lastSeq));
+        readCount += n;
+    }
+    ASSERT(cursor.next == total);
+    ASSERT(readCount + cursor.lostCount + cursor.tornCount == total);
+
+    tracebuf_destroy(&buf);
+    return 0;
+}
+
+#endif
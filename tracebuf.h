@@ -0,0 +1,60 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "circbufSpsc.h"
+
+/* Lossy ring for high rate tracing: writers never block or fail, the oldest records
+   are overwritten instead. Any number of writers reserve a position with a single
+   fetch-add. Every slot is stamped with (position << TRACEBUF_POSITION_SHIFT |
+   writerCount << TRACEBUF_STATE_BITS | state); the reader copies a record and accepts it
+   only if the stamp says "done" for the expected position before and after the copy.
+   writerCount counts the writers still storing into the slot, lapped ones included --
+   a writer that takes a slot over while an older one is active publishes "torn", as
+   the late bytes may land in its record. Records that were overwritten or torn are
+   counted instead of returned. */
+
+#define TRACEBUF_STATE_WRITING 1
+#define TRACEBUF_STATE_DONE 2
+#define TRACEBUF_STATE_TORN 3
+
+#define TRACEBUF_STATE_BITS 2
+// writers on the same slot at once, i.e. lapped mid copy up to 63 times in a row
+#define TRACEBUF_WRITER_COUNT_BITS 6
+#define TRACEBUF_POSITION_SHIFT (TRACEBUF_STATE_BITS + TRACEBUF_WRITER_COUNT_BITS)
+
+typedef struct {
+    _Alignas(CIRCBUF_CACHE_LINE_SIZE) atomic_size_t end;
+
+    // constant after init
+    _Alignas(CIRCBUF_CACHE_LINE_SIZE) uint8_t *slots;
+    size_t slotStride;
+    size_t recordSize;
+    unsigned int capacityLog2;
+    size_t rotationMask;
+} tracebuf_t;
+
+// reader position - start with tracebuf_makeCursor()
+typedef struct {
+    size_t next;
+    size_t lostCount; // overwritten before they were read
+    size_t tornCount; // trampled by a lapped writer
+} tracebuf_cursor_t;
+
+int tracebuf_init(tracebuf_t *buf, unsigned int capacityLog2, size_t recordSize);
+void tracebuf_put(tracebuf_t *buf, const void *record);
+
+// cursor at the oldest record that's still in the buffer
+tracebuf_cursor_t tracebuf_makeCursor(tracebuf_t *buf);
+// copies up to maxCount consistent records into out and advances the cursor; stops at
+// the first record that is still being written
+size_t tracebuf_read(tracebuf_t *buf, tracebuf_cursor_t *cursor, void *out, size_t maxCount);
+
+void tracebuf_destroy(tracebuf_t *buf);
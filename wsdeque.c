@@ -0,0 +1,236 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#include "wsdeque.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+#include "unittestMacros.h"
+
+// private declarations
+// -----------------------------------------------------------------------------
+static wsdeque_array_t *makeArray(unsigned int capacityLog2);
+static wsdeque_array_t *grow(wsdeque_t *dq, wsdeque_array_t *array, int64_t top, int64_t bottom);
+
+// interface functions
+// -----------------------------------------------------------------------------
+void wsdeque_init(wsdeque_t *dq, unsigned int capacityLog2) {
+    atomic_init(&dq->top, 0);
+    atomic_init(&dq->bottom, 0);
+    atomic_init(&dq->array, makeArray(capacityLog2));
+}
+
+void wsdeque_push(wsdeque_t *dq, void *elem) {
+    int64_t bottom = atomic_load_explicit(&dq->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&dq->top, memory_order_acquire);
+    wsdeque_array_t *array = atomic_load_explicit(&dq->array, memory_order_relaxed);
+    if ((size_t) (bottom - top) > array->rotationMask)
+        array = grow(dq, array, top, bottom);
+
+    atomic_store_explicit(array->a + ((size_t) bottom & array->rotationMask), elem, memory_order_relaxed);
+    atomic_store_explicit(&dq->bottom, bottom + 1, memory_order_release);
+}
+
+bool wsdeque_pop(wsdeque_t *dq, void **elemOut) {
+    int64_t bottom = atomic_load_explicit(&dq->bottom, memory_order_relaxed) - 1;
+    wsdeque_array_t *array = atomic_load_explicit(&dq->array, memory_order_relaxed);
+    // seq_cst store/load pair keeps the bottom decrement ordered before reading top
+    atomic_store_explicit(&dq->bottom, bottom, memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&dq->top, memory_order_seq_cst);
+
+    if (top > bottom) {
+        atomic_store_explicit(&dq->bottom, bottom + 1, memory_order_relaxed);
+        return false;
+    }
+
+    *elemOut = atomic_load_explicit(array->a + ((size_t) bottom & array->rotationMask), memory_order_relaxed);
+    if (top < bottom)
+        return true;
+
+    // last element -- race against stealers
+    bool isWon = atomic_compare_exchange_strong_explicit(&dq->top, &top, top + 1,
+            memory_order_seq_cst, memory_order_relaxed);
+    atomic_store_explicit(&dq->bottom, bottom + 1, memory_order_relaxed);
+    return isWon;
+}
+
+bool wsdeque_steal(wsdeque_t *dq, void **elemOut) {
+    int64_t top = atomic_load_explicit(&dq->top, memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&dq->bottom, memory_order_seq_cst);
+    if (top >= bottom)
+        return false;
+
+    wsdeque_array_t *array = atomic_load_explicit(&dq->array, memory_order_acquire);
+    void *elem = atomic_load_explicit(array->a + ((size_t) top & array->rotationMask), memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&dq->top, &top, top + 1,
+                memory_order_seq_cst, memory_order_relaxed))
+        return false;
+
+    *elemOut = elem;
+    return true;
+}
+
+size_t wsdeque_length(wsdeque_t *dq) {
+    int64_t top = atomic_load_explicit(&dq->top, memory_order_acquire);
+    int64_t bottom = atomic_load_explicit(&dq->bottom, memory_order_acquire);
+    return bottom > top ? (size_t) (bottom - top) : 0;
+}
+
+void wsdeque_destroy(wsdeque_t *dq) {
+    wsdeque_array_t *array = atomic_load_explicit(&dq->array, memory_order_relaxed);
+    while (array) {
+        wsdeque_array_t *previous = array->previous;
+        free(array);
+        array = previous;
+    }
+    atomic_store_explicit(&dq->array, NULL, memory_order_relaxed);
+}
+
+// private functions
+// -----------------------------------------------------------------------------
+static wsdeque_array_t *makeArray(unsigned int capacityLog2) {
+    const unsigned int ptrSizeLog2 = 1 + sizeof(void *) / 4;
+    const unsigned int addressablePtrCountLog2 = sizeof(size_t) * 8 - ptrSizeLog2;
+    assert(capacityLog2 < addressablePtrCountLog2);
+
+    size_t capacity = (size_t) 1 << capacityLog2;
+    wsdeque_array_t *array = malloc(sizeof(wsdeque_array_t) + sizeof(void *) * capacity);
+    array->previous = NULL;
+    array->capacityLog2 = capacityLog2;
+    array->rotationMask = capacity - 1;
+    return array;
+}
+
+static wsdeque_array_t *grow(wsdeque_t *dq, wsdeque_array_t *array, int64_t top, int64_t bottom) {
+    wsdeque_array_t *bigger = makeArray(array->capacityLog2 + 1);
+    bigger->previous = array;
+    for (int64_t i = top; i < bottom; ++i) {
+        void *elem = atomic_load_explicit(array->a + ((size_t) i & array->rotationMask), memory_order_relaxed);
+        atomic_store_explicit(bigger->a + ((size_t) i & bigger->rotationMask), elem, memory_order_relaxed);
+    }
+    atomic_store_explicit(&dq->array, bigger, memory_order_release);
+    return bigger;
+}
+
+// unittest
+// -----------------------------------------------------------------------------
+#ifdef UNITTEST
+#include <pthread.h>
+
+int wsdequePopIsLifo(void) {
+    double foo[3];
+    wsdeque_t dq;
+    wsdeque_init(&dq, 2);
+    for (int i = 0; i < 3; ++i)
+        wsdeque_push(&dq, foo + i);
+    void *elem;
+    for (int i = 2; i >= 0; --i) {
+        ASSERT(wsdeque_pop(&dq, &elem));
+        ASSERT(elem == foo + i);
+    }
+    ASSERT(!wsdeque_pop(&dq, &elem));
+
+    wsdeque_destroy(&dq);
+    return 0;
+}
+
+int wsdequeStealIsFifo(void) {
+    double foo[3];
+    wsdeque_t dq;
+    wsdeque_init(&dq, 2);
+    for (int i = 0; i < 3; ++i)
+        wsdeque_push(&dq, foo + i);
+    void *elem;
+    for (int i = 0; i < 3; ++i) {
+        ASSERT(wsdeque_steal(&dq, &elem));
+        ASSERT(elem == foo + i);
+    }
+    ASSERT(!wsdeque_steal(&dq, &elem));
+
+    wsdeque_destroy(&dq);
+    return 0;
+}
+
+int wsdequePushGrowsAndKeepsElements(void) {
+    wsdeque_t dq;
+    wsdeque_init(&dq, 1);
+    void *elem;
+    // move top away from 0 so the grown copy has to wrap
+    wsdeque_push(&dq, NULL);
+    wsdeque_steal(&dq, &elem);
+    for (size_t i = 0; i < 9; ++i)
+        wsdeque_push(&dq, (void *) i);
+    ASSERT(atomic_load(&dq.array)->capacityLog2 == 4);
+    ASSERT(wsdeque_length(&dq) == 9);
+
+    ASSERT(wsdeque_steal(&dq, &elem) && elem == (void *) 0);
+    ASSERT(wsdeque_pop(&dq, &elem) && elem == (void *) 8);
+
+    wsdeque_destroy(&dq);
+    return 0;
+}
+
+#define WSDEQUE_TEST_ELEMENT_COUNT 50000
+#define WSDEQUE_TEST_THIEF_COUNT 3
+
+typedef struct {
+    wsdeque_t *dq;
+    atomic_bool *isDone;
+    size_t sum;
+    size_t count;
+} wsdequeTestThief_t;
+
+static void *wsdequeTestThief(void *p) {
+    wsdequeTestThief_t *thief = p;
+    while (true) {
+        bool isDone = atomic_load(thief->isDone);
+        void *elem;
+        if (wsdeque_steal(thief->dq, &elem)) {
+            thief->sum += (size_t) elem;
+            ++thief->count;
+        } else if (isDone && !wsdeque_length(thief->dq)) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+int wsdequeConcurrentStealLosesNothing(void) {
+    wsdeque_t dq;
+    wsdeque_init(&dq, 2);
+    atomic_bool isDone;
+    atomic_init(&isDone, false);
+    pthread_t threads[WSDEQUE_TEST_THIEF_COUNT];
+    wsdequeTestThief_t thieves[WSDEQUE_TEST_THIEF_COUNT];
+    for (size_t i = 0; i < WSDEQUE_TEST_THIEF_COUNT; ++i) {
+        thieves[i] = (wsdequeTestThief_t) { .dq = &dq, .isDone = &isDone };
+        ASSERT(!pthread_create(threads + i, NULL, wsdequeTestThief, thieves + i));
+    }
+
+    size_t sum = 0, count = 0;
+    for (size_t i = 1; i <= WSDEQUE_TEST_ELEMENT_COUNT; ++i) {
+        wsdeque_push(&dq, (void *) i);
+        void *elem;
+        if (i % 3 == 0 && wsdeque_pop(&dq, &elem)) {
+            sum += (size_t) elem;
+            ++count;
+        }
+    }
+    atomic_store(&isDone, true);
+    for (size_t i = 0; i < WSDEQUE_TEST_THIEF_COUNT; ++i) {
+        pthread_join(threads[i], NULL);
+        sum += thieves[i].sum;
+        count += thieves[i].count;
+    }
+
+    size_t n = WSDEQUE_TEST_ELEMENT_COUNT;
+    ASSERT(count == n);
+    ASSERT(sum == n * (n + 1) / 2);
+
+    wsdeque_destroy(&dq);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * Copyright:  Copyright Johannes Teichrieb 2015
+ * License:    opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "circbufSpsc.h"
+
+/* Chase-Lev work stealing deque. The owner pushes and pops at the bottom (LIFO), any
+   other thread may steal from the top (FIFO). Storage is a power of two ring like
+   circbuf_t that doubles when full; replaced arrays are kept until destroy, because a
+   concurrent steal might still read from them. */
+
+typedef struct wsdeque_array_t {
+    struct wsdeque_array_t *previous;
+    unsigned int capacityLog2;
+    size_t rotationMask;
+    _Atomic(void *) a[];
+} wsdeque_array_t;
+
+typedef struct {
+    _Alignas(CIRCBUF_CACHE_LINE_SIZE) _Atomic int64_t top;
+    _Alignas(CIRCBUF_CACHE_LINE_SIZE) _Atomic int64_t bottom;
+    _Atomic(wsdeque_array_t *) array;
+} wsdeque_t;
+
+void wsdeque_init(wsdeque_t *dq, unsigned int capacityLog2);
+
+// owner only
+void wsdeque_push(wsdeque_t *dq, void *elem);
+bool wsdeque_pop(wsdeque_t *dq, void **elemOut);
+// any thread; returns false if the deque is empty or another thread won the race
+bool wsdeque_steal(wsdeque_t *dq, void **elemOut);
+// snapshot
+size_t wsdeque_length(wsdeque_t *dq);
+
+void wsdeque_destroy(wsdeque_t *dq);